@@ -26,10 +26,28 @@
 #define _GUSMap
 
 
-SEXP ll_fs_scaled_err_c(SEXP r, SEXP Kaa, SEXP Kab, SEXP Kbb, SEXP OPGP, SEXP nInd, SEXP nSnps);
-SEXP ll_fs_ss_scaled_err_c(SEXP r, SEXP Kaa, SEXP Kab, SEXP Kbb, SEXP OPGP, SEXP nInd, SEXP nSnps);
-SEXP ll_fs_up_ss_scaled_err_c(SEXP r, SEXP Kaa, SEXP Kab, SEXP Kbb, SEXP config, SEXP nInd, SEXP nSnps);
+SEXP ll_fs_scaled_err_c(SEXP r, SEXP Kaa, SEXP Kab, SEXP Kbb, SEXP OPGP, SEXP nInd, SEXP nSnps, SEXP nThreads);
+SEXP ll_fs_ss_scaled_err_c(SEXP r, SEXP Kaa, SEXP Kab, SEXP Kbb, SEXP OPGP, SEXP nInd, SEXP nSnps, SEXP nThreads);
+SEXP ll_fs_up_ss_scaled_err_c(SEXP r, SEXP Kaa, SEXP Kab, SEXP Kbb, SEXP config, SEXP nInd, SEXP nSnps, SEXP nThreads);
 SEXP EM_HMM(SEXP r, SEXP ep, SEXP depth_Ref, SEXP depth_Alt, SEXP OPGP, SEXP noFam, SEXP nInd, SEXP nSnps, SEXP sexSpec, SEXP seqError, SEXP para, SEXP ss_rf);
 SEXP EM_HMM_UP(SEXP r, SEXP ep, SEXP depth_Ref, SEXP depth_Alt, SEXP config, SEXP noFam, SEXP nInd, SEXP nSnps, SEXP seqError, SEXP para, SEXP ss_rf);
+SEXP EM_batch(SEXP jobs, SEXP para);
+SEXP EM_memory(SEXP nInd, SEXP nSnps, SEXP maxDepth, SEXP nCells, SEXP para);
+SEXP ll_HMM(SEXP r, SEXP ep, SEXP depth_Ref, SEXP depth_Alt, SEXP geno, SEXP noFam, SEXP nInd, SEXP nSnps, SEXP phased, SEXP nThreads);
+SEXP score_HMM(SEXP r, SEXP ep, SEXP depth_Ref, SEXP depth_Alt, SEXP geno, SEXP noFam, SEXP nInd, SEXP nSnps, SEXP phased, SEXP nThreads);
+SEXP optim_HMM(SEXP r, SEXP ep, SEXP depth_Ref, SEXP depth_Alt, SEXP geno, SEXP noFam, SEXP nInd, SEXP nSnps, SEXP phased, SEXP sexSpec, SEXP seqError, SEXP para, SEXP ss_rf);
+SEXP FSmodel_create(SEXP r, SEXP ep, SEXP depth_Ref, SEXP depth_Alt, SEXP OPGP, SEXP noFam, SEXP nInd, SEXP nSnps, SEXP nThreads);
+SEXP FSmodel_info(SEXP model);
+SEXP FSmodel_drop(SEXP model, SEXP snp, SEXP sexSpec, SEXP update);
+SEXP FSmodel_insert(SEXP model, SEXP pos, SEXP depth_Ref, SEXP depth_Alt, SEXP OPGP, SEXP sexSpec, SEXP update);
+SEXP FSmodel_order(SEXP model, SEXP para, SEXP sexSpec);
+SEXP rf_2pt(SEXP ep, SEXP depth_Ref, SEXP depth_Alt, SEXP config, SEXP noFam, SEXP nInd, SEXP nSnps, SEXP para);
+SEXP LG_2pt(SEXP ep, SEXP depth_Ref, SEXP depth_Alt, SEXP config, SEXP noFam, SEXP nInd, SEXP nSnps, SEXP para, SEXP LODthres);
+SEXP read_vcf(SEXP file, SEXP nThreads);
+SEXP read_ra(SEXP file, SEXP format, SEXP excsamp, SEXP sampthres, SEXP nThreads);
+SEXP write_cache(SEXP file, SEXP data, SEXP format, SEXP srcFile, SEXP src);
+SEXP read_cache(SEXP file, SEXP format, SEXP srcFile, SEXP src, SEXP excsamp, SEXP sampthres, SEXP nThreads);
+SEXP RA_filter(SEXP depth_Ref, SEXP depth_Alt, SEXP prog, SEXP par, SEXP grand, SEXP filter, SEXP nThreads);
+SEXP RA_bin(SEXP chrom, SEXP pos, SEXP BIN);
 
 #endif 
@@ -22,21 +22,15 @@
 #include <Rmath.h>
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include <limits.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include <R_ext/Applic.h>
 #include "probFun.h"
 
 
-int Tcount(int s1, int s2){
-  int sSum = s1 + s2*4;
-  if((sSum == 0)|(sSum == 5)|(sSum == 10)|(sSum == 15))
-    return 0;
-  else if((sSum == 3)|(sSum == 6)|(sSum == 9)|(sSum == 12))
-    return 2;
-  else
-    return 1;
-}
-
-
 // Function for computing binomial coefficients
 // taken  from this website "https://rosettacode.org/wiki/Evaluate_binomial_coefficients#C"
 static unsigned long gcd_ui(unsigned long x, unsigned long y) {
@@ -80,155 +74,968 @@ double long binomial(int a, int b){
 }
 */
 
-// Function for computing the emission probabilities given the true genotypes
-double computeProb(double *ppAA, double *ppBB, double *pbin_coef,
-                        double epsilon, int *pdepth_Ref, int *pdepth_Alt,
-                        int nInd, int nSnps){
-  int snp, ind, indx;
-  for(ind = 0; ind < nInd; ind++){
-    for(snp = 0; snp < nSnps; snp++){
-      indx = ind + nInd * snp;
-      if( (pdepth_Ref[indx] + pdepth_Alt[indx]) == 0){
-        *ppAA = 1;
-        *ppBB = 1;
+// Function for adding the contribution of the cells of a group of individuals (lanes)
+// to the expected number of sequencing errors (sumA) and correct reads (sumB) in the E-step.
+// The posterior probability of state s is alphaTilde[s]*betaTilde[s]*w, where w = exp(log_w) is given.
+//  - pair: depth pairs of the nl individuals of the group, whose depths are in pairRef and pairAlt.
+static inline void addErrorCounts(double *alphaTilde, double *betaTilde, const double *w_exp, const int *geno,
+                                  const int *pair, const int *pairRef, const int *pairAlt, int nl,
+                                  double *sumA, double *sumB){
+  int s1, l;
+  double w[NLANE], dRef[NLANE], dAlt[NLANE], uProb;
+  const double *dA, *dB;
+  for(l = 0; l < NLANE; l++){
+    dRef[l] = (l < nl) ? pairRef[pair[l]] : 0;
+    dAlt[l] = (l < nl) ? pairAlt[pair[l]] : 0;
+    w[l] = ( (dRef[l] + dAlt[l]) == 0 ) ? 0 : w_exp[l];
+  }
+  for(s1 = 0; s1 < 4; s1++){
+    if( geno[s1] == 0 )
+      continue;
+    // reads of the other allele are errors
+    dA = (geno[s1] == 1) ? dAlt : dRef;
+    dB = (geno[s1] == 1) ? dRef : dAlt;
+    for(l = 0; l < NLANE; l++){
+      uProb = alphaTilde[s1*NLANE + l] * betaTilde[s1*NLANE + l] * w[l];
+      sumA[l] = sumA[l] + uProb * dA[l];
+      sumB[l] = sumB[l] + uProb * dB[l];
+    }
+  }
+}
+
+
+//////////// EM algorithm for the multipoint likelihood in full-sib families /////////////////////
+// The EM engine is shared between EM_HMM (phase known) and EM_HMM_UP (phase unknown).
+// The two only differ in how the emission probabilities are indexed, which is given by
+// the table of the genotype of each state (geno_OPGP or geno_config in probFun.c).
+// All the working arrays are allocated on the heap via R_alloc (and so are released by R
+// once the .Call returns) and the cells are indexed using R_xlen_t so that the number
+// of individuals times the number of SNPs is not limited to the range of an int.
+// The E-step is fused with the backward recursion, so that the posterior probabilities
+// are never stored and only the sufficient statistics of the M-step are accumulated.
+
+// Data required for the E-step
+typedef struct {
+  int noFam, nSnps, nTotal;
+  int *nInd, *indSum;       // number of individuals in each family and index of the first one
+  int *geno;                // OPGP (or config) matrix with the families as rows and SNPs as columns
+  int *depth_Ref, *depth_Alt;  // read counts, only used to set up pair (see EM_depth)
+  int *depth_ptr, *depth_snp;  // NULL, or the nonzero cells of each individual for sparse read counts
+  int *pair;                // index of the depth pair of each cell (same layout as the depth matrices),
+                            // or only of the nonzero cells for sparse read counts (see EM_pairs)
+  int pairZero;             // index of the depth pair (0,0) of the cells which are not stored
+  int *pairRef, *pairAlt;   // depths of each unique depth pair
+  int *order;               // individuals in the order in which they are put in lanes (see EM_setup)
+  double *pAA, *pAB, *pBB;  // emission probabilities of each unique depth pair
+  const int (*gtab)[4];      // table of the genotype of each state (geno_OPGP or geno_config)
+  // Steps of the groups of lanes processed by EM_lanes_sparse: the group starting at position indx has
+  // nStep[indx] steps (-1 if it is not sparse), whose SNPs and depth pairs are at obsOff[indx] in
+  // obsSnp and obsPair (see EM_observed).
+  int *nStep, *obsSnp, *obsPair;
+  R_xlen_t *obsOff;
+} EMdata;
+
+// Blocks of individuals over which the E-step is split. The number of blocks only depends on
+// the data (and not on the number of threads) so that the results are reproducible.
+// The block size is a multiple of NLANE so that only the last group of each family has unused lanes.
+#define EM_NBLOCKS 64
+
+// Stored forward probabilities of the group of individuals (lanes) of a thread.
+// alphaTilde and log_w hold the scaled forward probabilities and weights of the lanes in rows,
+// i.e., alphaTilde[(4*row + s)*NLANE + l] and log_w[row*NLANE + l].
+// If alphaTildeF is not NULL, the forward probabilities are stored there in single precision instead
+// of in alphaTilde. As they are scaled to sum to one at each SNP they do not need the range of a double,
+// while the weights log_w and all the sums are kept in double precision.
+// If ckpt is zero, row snp holds SNP snp. Otherwise, only every ckpt-th SNP is stored (the checkpoints,
+// in the first nCk rows) and the forward probabilities of the SNPs between two checkpoints are recomputed
+// from the checkpoint in the backward pass (in the next ckpt-1 rows), which is one extra forward pass in
+// exchange for storing nCk + ckpt - 1 rows instead of nSnps.
+// gap is the work array of EM_lanes_sparse (or NULL if it is not used) and pair holds the depth pairs of
+// the group of lanes (see EM_group_pairs).
+typedef struct {
+  double *alphaTilde, *log_w;
+  float *alphaTildeF;
+  int ckpt, nCk;
+  double *gap;
+  int *pair;
+} EMstore;
+
+// Depth pairs of the nl lanes of the group starting at position indx, i.e., of the individuals order[indx],...,
+// order[indx+nl-1], with the pair of lane l at SNP snp in pair[snp*NLANE + l]. For sparse read counts,
+// only the nonzero cells of the individuals are visited.
+static void EM_group_pairs(EMdata *dat, int indx, int nl, int *pair){
+  int snp, l, k, ind;
+  if(dat->depth_ptr){
+    for(k = 0; k < NLANE * dat->nSnps; k++)
+      pair[k] = dat->pairZero;
+    for(l = 0; l < nl; l++){
+      ind = dat->order[indx + l];
+      for(k = dat->depth_ptr[ind]; k < dat->depth_ptr[ind+1]; k++)
+        pair[dat->depth_snp[k]*NLANE + l] = dat->pair[k];
+    }
+  }
+  else{
+    for(snp = 0; snp < dat->nSnps; snp++){
+      for(l = 0; l < nl; l++)
+        pair[snp*NLANE + l] = dat->pair[dat->order[indx + l] + (R_xlen_t)dat->nTotal*snp];
+    }
+  }
+}
+
+// Store (load) the forward probabilities alpha of the lanes in (from) row of st.
+// On loading, the pointer to the values is returned, which is buf when they are stored in single precision.
+static inline void EM_store_row(EMstore *st, R_xlen_t row, const double *alpha, const double *log_w){
+  int l;
+  if(st->alphaTildeF)
+    lanes_to_float(alpha, st->alphaTildeF + 4*NLANE*row);
+  else{
+    for(l = 0; l < 4*NLANE; l++)
+      st->alphaTilde[4*NLANE*row + l] = alpha[l];
+  }
+  for(l = 0; l < NLANE; l++)
+    st->log_w[row*NLANE + l] = log_w[l];
+}
+
+static inline double *EM_load_row(EMstore *st, R_xlen_t row, double *buf){
+  if(st->alphaTildeF){
+    lanes_from_float(st->alphaTildeF + 4*NLANE*row, buf);
+    return buf;
+  }
+  return st->alphaTilde + 4*NLANE*row;
+}
+
+// One step of the forward recursion for the nl (<= NLANE) lanes of family fam with depth pairs pair
+// (see EM_group_pairs): alpha holds the scaled forward probabilities of the lanes at snp-1 on entry (and is
+// not used when snp = 0) and those at snp on exit, and log_w the log of the weight (scaling factor) of each
+// lane at snp.
+static inline void EM_forward_lanes(EMdata *dat, double *Tc, int fam, const int *pair, int nl, int snp,
+                                    double *alpha, double *log_w){
+  int s, l;
+  double sum[NLANE], Kaa[NLANE], Kab[NLANE], Kbb[NLANE], alphaDot[4*NLANE], Talpha[4*NLANE];
+  const double *Q[4];
+  lane_gather(dat->pAA, pair + NLANE*snp, nl, Kaa);
+  lane_gather(dat->pAB, pair + NLANE*snp, nl, Kab);
+  lane_gather(dat->pBB, pair + NLANE*snp, nl, Kbb);
+  Qlanes(dat->gtab[dat->geno[snp*dat->noFam + fam]-1], Kaa, Kab, Kbb, Q);
+  if(snp == 0){
+    for(s = 0; s < 4; s++){
+      for(l = 0; l < NLANE; l++)
+        alphaDot[s*NLANE + l] = 0.25 * Q[s][l];
+    }
+  }
+  else{
+    Tmult_lanes(Tc + 4*(snp-1), alpha, Talpha);
+    for(s = 0; s < 4; s++){
+      for(l = 0; l < NLANE; l++)
+        alphaDot[s*NLANE + l] = Q[s][l] * Talpha[s*NLANE + l];
+    }
+  }
+  // Compute the weight and scale the forward probability vector
+  for(l = 0; l < NLANE; l++)
+    sum[l] = 0;
+  for(s = 0; s < 4; s++){
+    for(l = 0; l < NLANE; l++)
+      sum[l] = sum[l] + alphaDot[s*NLANE + l];
+  }
+  for(l = 0; l < NLANE; l++)
+    log_w[l] = log(sum[l]);
+  for(s = 0; s < 4; s++){
+    for(l = 0; l < NLANE; l++)
+      alpha[s*NLANE + l] = alphaDot[s*NLANE + l]/sum[l];
+  }
+}
+
+// Row of st holding the forward probabilities at snp in the backward pass (which visits the SNPs in
+// decreasing order). With checkpoints, the forward probabilities from the checkpoint at or before snp
+// up to snp are recomputed when snp is before the current segment (starting at *segStart).
+static inline R_xlen_t EM_backward_row(EMdata *dat, double *Tc, int fam, int nl, int snp,
+                                       EMstore *st, int *segStart, double *buf){
+  int j, l;
+  double lw[NLANE], *alpha;
+  if(st->ckpt == 0)
+    return snp;
+  if(snp < *segStart){
+    *segStart = st->ckpt * (snp/st->ckpt);
+    alpha = EM_load_row(st, *segStart/st->ckpt, buf);
+    if(alpha != buf){
+      for(l = 0; l < 4*NLANE; l++)
+        buf[l] = alpha[l];
+    }
+    for(j = *segStart + 1; j <= snp; j++){
+      EM_forward_lanes(dat, Tc, fam, st->pair, nl, j, buf, lw);
+      EM_store_row(st, st->nCk + j - *segStart - 1, buf, lw);
+    }
+  }
+  if(snp == *segStart)
+    return snp/st->ckpt;
+  return st->nCk + snp - *segStart - 1;
+}
+
+// Forward-backward recursion and E-step for the nl (<= NLANE) lanes of the group starting at position indx
+// (see EM_group_pairs), which all belong to family fam (see the lane kernels in probFun.h), with the
+// forward probabilities stored in st (see EMstore).
+// The contributions are added to the accumulator acc, which is laid out as
+// the expected number of paternal (first nSnps-1 entries) and maternal (next nSnps-1 entries)
+// recombinations in each interval divided by the r.f. of the interval, followed by the log-likelihood
+// and the expected number of sequencing errors (sumA) and correct reads (sumB).
+// The contributions of the lanes are added in the order of the lanes.
+static LANE_KERNEL void EM_lanes(EMdata *dat, double *Tc, int fam, int indx, int nl, EMstore *st, double *acc){
+  int s1, s2, snp, l, segStart, nSnps_c = dat->nSnps, noFam_c = dat->noFam, *pgeno = dat->geno, *pair = st->pair;
+  R_xlen_t row;
+  double sum[NLANE], vProb[NLANE], llval[NLANE], sumA[NLANE], sumB[NLANE], Kaa[NLANE], Kab[NLANE], Kbb[NLANE];
+  double betaDot[4*NLANE], betaTilde[4*NLANE], Qbeta[4*NLANE], lw[NLANE];
+  double Mbeta[4*NLANE], Pbeta[4*NLANE], w_exp[NLANE], alphaBuf[4*NLANE];
+  double *alpha;
+  const double *Q[4];
+  const int (*gtab)[4] = dat->gtab;
+  double *rfSum = acc;
+  /////////////////////////////////////////
+  // Compute the forward probabilities and the likelihood
+  EM_group_pairs(dat, indx, nl, pair);
+  for(l = 0; l < NLANE; l++)
+    llval[l] = 0;
+  for(snp = 0; snp < nSnps_c; snp++){
+    EM_forward_lanes(dat, Tc, fam, pair, nl, snp, alphaBuf, lw);
+    // Add contribution to the likelihood
+    for(l = 0; l < NLANE; l++)
+      llval[l] = llval[l] + lw[l];
+    if(st->ckpt == 0)
+      EM_store_row(st, snp, alphaBuf, lw);
+    else if(snp % st->ckpt == 0)
+      EM_store_row(st, snp/st->ckpt, alphaBuf, lw);
+  }
+  //////////////////////
+  // Compute the backward probabilities together with the E-step.
+  // The posterior probabilities are not stored but their contribution is added
+  // straight into the sufficient statistics of the M-step.
+  for(l = 0; l < NLANE; l++){
+    sumA[l] = 0;
+    sumB[l] = 0;
+  }
+  snp = nSnps_c - 1;
+  segStart = nSnps_c;
+  row = EM_backward_row(dat, Tc, fam, nl, snp, st, &segStart, alphaBuf);
+  alpha = EM_load_row(st, row, alphaBuf);
+  for(l = 0; l < NLANE; l++)
+    w_exp[l] = exp(st->log_w[row*NLANE + l]);
+  for(s1 = 0; s1 < 4; s1++){
+    for(l = 0; l < NLANE; l++)
+      betaTilde[s1*NLANE + l] = 1/w_exp[l];
+  }
+  addErrorCounts(alpha, betaTilde, w_exp, gtab[pgeno[snp*noFam_c + fam]-1],
+                 pair + NLANE*snp, dat->pairRef, dat->pairAlt, nl, sumA, sumB);
+  // iterate over the remaining SNPs
+  for(snp = nSnps_c-2; snp > -1; snp--){
+    lane_gather(dat->pAA, pair + NLANE*(snp+1), nl, Kaa);
+    lane_gather(dat->pAB, pair + NLANE*(snp+1), nl, Kab);
+    lane_gather(dat->pBB, pair + NLANE*(snp+1), nl, Kbb);
+    Qlanes(gtab[pgeno[(snp+1)*noFam_c + fam]-1], Kaa, Kab, Kbb, Q);
+    for(s2 = 0; s2 < 4; s2++){
+      for(l = 0; l < NLANE; l++)
+        Qbeta[s2*NLANE + l] = Q[s2][l] * betaTilde[s2*NLANE + l];
+    }
+    // Apply the maternal and paternal factors of the transition matrix
+    Tmult_mat_lanes(Tc + 4*snp, Qbeta, Mbeta);
+    Tmult_pat_lanes(Tc + 4*snp, Mbeta, betaDot);
+    Tmult_pat_lanes(Tc + 4*snp, Qbeta, Pbeta);
+    // E-step: expected number of paternal and maternal recombinations, i.e., the sum of
+    // alpha[s1]*T[s1,s2]*Q[s2]*beta[s2] over the states where the paternal (maternal) allele changes.
+    // The factor r of T[s1,s2] is left out here (so that these sums also give the gradient, see EM_score).
+    row = EM_backward_row(dat, Tc, fam, nl, snp, st, &segStart, alphaBuf);
+    alpha = EM_load_row(st, row, alphaBuf);
+    for(l = 0; l < NLANE; l++){
+      sum[l] = 0;
+      vProb[l] = 0;
+    }
+    for(s1 = 0; s1 < 4; s1++){
+      for(l = 0; l < NLANE; l++){
+        sum[l] = sum[l] + alpha[s1*NLANE + l] * Mbeta[(s1 ^ 2)*NLANE + l];
+        vProb[l] = vProb[l] + alpha[s1*NLANE + l] * Pbeta[(s1 ^ 1)*NLANE + l];
       }
-      else{
-        *ppAA = *pbin_coef * powl(1 - epsilon, pdepth_Ref[indx]) * powl(epsilon, pdepth_Alt[indx]);
-        *ppBB = *pbin_coef * powl(epsilon, pdepth_Ref[indx]) * powl(1 - epsilon, pdepth_Alt[indx]);
+    }
+    for(l = 0; l < nl; l++){
+      rfSum[snp] = rfSum[snp] + sum[l];
+      rfSum[snp + nSnps_c-1] = rfSum[snp + nSnps_c-1] + vProb[l];
+    }
+    // Scale the backward probability vector
+    for(l = 0; l < NLANE; l++)
+      w_exp[l] = exp(st->log_w[row*NLANE + l]);
+    for(s1 = 0; s1 < 4; s1++){
+      for(l = 0; l < NLANE; l++)
+        betaTilde[s1*NLANE + l] = betaDot[s1*NLANE + l]/w_exp[l];
+    }
+    // E-step: expected number of sequencing errors
+    addErrorCounts(alpha, betaTilde, w_exp, gtab[pgeno[snp*noFam_c + fam]-1],
+                   pair + NLANE*snp, dat->pairRef, dat->pairAlt, nl, sumA, sumB);
+  }
+  // Add the log-likelihood and the error counts of each individual
+  for(l = 0; l < nl; l++){
+    acc[2*(nSnps_c-1)]     = acc[2*(nSnps_c-1)] + llval[l];
+    acc[2*(nSnps_c-1) + 1] = acc[2*(nSnps_c-1) + 1] + sumA[l];
+    acc[2*(nSnps_c-1) + 2] = acc[2*(nSnps_c-1) + 2] + sumB[l];
+  }
+}
+
+//// Sparse version of EM_lanes for groups of individuals with many SNPs without reads.
+// As a SNP without reads has an emission probability of one for every state, each lane only steps through
+// its own SNPs with reads (the k-th step of lane l is the SNP obs[k*NLANE + l], see EM_observed) and the
+// transition between two steps is that of the whole gap between the SNPs (see Tgap). Before the first SNP with
+// reads, the forward probabilities stay at the (stationary) uniform distribution. Lanes with fewer steps
+// are padded with empty steps (an identity transition with emission probabilities of one).
+// In the E-step, the expected number of recombinations over a gap is split among its intervals. If the
+// paternal allele is the same (different) at the two ends of the gap, the expected number of recombinations
+// in interval i is r_i(1 - D_i)/(1 + D) (r_i(1 + D_i)/(1 - D)), where D is the product of 1 - 2r over the
+// intervals of the gap and D_i the same product without interval i. Hence, the contribution to the
+// accumulator (which holds the expected number of recombinations divided by r_i) is
+//   (Hs + Hd)/2 + (Hd - Hs)/2 * D_i,
+// where Hs and Hd are the E-step sums of EM_lanes with the factors 1 - r and r of the gap left out, which
+// reduces to Hd for a gap of one interval. The intervals before the first and after the last SNP with reads
+// have no information and add one (i.e., the expected number of recombinations is r_i).
+
+// Collect the steps of the nl lanes with depth pairs pair (see EM_group_pairs): the SNPs with reads (in snp)
+// and their depth pairs (in obsPair), with the k-th step of lane l at k*NLANE + l and padded with -1 (and 0)
+// up to nStep steps.
+static void EM_observed(EMdata *dat, const int *pair, int nl, int nStep, int *snp, int *obsPair){
+  int s, l, k, nObs[NLANE];
+  for(l = 0; l < NLANE; l++)
+    nObs[l] = 0;
+  for(s = 0; s < dat->nSnps; s++){
+    for(l = 0; l < nl; l++){
+      if(dat->pairRef[pair[s*NLANE + l]] + dat->pairAlt[pair[s*NLANE + l]] > 0){
+        snp[nObs[l]*NLANE + l] = s;
+        obsPair[nObs[l]*NLANE + l] = pair[s*NLANE + l];
+        nObs[l]++;
       }
-      ppAA++;
-      ppBB++;
-      pbin_coef++;
-    }
-  }
-  return -1;
-}
-
-// Function for extracting entries of the emission probability matrix
-// when the OPGPs are known
-int Iindx(int OPGP, int elem){
-  switch(OPGP){
-  case 1:
-    if(elem == 1)
-      return 2;
-    else if ((elem == 2)|(elem == 3))  
-      return 0;
-    else if (elem == 4)
-      return 1;
-  case 2:
-    if(elem == 3)
-      return 2;
-    else if ((elem == 1)|(elem == 4))
-      return 0;
-    else if (elem == 2)
-      return 1;
-  case 3:
-    if(elem == 2) 
-      return 2;
-    else if ((elem == 1)|(elem == 4))
-      return 0;
-    else if (elem == 3)
-      return 1;
-  case 4:
-    if(elem == 4) 
-      return 2;
-    else if ((elem == 2)|(elem == 3))
-      return 0;
-    else if (elem == 1)
-      return 1;
-  case 5:
-    if ((elem == 1)|(elem == 2))
-      return 0;
-    else if ((elem == 3)|(elem == 4))
-      return 1;
-  case 6:
-    if ((elem == 1)|(elem == 2))
-      return 1;
-    else if ((elem == 3)|(elem == 4))
-      return 0;
-  case 7:
-    if ((elem == 1)|(elem == 2))
-      return 2;
-    else if ((elem == 3)|(elem == 4))
-      return 0;
-  case 8:
-    if ((elem == 1)|(elem == 2))
-      return 0;
-    else if ((elem == 3)|(elem == 4))
-      return 2;
-  case 9:
-    if ((elem == 1)|(elem == 3))
-      return 0;
-    else if ((elem == 2)|(elem == 4))
-      return 1;
-  case 10:
-    if ((elem == 1)|(elem == 3))
-      return 1;
-    else if ((elem == 2)|(elem == 4))
-      return 0;
-  case 11:
-    if ((elem == 1)|(elem == 3))
-      return 2;
-    else if ((elem == 2)|(elem == 4))
-      return 0;
-  case 12:
-    if ((elem == 1)|(elem == 3))
-      return 0;
-    else if ((elem == 2)|(elem == 4))
-      return 2;
-  case 13:
-    return 1;
-  case 14:
-    return 0;
-  case 15:
-    return 0;
-  case 16:
-    return 2;
-  } // end of Switch
-  return -1;
+    }
+  }
+  for(l = 0; l < NLANE; l++){
+    for(k = nObs[l]; k < nStep; k++){
+      snp[k*NLANE + l] = -1;
+      obsPair[k*NLANE + l] = 0;
+    }
+  }
 }
 
+// Transition matrices (Tl, see Tmult_lanes_var) and emission probabilities (Q[s*NLANE + l]) of the lanes
+// for the step from the SNPs prev (NULL for the first step) to the SNPs cur with depth pairs pair.
+// pad is one for the empty steps.
+static inline void EM_step_lanes(EMdata *dat, double *Tc, int fam, const int *prev, const int *cur,
+                                 const int *pair, double *Tl, double *Q, double *pad){
+  int s, l, b;
+  double K[3], T[4];
+  const int *geno;
+  for(l = 0; l < NLANE; l++){
+    b = cur[l];
+    pad[l] = (b < 0);
+    if(b < 0){
+      Tl[l] = 1;
+      Tl[NLANE + l] = 0;
+      Tl[2*NLANE + l] = 1;
+      Tl[3*NLANE + l] = 0;
+      for(s = 0; s < 4; s++)
+        Q[s*NLANE + l] = 1;
+      continue;
+    }
+    // the first step has an identity transition (an empty gap)
+    Tgap(Tc, prev ? prev[l] : b, b, T);
+    Tl[l]           = T[0];
+    Tl[NLANE + l]   = T[1];
+    Tl[2*NLANE + l] = T[2];
+    Tl[3*NLANE + l] = T[3];
+    K[0] = dat->pAB[pair[l]];
+    K[1] = dat->pAA[pair[l]];
+    K[2] = dat->pBB[pair[l]];
+    geno = dat->gtab[dat->geno[b*dat->noFam + fam]-1];
+    for(s = 0; s < 4; s++)
+      Q[s*NLANE + l] = K[geno[s]];
+  }
+}
 
+// Add the contributions of the lanes at the SNPs cur (with depth pairs pair) to the expected number of
+// sequencing errors (sumA) and correct reads (sumB), as in addErrorCounts but with the genotype table row
+// of each lane's own SNP.
+static inline void addErrorCounts_lanes(EMdata *dat, int fam, int nl, const int *cur, const int *pair,
+                                        const double *alpha, const double *beta, const double *w_exp,
+                                        double *sumA, double *sumB){
+  int s, l;
+  double uProb, dRef, dAlt;
+  const int *geno;
+  for(l = 0; l < nl; l++){
+    if(cur[l] < 0)
+      continue;
+    dRef = dat->pairRef[pair[l]];
+    dAlt = dat->pairAlt[pair[l]];
+    geno = dat->gtab[dat->geno[cur[l]*dat->noFam + fam]-1];
+    for(s = 0; s < 4; s++){
+      if( geno[s] == 0 )
+        continue;
+      uProb = alpha[s*NLANE + l] * beta[s*NLANE + l] * w_exp[l];
+      // reads of the other allele are errors
+      sumA[l] = sumA[l] + uProb * ((geno[s] == 1) ? dAlt : dRef);
+      sumB[l] = sumB[l] + uProb * ((geno[s] == 1) ? dRef : dAlt);
+    }
+  }
+}
 
+// Split the E-step sums Hs and Hd of the gap from SNP a to SNP b among its intervals (see above) for the
+// paternal (parent = 0) or maternal (parent = 1) r.f.'s. pre is a work array of length b - a.
+static inline void EM_gap_counts(const double *Tc, int a, int b, int parent, double Hs, double Hd,
+                                 double *rfSum, double *pre){
+  int i;
+  double suf = 1, c0 = (Hs + Hd)/2, c1 = (Hd - Hs)/2;
+  const double *T = Tc + 2*parent;
+  if(b == a + 1){
+    rfSum[a] = rfSum[a] + Hd;
+    return;
+  }
+  pre[0] = 1;
+  for(i = a + 1; i < b; i++)
+    pre[i-a] = pre[i-a-1] * (T[4*(i-1)] - T[4*(i-1) + 1]);
+  for(i = b - 1; i >= a; i--){
+    rfSum[i] = rfSum[i] + c0 + c1 * pre[i-a] * suf;
+    suf = suf * (T[4*i] - T[4*i + 1]);
+  }
+}
 
-SEXP EM_HMM(SEXP r, SEXP ep, SEXP depth_Ref, SEXP depth_Alt, SEXP OPGP, SEXP noFam, SEXP nInd, SEXP nSnps,
-            SEXP sexSpec, SEXP seqError, SEXP para, SEXP ss_rf){
-  // Initialize variables
-  int s1, s2, fam, ind, snp, g, iter, nIter, indx, parent, noFam_c, nSnps_c, sexSpec_c, seqError_c;
-  double sum, sumA, sumB, a, b, delta;
-  // Copy values of R input into C objects
-  nSnps_c = INTEGER(nSnps)[0];
-  double r_c[(nSnps_c-1)*2], ep_c;
-  for(snp = 0; snp < nSnps_c - 1; snp++){
-    for(parent = 0; parent < 2; parent++){
-      r_c[snp+parent*(nSnps_c-1)] = REAL(r)[snp+parent*(nSnps_c-1)];
+static LANE_KERNEL void EM_lanes_sparse(EMdata *dat, double *Tc, int fam, int indx, int nl, EMstore *st, double *acc){
+  int s1, k, l, nStep = dat->nStep[indx], nSnps_c = dat->nSnps;
+  const int *obs = dat->obsSnp + dat->obsOff[indx], *pair = dat->obsPair + dat->obsOff[indx];
+  double llval[NLANE], sumA[NLANE], sumB[NLANE], sum[NLANE], lw[NLANE], pad[NLANE], w_exp[NLANE];
+  double Hs[NLANE], Hd[NLANE], Ms[NLANE], Md[NLANE];
+  double Tl[4*NLANE], Q[4*NLANE], alphaBuf[4*NLANE], alphaDot[4*NLANE], Talpha[4*NLANE];
+  double betaTilde[4*NLANE], betaDot[4*NLANE], Qbeta[4*NLANE], Mbeta[4*NLANE], Pbeta[4*NLANE];
+  double *alpha, *rfSum = acc;
+  for(l = 0; l < NLANE; l++){
+    llval[l] = 0;
+    sumA[l] = 0;
+    sumB[l] = 0;
+  }
+  if(nStep > 0){
+    /////////////////////////////////////////
+    // Compute the forward probabilities and the likelihood
+    for(s1 = 0; s1 < 4*NLANE; s1++)
+      alphaBuf[s1] = 0.25;
+    for(k = 0; k < nStep; k++){
+      EM_step_lanes(dat, Tc, fam, k ? obs + (k-1)*NLANE : NULL, obs + k*NLANE, pair + k*NLANE, Tl, Q, pad);
+      Tmult_lanes_var(Tl, alphaBuf, Talpha);
+      for(s1 = 0; s1 < 4*NLANE; s1++)
+        alphaDot[s1] = Q[s1] * Talpha[s1];
+      for(l = 0; l < NLANE; l++)
+        sum[l] = 0;
+      for(s1 = 0; s1 < 4; s1++){
+        for(l = 0; l < NLANE; l++)
+          sum[l] = sum[l] + alphaDot[s1*NLANE + l];
+      }
+      // the empty steps leave the forward probabilities unchanged
+      for(l = 0; l < NLANE; l++){
+        if(pad[l] != 0)
+          sum[l] = 1;
+        lw[l] = log(sum[l]);
+        llval[l] = llval[l] + lw[l];
+      }
+      for(s1 = 0; s1 < 4; s1++){
+        for(l = 0; l < NLANE; l++)
+          alphaBuf[s1*NLANE + l] = alphaDot[s1*NLANE + l]/sum[l];
+      }
+      EM_store_row(st, k, alphaBuf, lw);
+    }
+    //////////////////////
+    // Compute the backward probabilities together with the E-step
+    k = nStep - 1;
+    alpha = EM_load_row(st, k, alphaBuf);
+    for(l = 0; l < NLANE; l++)
+      w_exp[l] = exp(st->log_w[k*NLANE + l]);
+    for(s1 = 0; s1 < 4; s1++){
+      for(l = 0; l < NLANE; l++)
+        betaTilde[s1*NLANE + l] = 1/w_exp[l];
+    }
+    addErrorCounts_lanes(dat, fam, nl, obs + k*NLANE, pair + k*NLANE, alpha, betaTilde, w_exp, sumA, sumB);
+    for(k = nStep - 2; k > -1; k--){
+      EM_step_lanes(dat, Tc, fam, obs + k*NLANE, obs + (k+1)*NLANE, pair + (k+1)*NLANE, Tl, Q, pad);
+      for(s1 = 0; s1 < 4*NLANE; s1++)
+        Qbeta[s1] = Q[s1] * betaTilde[s1];
+      Tmult_mat_lanes_var(Tl, Qbeta, Mbeta);
+      Tmult_pat_lanes_var(Tl, Mbeta, betaDot);
+      Tmult_pat_lanes_var(Tl, Qbeta, Pbeta);
+      alpha = EM_load_row(st, k, alphaBuf);
+      // E-step sums of the paternal (Hs, Hd) and maternal (Ms, Md) alleles over the gap
+      for(l = 0; l < NLANE; l++){
+        Hs[l] = 0;
+        Hd[l] = 0;
+        Ms[l] = 0;
+        Md[l] = 0;
+      }
+      for(s1 = 0; s1 < 4; s1++){
+        for(l = 0; l < NLANE; l++){
+          Hs[l] = Hs[l] + alpha[s1*NLANE + l] * Mbeta[s1*NLANE + l];
+          Hd[l] = Hd[l] + alpha[s1*NLANE + l] * Mbeta[(s1 ^ 2)*NLANE + l];
+          Ms[l] = Ms[l] + alpha[s1*NLANE + l] * Pbeta[s1*NLANE + l];
+          Md[l] = Md[l] + alpha[s1*NLANE + l] * Pbeta[(s1 ^ 1)*NLANE + l];
+        }
+      }
+      for(l = 0; l < nl; l++){
+        if(obs[(k+1)*NLANE + l] < 0)
+          continue;
+        EM_gap_counts(Tc, obs[k*NLANE + l], obs[(k+1)*NLANE + l], 0, Hs[l], Hd[l], rfSum, st->gap);
+        EM_gap_counts(Tc, obs[k*NLANE + l], obs[(k+1)*NLANE + l], 1, Ms[l], Md[l], rfSum + nSnps_c-1, st->gap);
+      }
+      // Scale the backward probability vector
+      for(l = 0; l < NLANE; l++)
+        w_exp[l] = exp(st->log_w[k*NLANE + l]);
+      for(s1 = 0; s1 < 4; s1++){
+        for(l = 0; l < NLANE; l++)
+          betaTilde[s1*NLANE + l] = betaDot[s1*NLANE + l]/w_exp[l];
+      }
+      addErrorCounts_lanes(dat, fam, nl, obs + k*NLANE, pair + k*NLANE, alpha, betaTilde, w_exp, sumA, sumB);
     }
   }
-  ep_c = REAL(ep)[0];
-  sexSpec_c = INTEGER(sexSpec)[0];
-  seqError_c = INTEGER(seqError)[0];
-  noFam_c = INTEGER(noFam)[0];
-  int nInd_c[noFam_c], nTotal, indSum[noFam_c];
-  nTotal = 0;
+  // The intervals before the first and after the last SNP with reads of each individual
+  for(l = 0; l < nl; l++){
+    int first = nSnps_c - 1, last = nSnps_c - 1;
+    if(nStep > 0 && obs[l] >= 0){
+      first = obs[l];
+      for(k = nStep - 1; obs[k*NLANE + l] < 0; k--)
+        ;
+      last = obs[k*NLANE + l];
+    }
+    for(k = 0; k < first; k++){
+      rfSum[k] = rfSum[k] + 1;
+      rfSum[k + nSnps_c-1] = rfSum[k + nSnps_c-1] + 1;
+    }
+    for(k = last; k < nSnps_c - 1; k++){
+      rfSum[k] = rfSum[k] + 1;
+      rfSum[k + nSnps_c-1] = rfSum[k + nSnps_c-1] + 1;
+    }
+  }
+  // Add the log-likelihood and the error counts of each individual
+  for(l = 0; l < nl; l++){
+    acc[2*(nSnps_c-1)]     = acc[2*(nSnps_c-1)] + llval[l];
+    acc[2*(nSnps_c-1) + 1] = acc[2*(nSnps_c-1) + 1] + sumA[l];
+    acc[2*(nSnps_c-1) + 2] = acc[2*(nSnps_c-1) + 2] + sumB[l];
+  }
+}
+
+// E-step over all the individuals.
+// The individuals are split into blocks (which do not cross families) that are handed out
+// dynamically to the threads, so that idle threads take the next available block regardless
+// of how the family sizes differ. Each block has its own accumulator and the accumulators are
+// merged with a pairwise (tree) reduction in a fixed order, so the result does not depend on
+// the number of threads or on which thread processed which block.
+// On exit, acc[0:(lenAcc-1)] contains the sufficient statistics summed over all individuals.
+static void EM_estep(EMdata *dat, double *Tc, int nBlocks, int *blockFam, int *blockStart, int *blockEnd,
+                     double *acc, int lenAcc, EMstore *store, int nThreads){
+  int block, indx, step, k;
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(nThreads) schedule(dynamic, 1) private(indx, k)
+#endif
+  for(block = 0; block < nBlocks; block++){
+    int thread = 0;
+#ifdef _OPENMP
+    thread = omp_get_thread_num();
+#endif
+    double *pacc = acc + (R_xlen_t) block * lenAcc;
+    for(k = 0; k < lenAcc; k++){
+      pacc[k] = 0;
+    }
+    for(indx = blockStart[block]; indx < blockEnd[block]; indx = indx + NLANE){
+      if(dat->nStep[indx] >= 0)
+        EM_lanes_sparse(dat, Tc, blockFam[block], indx, (blockEnd[block] - indx < NLANE) ? blockEnd[block] - indx : NLANE,
+                        store + thread, pacc);
+      else
+        EM_lanes(dat, Tc, blockFam[block], indx, (blockEnd[block] - indx < NLANE) ? blockEnd[block] - indx : NLANE,
+                 store + thread, pacc);
+    }
+  }
+  // Tree reduction of the block accumulators
+  for(step = 1; step < nBlocks; step = 2*step){
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(nThreads) private(k)
+#endif
+    for(block = 0; block < nBlocks - step; block = block + 2*step){
+      for(k = 0; k < lenAcc; k++){
+        acc[(R_xlen_t) block * lenAcc + k] = acc[(R_xlen_t) block * lenAcc + k] + acc[(R_xlen_t) (block + step) * lenAcc + k];
+      }
+    }
+  }
+}
+
+// Working arrays of the E-step
+typedef struct {
+  int nThreads, nBlocks, lenAcc, maxDepth, nPairs;
+  int *blockFam, *blockStart, *blockEnd;  // family, first and last (+1) individual of each block
+  double *acc;                            // accumulators of each block (see EM_lanes)
+  double *Tc;                             // transition matrix cache for each interval (see Tmat_cache)
+  EMstore *store;                         // stored forward probabilities of each thread (see EMstore)
+  double *powTab, ep_prev;                // see computeProb and EM_expect
+  double *theta;                          // parameter vectors of EM_squarem
+  int interrupt;                          // whether to check for a user interrupt (see EM_interrupt)
+} EMwork;
+
+// Number of threads used, which is at most the number of processors
+static int EM_threads(int nThreads){
+#ifdef _OPENMP
+  if(nThreads > omp_get_num_procs())
+    nThreads = omp_get_num_procs();
+#endif
+  if(nThreads < 1)
+    nThreads = 1;
+  return nThreads;
+}
+
+// Set up the emission probabilities: the starting index of each family, the index of the unique depth
+// pair of each cell (see depth_pairs) and the arrays of the probabilities of each pair (see EM_expect).
+// For sparse read counts, the index is only stored for the nonzero cells (in the order of depth_snp) and
+// the other cells share the pair pairZero, so the memory used is proportional to the number of cells with reads.
+static void EM_pairs(EMdata *dat, EMwork *wk){
+  int fam, k, nTotal = 0;
+  R_xlen_t nCells;
+  dat->indSum = (int *) R_alloc(dat->noFam, sizeof(int));
+  for(fam = 0; fam < dat->noFam; fam++){
+    nTotal = nTotal + dat->nInd[fam];
+    dat->indSum[fam] = nTotal - dat->nInd[fam];
+  }
+  dat->nTotal = nTotal;
+  if(dat->depth_ptr){
+    nCells = dat->depth_ptr[nTotal];
+    dat->pair = (int *) R_alloc((size_t) nCells + 1, sizeof(int));
+    wk->nPairs = depth_pairs_sparse(dat->depth_ptr, dat->depth_snp, dat->depth_Ref, dat->depth_Alt, nTotal, dat->nSnps,
+                                    dat->pair, &dat->pairRef, &dat->pairAlt, &wk->maxDepth, &dat->pairZero);
+  }
+  else{
+    nCells = (R_xlen_t) nTotal * dat->nSnps;
+    dat->pair = (int *) R_alloc((size_t) nCells, sizeof(int));
+    wk->nPairs = depth_pairs(dat->depth_Ref, dat->depth_Alt, nCells, dat->pair, &dat->pairRef, &dat->pairAlt,
+                             &wk->maxDepth);
+    dat->pairZero = -1;
+  }
+  dat->pAA = (double *) R_alloc(wk->nPairs, sizeof(double));
+  dat->pAB = (double *) R_alloc(wk->nPairs, sizeof(double));
+  dat->pBB = (double *) R_alloc(wk->nPairs, sizeof(double));
+  // Compute the probs for the heterozygous calls (0.5^depth is exact via ldexp).
+  // Note: the binomial coefficients are not included here but are added to the likelihood in R.
+  for(k = 0; k < wk->nPairs; k++){
+    dat->pAB[k] = ldexp(1.0, -(dat->pairRef[k] + dat->pairAlt[k]));
+  }
+  wk->powTab = (double *) R_alloc(2 * ((size_t) wk->maxDepth + 1), sizeof(double));
+  wk->ep_prev = -1;
+}
+
+// Number of individuals in each block of the E-step (see EM_NBLOCKS) for nTotal individuals
+static int EM_block_size(int nTotal){
+  int blockSize = (nTotal + EM_NBLOCKS - 1)/EM_NBLOCKS;
+  blockSize = NLANE * ((blockSize + NLANE - 1)/NLANE);
+  return (blockSize < NLANE) ? NLANE : blockSize;
+}
+
+// Number of rows of the forward probabilities stored by each thread (see EMstore), where *ckpt is the number
+// of SNPs between the checkpoints on entry (see EM_setup) and is set to the one used.
+static int EM_rows(int nSnps_c, int *ckpt){
+  if(*ckpt < 0)
+    *ckpt = (int) ceil(sqrt((double) nSnps_c));
+  if(*ckpt >= nSnps_c)
+    *ckpt = nSnps_c;
+  return (*ckpt > 0) ? (nSnps_c + *ckpt - 1)/(*ckpt) + *ckpt - 1 : nSnps_c;
+}
+
+// Set up the E-step: the blocks of individuals, the unique depth pairs and the working arrays.
+// If ckpt is nonzero, the forward probabilities are only stored at every ckpt-th SNP (or every
+// ceiling(sqrt(nSnps))-th SNP when ckpt < 0). Otherwise, they are stored in single precision if single is nonzero.
+static void EM_setup(EMdata *dat, EMwork *wk, int nThreads, int single, int ckpt){
+  int fam, ind, snp, block, nl, l, nStep, blockSize, nTotal, nRows, thread, anySparse, noFam_c = dat->noFam, nSnps_c = dat->nSnps;
+  int *nObsInd;
+  double *key;
+  R_xlen_t nObs, cell;
+  nThreads = EM_threads(nThreads);
+  wk->nThreads = nThreads;
+  wk->interrupt = 1;
+  EM_pairs(dat, wk);
+  nTotal = dat->nTotal;
+  // Split the individuals into blocks within each family
+  blockSize = EM_block_size(nTotal);
+  wk->nBlocks = 0;
   for(fam = 0; fam < noFam_c; fam++){
-    nInd_c[fam] = INTEGER(nInd)[fam];
-    nTotal = nTotal + nInd_c[fam];
-    indSum[fam] = nTotal - nInd_c[fam];
+    wk->nBlocks = wk->nBlocks + (dat->nInd[fam] + blockSize - 1)/blockSize;
   }
-  nIter = REAL(para)[0];
-  delta = REAL(para)[1];
-  // Initialize some more variables
-  double alphaTilde[4][nTotal][nSnps_c], alphaDot[4];
-  double betaTilde[4][nTotal][nSnps_c], betaDot[4];
-  double w_new, log_w[nTotal][nSnps_c];
-  double uProb[4][nTotal][nSnps_c], vProb[4][4][nTotal][nSnps_c-1];
-  // Define the pointers to the other input R variables
-  int *pOPGP, *pdepth_Ref, *pdepth_Alt;
-  pOPGP = INTEGER(OPGP);
-  pdepth_Ref = INTEGER(depth_Ref);
-  pdepth_Alt = INTEGER(depth_Alt);
-  int *pss_rf;
-  pss_rf = INTEGER(ss_rf);
+  wk->blockFam   = (int *) R_alloc(wk->nBlocks, sizeof(int));
+  wk->blockStart = (int *) R_alloc(wk->nBlocks, sizeof(int));
+  wk->blockEnd   = (int *) R_alloc(wk->nBlocks, sizeof(int));
+  wk->nBlocks = 0;
+  for(fam = 0; fam < noFam_c; fam++){
+    for(ind = 0; ind < dat->nInd[fam]; ind = ind + blockSize){
+      wk->blockFam[wk->nBlocks] = fam;
+      wk->blockStart[wk->nBlocks] = dat->indSum[fam] + ind;
+      wk->blockEnd[wk->nBlocks] = dat->indSum[fam] + (ind + blockSize < dat->nInd[fam] ? ind + blockSize : dat->nInd[fam]);
+      wk->nBlocks++;
+    }
+  }
+  // Sufficient statistics of each block: r.f. sums, log-likelihood, sumA and sumB (see EM_lanes)
+  wk->lenAcc = 2*(nSnps_c - 1) + 3;
+  wk->acc = (double *) R_alloc((size_t) wk->nBlocks * wk->lenAcc, sizeof(double));
+  wk->Tc = (double *) R_alloc(4 * (size_t) (nSnps_c - 1), sizeof(double));
+  // The forward probabilities are only required for the current group of individuals of each thread
+  nRows = EM_rows(nSnps_c, &ckpt);
+  // With checkpoints, few rows are stored and the forward probabilities recomputed in the backward pass
+  // must match those of the forward pass, so the checkpoints are always kept in double precision.
+  if(ckpt > 0)
+    single = 0;
+  wk->store = (EMstore *) R_alloc(nThreads, sizeof(EMstore));
+  for(thread = 0; thread < nThreads; thread++){
+    EMstore *st = wk->store + thread;
+    st->ckpt = ckpt;
+    st->nCk = (ckpt > 0) ? (nSnps_c + ckpt - 1)/ckpt : 0;
+    st->alphaTilde = single ? NULL : (double *) R_alloc(4 * NLANE * (size_t) nRows, sizeof(double));
+    st->alphaTildeF = single ? (float *) R_alloc(4 * NLANE * (size_t) nRows, sizeof(float)) : NULL;
+    st->log_w = (double *) R_alloc(NLANE * (size_t) nRows, sizeof(double));
+    st->gap = NULL;
+    st->pair = (int *) R_alloc(NLANE * (size_t) nSnps_c, sizeof(int));
+  }
+  // Number of SNPs with reads of each individual
+  nObsInd = (int *) R_alloc(nTotal, sizeof(int));
+  for(ind = 0; ind < nTotal; ind++)
+    nObsInd[ind] = 0;
+  if(dat->depth_ptr){
+    for(ind = 0; ind < nTotal; ind++){
+      for(cell = dat->depth_ptr[ind]; cell < dat->depth_ptr[ind+1]; cell++)
+        nObsInd[ind] = nObsInd[ind] + (dat->pairRef[dat->pair[cell]] + dat->pairAlt[dat->pair[cell]] > 0);
+    }
+  }
+  else{
+    for(snp = 0; snp < nSnps_c; snp++){
+      for(ind = 0; ind < nTotal; ind++){
+        cell = ind + (R_xlen_t) nTotal*snp;
+        nObsInd[ind] = nObsInd[ind] + (dat->pairRef[dat->pair[cell]] + dat->pairAlt[dat->pair[cell]] > 0);
+      }
+    }
+  }
+  // The individuals are put in lanes in their order, except when some of them can use EM_lanes_sparse (only
+  // without checkpoints). In that case, the individuals of each family with reads at more than EM_SPARSE of the
+  // SNPs come first (in their order), followed by the others sorted by their number of SNPs with reads (in
+  // decreasing order and then by index). This puts the individuals with few SNPs with reads in the same groups
+  // of lanes, rather than leaving a group on EM_lanes whenever one of its lanes has many.
+  dat->order = (int *) R_alloc(nTotal, sizeof(int));
+  anySparse = 0;
+  for(ind = 0; ind < nTotal; ind++){
+    dat->order[ind] = ind;
+    anySparse = anySparse || (nObsInd[ind] <= EM_SPARSE * nSnps_c);
+  }
+  if(anySparse && ckpt == 0){
+    key = (double *) R_alloc(nTotal, sizeof(double));
+    for(ind = 0; ind < nTotal; ind++)
+      key[ind] = (double) (nObsInd[ind] <= EM_SPARSE * nSnps_c ? nObsInd[ind] : nSnps_c + 1) * nTotal + (nTotal - 1 - ind);
+    for(fam = 0; fam < noFam_c; fam++)
+      revsort(key + dat->indSum[fam], dat->order + dat->indSum[fam], dat->nInd[fam]);
+  }
+  // The groups of lanes with few SNPs with reads use EM_lanes_sparse (except with checkpoints), for which
+  // their SNPs with reads are collected here once rather than in each E-step
+  dat->nStep = (int *) R_alloc(nTotal, sizeof(int));
+  dat->obsOff = (R_xlen_t *) R_alloc(nTotal, sizeof(R_xlen_t));
+  nObs = 0;
+  for(ind = 0; ind < nTotal; ind++)
+    dat->nStep[ind] = -1;
+  for(block = 0; block < wk->nBlocks && ckpt == 0; block++){
+    for(ind = wk->blockStart[block]; ind < wk->blockEnd[block]; ind = ind + NLANE){
+      nl = (wk->blockEnd[block] - ind < NLANE) ? wk->blockEnd[block] - ind : NLANE;
+      nStep = 0;
+      for(l = 0; l < nl; l++){
+        if(nObsInd[dat->order[ind + l]] > nStep)
+          nStep = nObsInd[dat->order[ind + l]];
+      }
+      if(nStep <= EM_SPARSE * nSnps_c){
+        dat->nStep[ind] = nStep;
+        dat->obsOff[ind] = nObs;
+        nObs = nObs + NLANE * (R_xlen_t) nStep;
+      }
+    }
+  }
+  dat->obsSnp = (int *) R_alloc((size_t) nObs, sizeof(int));
+  dat->obsPair = (int *) R_alloc((size_t) nObs, sizeof(int));
+  anySparse = 0;
+  for(block = 0; block < wk->nBlocks; block++){
+    for(ind = wk->blockStart[block]; ind < wk->blockEnd[block]; ind = ind + NLANE){
+      if(dat->nStep[ind] < 0)
+        continue;
+      nl = (wk->blockEnd[block] - ind < NLANE) ? wk->blockEnd[block] - ind : NLANE;
+      EM_group_pairs(dat, ind, nl, wk->store[0].pair);
+      EM_observed(dat, wk->store[0].pair, nl, dat->nStep[ind], dat->obsSnp + dat->obsOff[ind],
+                  dat->obsPair + dat->obsOff[ind]);
+      anySparse = 1;
+    }
+  }
+  for(thread = 0; thread < nThreads && anySparse; thread++)
+    wk->store[thread].gap = (double *) R_alloc(nSnps_c, sizeof(double));
+  wk->theta = (double *) R_alloc(5 * (2 * (size_t) (nSnps_c - 1) + 1), sizeof(double));
+}
+
+// Check for a user interrupt, unless wk->interrupt is zero. This is set by EM_batch for the jobs run on
+// its threads, from which R cannot be called.
+static void EM_interrupt(EMwork *wk){
+  if(wk->interrupt)
+    R_CheckUserInterrupt();
+}
+
+// E-step at the given parameter values. On exit, wk->acc[0:(lenAcc-1)] contains the sufficient
+// statistics summed over all the individuals (see EM_lanes).
+static void EM_expect(EMdata *dat, EMwork *wk, double *r_c, double ep_c){
+  int nSnps_c = dat->nSnps;
+  // update the probabilites for pAA and pBB given the parameter values and data
+  // (these only change when the sequencing error parameter has changed)
+  if(ep_c != wk->ep_prev){
+    computeProb(dat->pAA, dat->pBB, ep_c, dat->pairRef, dat->pairAlt, wk->nPairs, wk->maxDepth, wk->powTab);
+    wk->ep_prev = ep_c;
+  }
+  // Compute the transition matrices for each interval
+  Tmat_cache(wk->Tc, r_c, r_c + nSnps_c-1, nSnps_c-1);
+  // Compute the forward and backward probabilities for each individual and the E-step
+  EM_estep(dat, wk->Tc, wk->nBlocks, wk->blockFam, wk->blockStart, wk->blockEnd, wk->acc, wk->lenAcc,
+           wk->store, wk->nThreads);
+}
+
+// M-step: update the r.f.'s and the sequencing error parameter from the sufficient statistics in acc
+// (see EM_lanes) computed at the current values of r_c and ep_c.
+static void EM_mstep(double *r_c, double *ep_c, double *acc, int lenAcc, int nSnps_c, int nTotal,
+                     int sexSpec_c, int seqError_c, int *pss_rf){
+  int snp;
+  double sumA = acc[lenAcc-2], sumB = acc[lenAcc-1];
+  // The recombination fractions
+  for(snp = 0; snp < nSnps_c-1; snp++){
+    if(sexSpec_c){
+      if(pss_rf[snp] == 1)
+        r_c[snp] = r_c[snp]/nTotal * acc[snp];
+      if(pss_rf[snp+nSnps_c-1] == 1)
+        r_c[snp + nSnps_c-1] = r_c[snp + nSnps_c-1]/nTotal * acc[snp + nSnps_c-1];
+    }
+    else{ // non sex-specific
+      r_c[snp] = r_c[snp]/(2.0*nTotal) * (acc[snp] + acc[snp + nSnps_c-1]);
+      r_c[snp + nSnps_c-1] = r_c[snp];
+    }
+  }
+  // Error parameter:
+  if(seqError_c){
+    *ep_c = sumA/(sumA + sumB);
+  }
+}
+
+// One EM iteration: out = M(E(in)), where the parameter vectors are the r.f.'s (paternal followed by
+// maternal) followed by the sequencing error parameter. Returns the log-likelihood at in.
+static double EM_step(EMdata *dat, EMwork *wk, double *in, double *out, int sexSpec_c, int seqError_c,
+                      int *pss_rf){
+  int k, npar = 2*(dat->nSnps-1) + 1;
+  EM_expect(dat, wk, in, in[npar-1]);
+  for(k = 0; k < npar; k++){
+    out[k] = in[k];
+  }
+  EM_mstep(out, out + npar-1, wk->acc, wk->lenAcc, dat->nSnps, dat->nTotal, sexSpec_c, seqError_c, pss_rf);
+  return wk->acc[wk->lenAcc-3];
+}
+
+// Bounds of the extrapolated parameter values in EM_squarem
+#define EM_PAR_MIN 1e-10
+#define EM_PAR_MAX (1 - 1e-10)
+
+// Accelerated EM algorithm (SQUAREM, scheme S3 of Varadhan and Roland 2008).
+// Each iteration takes two EM steps from theta0 (theta1 = M(theta0), theta2 = M(theta1)) and extrapolates
+// theta' = theta0 + 2*alpha*u + alpha^2*v, with u = theta1 - theta0, v = theta2 - 2*theta1 + theta0 and the
+// step length alpha = |u|/|v| restricted to [1, stepmax] (alpha = 1 gives theta2). The extrapolated values
+// are projected into the parameter space and stabilized with one more EM step. If the log-likelihood at
+// theta' is below that at theta0, the iteration falls back to theta2 (which, as an EM update, cannot
+// decrease the likelihood) and stepmax is reduced. Otherwise stepmax is increased whenever alpha hits it.
+// Input and output are as for EM_engine, with nIter the maximum number of E-steps.
+static double EM_squarem(EMdata *dat, EMwork *wk, double *r_c, double *ep_c, int sexSpec_c, int seqError_c,
+                         int nIter, double delta, int *pss_rf, int *counts){
+  int k, iter = 0, nEstep = 0, npar = 2*(dat->nSnps-1) + 1;
+  double sr2, sv2, u, v, alpha, stepmax = 1, ll0, llnew, llp;
+  double *theta0 = wk->theta;
+  double *theta1 = theta0 + npar, *theta2 = theta1 + npar, *thetap = theta2 + npar, *thetanew = thetap + npar;
+  for(k = 0; k < npar-1; k++){
+    theta0[k] = r_c[k];
+  }
+  theta0[npar-1] = *ep_c;
+  ll0 = EM_step(dat, wk, theta0, theta1, sexSpec_c, seqError_c, pss_rf);
+  nEstep++;
+  while(nEstep + 3 <= nIter){
+    iter = iter + 1;
+    EM_step(dat, wk, theta1, theta2, sexSpec_c, seqError_c, pss_rf);
+    nEstep++;
+    // Step length
+    sr2 = 0;
+    sv2 = 0;
+    for(k = 0; k < npar; k++){
+      u = theta1[k] - theta0[k];
+      v = theta2[k] - 2*theta1[k] + theta0[k];
+      sr2 = sr2 + u*u;
+      sv2 = sv2 + v*v;
+    }
+    alpha = (sv2 > 0) ? sqrt(sr2/sv2) : 1;
+    if(alpha < 1)
+      alpha = 1;
+    if(alpha > stepmax)
+      alpha = stepmax;
+    // Extrapolate (only the parameters which are being updated)
+    for(k = 0; k < npar; k++){
+      thetap[k] = theta0[k];
+      if(theta1[k] != theta0[k] || theta2[k] != theta1[k]){
+        u = theta1[k] - theta0[k];
+        v = theta2[k] - 2*theta1[k] + theta0[k];
+        thetap[k] = theta0[k] + 2*alpha*u + alpha*alpha*v;
+        if(thetap[k] < EM_PAR_MIN)
+          thetap[k] = EM_PAR_MIN;
+        else if(thetap[k] > EM_PAR_MAX)
+          thetap[k] = EM_PAR_MAX;
+      }
+    }
+    // Stabilize with an EM step and check that the likelihood has not decreased
+    llp = EM_step(dat, wk, thetap, thetanew, sexSpec_c, seqError_c, pss_rf);
+    nEstep++;
+    if(!R_FINITE(llp) || llp < ll0){
+      for(k = 0; k < npar; k++){
+        thetanew[k] = theta2[k];
+      }
+      if(alpha == stepmax)
+        stepmax = (stepmax/4 > 1) ? stepmax/4 : 1;
+    }
+    else if(alpha == stepmax)
+      stepmax = 4*stepmax;
+    // Start the next iteration from the new values
+    for(k = 0; k < npar; k++){
+      theta0[k] = thetanew[k];
+    }
+    llnew = EM_step(dat, wk, theta0, theta1, sexSpec_c, seqError_c, pss_rf);
+    nEstep++;
+    if(llnew - ll0 <= delta){
+      ll0 = llnew;
+      break;
+    }
+    ll0 = llnew;
+    EM_interrupt(wk);
+  }
+  // As in EM_engine, return the parameters after the last M-step and the log-likelihood before it
+  for(k = 0; k < npar-1; k++){
+    r_c[k] = theta1[k];
+  }
+  *ep_c = theta1[npar-1];
+  counts[0] = iter;
+  counts[1] = nEstep;
+  return ll0;
+}
+
+// The EM algorithm
+// Input variables:
+//  - r_c: recombination fractions (paternal followed by maternal). Updated in place.
+//  - ep_c: sequencing error parameter. Updated in place.
+//  - dat, wk: the data (see EMdata) and the working arrays set up by EM_setup.
+//  - sexSpec_c: whether the r.f.'s are sex-specific.
+//  - seqError_c: whether the sequencing error parameter is estimated.
+//  - nIter, delta: maximum number of iterations and tolerance on the log-likelihood.
+//  - pss_rf: which of the sex-specific r.f.'s are to be estimated.
+//  - accel: whether to use the accelerated EM algorithm (see EM_squarem).
+//  - counts: on exit, the number of iterations and the number of E-steps (forward-backward passes).
+// Returns the log-likelihood value at the final parameter values.
+// Nothing is allocated here, so that EM_run can be called from the threads of EM_batch.
+static double EM_run(double *r_c, double *ep_c, EMdata *dat, EMwork *wk, int sexSpec_c, int seqError_c,
+                     int nIter, double delta, int *pss_rf, int accel, int *counts){
+  // Initialize variables
+  int snp, iter, nSnps_c = dat->nSnps;
+  double *acc = wk->acc, llval = 0, prellval = 0;
   // if sex-specific rf
   if(sexSpec_c){
     for(snp = 0; snp < nSnps_c-1; snp++){
@@ -239,276 +1046,200 @@ SEXP EM_HMM(SEXP r, SEXP ep, SEXP depth_Ref, SEXP depth_Alt, SEXP OPGP, SEXP noF
         r_c[snp + nSnps_c-1] = 0;
       }
     }
-  } 
-  // Probability matrics
-  double pAA[nTotal][nSnps_c];
-  double pAB[nTotal][nSnps_c];
-  double pBB[nTotal][nSnps_c];
-  double bin_coef[nTotal][nSnps_c];
-  double *ppAA, *ppBB, *pbin_coef;
-  int Iaa[4][nTotal][nSnps_c], Ibb[4][nTotal][nSnps_c];
-  ppAA = &pAA[0][0];
-  ppBB = &pBB[0][0];
-  pbin_coef = &bin_coef[0][0];
-  //double (*pbin_coef)[nSnps_c] = &bin_coef;
-  // Compute the probs for the heterozygous calls
-  for(fam = 0; fam < noFam_c; fam++){
-    for(ind = 0; ind < nInd_c[fam]; ind++){
-      indx = ind + indSum[fam];
-      for(snp = 0; snp < nSnps_c; snp++){
-        bin_coef[indx][snp] = 1; //binomial(pdepth_Ref[indx + nTotal*snp], pdepth_Alt[indx + nTotal*snp]);
-        pAB[indx][snp] = bin_coef[indx][snp] * powl(0.5,pdepth_Ref[indx + nTotal*snp] + pdepth_Alt[indx + nTotal*snp]);
-        for(s1 = 0; s1 < 4; s1++){
-          g = Iindx(pOPGP[snp*noFam_c + fam], s1 + 1);
-          if( g == 1 ){
-            Iaa[s1][indx][snp] = 1;
-            Ibb[s1][indx][snp] = 0;
-          }
-          else if( g == 2 ){
-            Ibb[s1][indx][snp] = 1;
-            Iaa[s1][indx][snp] = 0;
-          }
-          else{
-            Iaa[s1][indx][snp] = 0;
-            Ibb[s1][indx][snp] = 0;
-          }
-        }
-      }
-    }
   }
-  // Define the output variable
-  double *prout, *pepout, *pllout;
-  SEXP rout = PROTECT(allocVector(REALSXP, 2*(nSnps_c-1)));
-  SEXP epout = PROTECT(allocVector(REALSXP, 1));
-  SEXP llout = PROTECT(allocVector(REALSXP, 1));
-  prout = REAL(rout);
-  pepout = REAL(epout);
-  pllout = REAL(llout);
-  SEXP pout = PROTECT(allocVector(VECSXP, 3));
-  double llval = 0, prellval = 0;
+  if(accel && nIter >= 4)
+    return EM_squarem(dat, wk, r_c, ep_c, sexSpec_c, seqError_c, nIter, delta, pss_rf, counts);
   
   /////// Start algorithm
   iter = 0;
   while( (iter < 2) || ((iter < nIter) & ((llval - prellval) > delta))){
     iter = iter + 1;
     prellval = llval;
-    llval = 0;
     
-    // unpdate the probabilites for pAA and pBB given the parameter values and data.
-    computeProb(ppAA, ppBB, pbin_coef, ep_c, pdepth_Ref, pdepth_Alt, nTotal, nSnps_c);
-  
-    // Compute the forward and backward probabilities for each individual
-    for(fam = 0; fam < noFam_c; fam++){
-      for(ind = 0; ind < nInd_c[fam]; ind++){
-        indx = ind + indSum[fam];
-        //Rprintf("indSum %i\n", indSum[fam]);
-        //Rprintf("indx %i\n", indx);
-        //Rprintf("bin_coef %f at snp %i: ind %i:\n",bin_coef[indx][0], 0, indx);
-        //Rprintf("pAA %f at snp %i: ind %i:\n",pAA[indx][0], 0, indx);
-        //Rprintf("pAB %f at snp %i: ind %i:\n",pAB[indx][0], 0, indx);
-        //Rprintf("pBB %f at snp %i: ind %i:\n",pBB[indx][0], 0, indx);
-        /////////////////////////////////////////
-        // Compute forward probabilities at snp 1
-        sum = 0;
-        //Rprintf("OPGP :%.6f at snp %i in ind %i\n", pOPGP[fam], 0, ind);
-        for(s1 = 0; s1 < 4; s1++){
-          //Rprintf("pAA %.16f, pAB %.16f pBB %.16f at snp %i in ind %i\n", pAA[indx][0], pAB[indx][0], pBB[indx][0], 0, ind);
-          //Rprintf("Q value :%.22f at snp %i in ind %i\n", Qentry(pOPGP[fam], pAA[indx][0], pAB[indx][0], pBB[indx][0], s1+1), 0, ind);
-          alphaDot[s1] = 0.25 * Qentry(pOPGP[fam], pAA[indx][0], pAB[indx][0], pBB[indx][0], s1+1);
-          sum = sum + alphaDot[s1];
-        }
-        //Rprintf("Q value :%.22f at snp %i in ind %i\n", sum, 0, ind);
-        // Scale forward probabilities
-        for(s1 = 0; s1 < 4; s1++){
-          alphaTilde[s1][indx][0] = alphaDot[s1]/sum;
-        }
-        //Rprintf("New weight :%.6f at snp %i\n", sum, 1);
-      
-        // add contribution to likelihood
-        log_w[indx][0] = log(sum);
-        llval = llval + log(sum);
-        //w_logcumsum = log(sum);
-        //llval = llval + w_logcumsum;
-        // llval = llval - log(sum);
-        //Rprintf("llvalue :%.6f at snp %i\n", llval, 0);
-        
-        // iterate over the remaining SNPs
-        for(snp = 1; snp < nSnps_c; snp++){
-          //Rprintf("snp %i and ind %i\n", snp, ind);
-          //Rprintf("snp %i\n", snp );
-          //Rprintf("nSnps %i\n", nSnps_c );
-          // compute the next forward probabilities for snp j
-          //Rprintf("pAA %f at snp %i: ind %i:\n",pAA[indx][snp], snp, ind);
-          //Rprintf("pAB %f at snp %i: ind %i:\n",pAB[indx][snp], snp, ind);
-          //Rprintf("pBB %f at snp %i: ind %i:\n",pBB[indx][snp], snp, ind);
-          for(s2 = 0; s2 < 4; s2++){
-            sum = 0;
-            for(s1 = 0; s1 < 4; s1++){
-              sum = sum + Tmat_ss(s1, s2, r_c[snp-1], r_c[snp-1+nSnps_c-1]) * alphaTilde[s1][indx][snp-1];
-              
-              //Rprintf("Tmat %.16f for r_c %.12f and %.12f and state %i and %i\n", Tmat_ss(s1, s2, r_c[snp-1], r_c[snp-1+nSnps_c-1]), r_c[snp-1], r_c[snp-1+nSnps_c-1], s1, s2);
-            }
-            //Rprintf("sum :%.16f at state %i, snp %i and ind %i\n", sum, s2, snp, ind);
-            //Rprintf("Q value :%.22f at snp %i in ind %i\n", Qentry(pOPGP[snp*noFam_c + fam], pAA[indx][snp], pAB[indx][snp], pBB[indx][snp], s2+1), snp, ind);
-            //Rprintf("pAA %.16f, pAB %.16f pBB %.16f at snp %i in ind %i\n", pAA[indx][snp], pAB[indx][snp], pBB[indx][snp], snp, indx);
-            //Rprintf("Q value :%.22f at snp %i in ind %i\n", Qentry(pOPGP[snp*noFam_c + fam], pAA[indx][snp], pAB[indx][snp], pBB[indx][snp], s2+1), snp, indx);
-            alphaDot[s2] = Qentry(pOPGP[snp*noFam_c + fam], pAA[indx][snp], pAB[indx][snp], pBB[indx][snp], s2+1) * sum;
-            //Rprintf("alphaDot :%.22f at state %i, snp %i and ind %i\n", alphaDot[s2], s2, snp, ind);
-          }
-          
-          // Compute the weight for snp \ell
-          w_new = 0;
-          for(s2 = 0; s2 < 4; s2++){
-            w_new = w_new + alphaDot[s2];
-          }
-          // Add contribution to the likelihood
-          //llval = llval + log(w_new) + w_logcumsum;
-          //w_logcumsum = w_logcumsum + log(w_new);
-          log_w[indx][snp] = log(w_new);
-          // Scale the forward probability vector
-          for(s2 = 0; s2 < 4; s2++){
-            alphaTilde[s2][indx][snp] = alphaDot[s2]/w_new;
-            //Rprintf("alphaTilde :%.22f at state %i, snp %i and ind %i\n", alphaTilde[s2][indx][snp], s2, snp, ind);
-          }
-          // Add contribution to the likelihood
-          llval = llval + log(w_new);
-          //Rprintf("llvalue :%.8f at iter %i\n", llval, indx);
-        }
-        //////////////////////
-        // Compute the backward probabilities
-        for(s1 = 0; s1 < 4; s1++){
-          betaTilde[s1][indx][nSnps_c-1] = 1/exp(log_w[indx][nSnps_c-1]);
-          //sum = log(betaTilde[s1][indx][nSnps_c-1]) - (log(1) -  log_w[indx][nSnps_c-1]);
-          //Rprintf("log(beta) :%.22f at state %i, snp %i and ind %i\n", exp(sum), s1, nSnps_c-1, ind);
-        }
-        // iterate over the remaining SNPs
-        sum = 0;
-        for(snp = nSnps_c-2; snp > -1; snp--){
-          for(s1 = 0; s1 < 4; s1++){
-            sum = 0;
-            for(s2 = 0; s2 < 4; s2++){
-              sum = sum + Qentry(pOPGP[(snp+1)*noFam_c + fam], pAA[indx][snp+1], pAB[indx][snp+1], pBB[indx][snp+1], s2+1) * 
-                Tmat_ss(s1, s2, r_c[snp], r_c[snp+nSnps_c-1]) * betaTilde[s2][indx][snp+1];
-            }
-            betaDot[s1] = sum;
-          }
-          // Scale the backward probability vector
-          for(s1 = 0; s1 < 4; s1++){
-            betaTilde[s1][indx][snp] = betaDot[s1]/exp(log_w[indx][snp]);
-            //Rprintf("betaTilde :%.6f at state %i, snp %i and ind %i\n", betaTilde[s1][indx][snp], s1, snp, ind);
-          }
-        }
-        ///////// E-step:
-        for(snp = 0; snp < nSnps_c - 1; snp++){
-          for(s1 = 0; s1 < 4; s1++){
-            uProb[s1][indx][snp] = (alphaTilde[s1][indx][snp] * betaTilde[s1][indx][snp])/exp(-log_w[indx][snp]);
-            for(s2 = 0; s2 < 4; s2++){
-              vProb[s1][s2][indx][snp] = alphaTilde[s1][indx][snp] * Tmat_ss(s1, s2, r_c[snp], r_c[snp+nSnps_c-1]) *
-                Qentry(pOPGP[(snp+1)*noFam_c + fam], pAA[indx][snp+1], pAB[indx][snp+1], pBB[indx][snp+1], s2+1)  * 
-                betaTilde[s2][indx][snp+1];
-            }
-          }
-        }
-        snp = nSnps_c - 1;
-        for(s1 = 0; s1 < 4; s1++){
-          uProb[s1][indx][snp] = (alphaTilde[s1][indx][snp] * betaTilde[s1][indx][snp])/exp(-log_w[indx][snp]); 
-        }
-      }  
-    }
+    // E-step
+    EM_expect(dat, wk, r_c, *ep_c);
+    llval = acc[wk->lenAcc-3];
 
-    //////// M-step:
-    // The recombination fractions
-    if(sexSpec_c){
-      //Rprintf("Sex-Specific rf's\n");
-      for(snp = 0; snp < nSnps_c-1; snp++){
-        // Paternal
-        if(pss_rf[snp] == 1){
-          sum = 0;
-          for(fam = 0; fam < noFam_c; fam++){
-            for(ind = 0; ind < nInd_c[fam]; ind++){
-              indx = ind + indSum[fam];
-              for(s1 = 0; s1 < 2; s1++){
-                for(s2 = 2; s2 < 4; s2++){
-                  sum = sum + vProb[s1][s2][indx][snp] + vProb[s1+2][s2-2][indx][snp];
-                }
-              }
-            }
-          }
-          r_c[snp] = 1.0/nTotal * sum;
-        }
-        // Maternal
-        if(pss_rf[snp+nSnps_c-1] == 1){
-          sum = 0;
-          for(fam = 0; fam < noFam_c; fam++){
-            for(ind = 0; ind < nInd_c[fam]; ind++){
-              indx = ind + indSum[fam];
-              for(s1 = 0; s1 < 2; s1++){
-                for(s2 = 0; s2 < 2; s2++){
-                  sum = sum + vProb[2*s1][1+2*s2][indx][snp] + vProb[1+2*s1][2*s2][indx][snp];
-                }
-              }
-            }
-          }
-          r_c[snp + nSnps_c-1] = 1.0/nTotal * sum;
-        }
-      }
-    }
-    else{ // non sex-specific
-      //Rprintf("non Sex-Specific rf's\n");
-      for(snp = 0; snp < nSnps_c-1; snp++){
-        sum = 0;
-        for(fam = 0; fam < noFam_c; fam++){
-          for(ind = 0; ind < nInd_c[fam]; ind++){
-            indx = ind + indSum[fam];
-            for(s1 = 0; s1 < 4; s1++){
-              for(s2 = 0; s2 < 4; s2++){
-                sum = sum + vProb[s1][s2][indx][snp] * Tcount(s1,s2);
-                //Rprintf("sum: %.36Le and snp %i and s1 %i and s2 %i\n", vProb[s1][s2][indx][snp] * Tcount(s1,s2), snp, s1, s2);
-              }
-            }
-          }
-        }
-        //Rprintf("sum: %.36Le and snp %i\n", sum, snp);
-        //Rprintf("r_c: %.36Le and snp %i\n", 1.0/(2.0*nTotal) * sum, snp);
-        r_c[snp] = 1.0/(2.0*nTotal) * sum;
-        r_c[snp + nSnps_c-1] = 1.0/(2.0*nTotal) * sum;
-      }
-    }
-    // Error parameter:
-    if(seqError_c){
-      sumA = 0;
-      sumB = 0;
-      for(snp = 0; snp < nSnps_c; snp++){
-        for(fam = 0; fam < noFam_c; fam++){
-          for(ind = 0; ind < nInd_c[fam]; ind++){
-            indx = ind + indSum[fam];
-            a = pdepth_Ref[indx + nTotal*snp];
-            b = pdepth_Alt[indx + nTotal*snp];
-            //Rprintf("a :%.8f at snp %i and ind %i\n", a, snp, indx);
-            //Rprintf("b :%.8f at snp %i and ind %i\n", b, snp, indx);
-            for(s1 = 0; s1 < 4; s1++){
-              //Rprintf("Iaa :%i at s1 %i and snp %i and ind %i\n", Iaa[s1][indx][snp], s1,snp, indx);
-              //Rprintf("Ibb :%i at s1 %i and snp %i and ind %i\n", Ibb[s1][indx][snp], s1,snp, indx);
-              sumA = sumA + uProb[s1][indx][snp]*(b*Iaa[s1][indx][snp] +  a*Ibb[s1][indx][snp]);
-              sumB = sumB + uProb[s1][indx][snp]*(a*Iaa[s1][indx][snp] +  b*Ibb[s1][indx][snp]);
-
-            }
-          }
-        }
-      }
-      ep_c = sumA/(sumA + sumB);
+    // M-step
+    EM_mstep(r_c, ep_c, acc, wk->lenAcc, nSnps_c, dat->nTotal, sexSpec_c, seqError_c, pss_rf);
+    EM_interrupt(wk);
+  }
+  counts[0] = iter;
+  counts[1] = iter;
+  return llval;
+}
+
+// The EM algorithm using nThreads threads in the E-step, with the forward probabilities stored as given
+// by single and ckpt (see EM_setup and EM_run for the other input variables)
+static double EM_engine(double *r_c, double *ep_c, EMdata *dat, int sexSpec_c, int seqError_c,
+                        int nIter, double delta, int *pss_rf, int nThreads, int accel, int single, int ckpt,
+                        int *counts){
+  EMwork wk;
+  EM_setup(dat, &wk, nThreads, single, ckpt);
+  return EM_run(r_c, ep_c, dat, &wk, sexSpec_c, seqError_c, nIter, delta, pss_rf, accel, counts);
+}
+
+
+// The log-likelihood and its gradient with respect to the r.f.'s (paternal followed by maternal, in grad_r)
+// and the sequencing error parameter (grad_ep), computed from a single forward-backward pass.
+// The derivative of the likelihood of an individual with respect to the paternal r.f. of an interval is the
+// sum of alpha[s1]*dT[s1,s2]*Q[s2]*beta[s2], where dT = dP x M. As the sum of alpha[s1]*T[s1,s2]*Q[s2]*beta[s2]
+// over all the states is one, this is (A - 1)/(1 - r_f), where A is the E-step sum of EM_lanes, and similarly
+// for the maternal r.f. The derivative with respect to epsilon is sumA/epsilon - sumB/(1-epsilon).
+static double EM_score(EMdata *dat, EMwork *wk, double *r_c, double ep_c, double *grad_r, double *grad_ep){
+  int snp, nSnps_c = dat->nSnps, lenAcc = wk->lenAcc;
+  double *acc = wk->acc;
+  EM_expect(dat, wk, r_c, ep_c);
+  for(snp = 0; snp < 2*(nSnps_c-1); snp++){
+    grad_r[snp] = (acc[snp] - dat->nTotal)/(1 - r_c[snp]);
+  }
+  if(ep_c > 0)
+    *grad_ep = acc[lenAcc-2]/ep_c - acc[lenAcc-1]/(1 - ep_c);
+  else
+    *grad_ep = 0;
+  return acc[lenAcc-3];
+}
+
+
+//////////// Quasi-Newton (L-BFGS-B) optimization of the likelihood using the exact gradient /////////////////////
+// The r.f.'s are on the logit2 scale (r = 0.5/(1+exp(-x)), phase known) or the logit scale (r = 1/(1+exp(-x)),
+// phase unknown) and the sequencing error parameter is on the logit scale, as in the optim versions in R.
+
+// Parameters of the optimization
+typedef struct {
+  EMdata *dat;
+  EMwork *wk;
+  int nr, sexSpec, seqError;
+  int *rIndx;           // index in r_c of each r.f. parameter
+  double rmax;          // upper bound of the r.f.'s (0.5 or 1)
+  double *r_c, ep_c;    // parameter values on the original scale
+  double *grad_r, *xval, *gval, fval;  // gradient on the original scale and the cached value of x, f and g
+} EMoptim;
+
+// Transform the parameters to the original scale
+static void EM_untransform(EMoptim *op, double *x){
+  int k, nSnps_c = op->dat->nSnps;
+  for(k = 0; k < op->nr; k++){
+    op->r_c[op->rIndx[k]] = op->rmax/(1 + exp(-x[k]));
+    if(!op->sexSpec)
+      op->r_c[op->rIndx[k] + nSnps_c-1] = op->r_c[op->rIndx[k]];
+  }
+  if(op->seqError)
+    op->ep_c = 1/(1 + exp(-x[op->nr]));
+}
+
+// Negative log-likelihood (optimfn). The gradient is computed at the same time and cached for EM_optim_gr.
+static double EM_optim_fn(int n, double *x, void *ex){
+  int k, nSnps_c;
+  double r, grad_ep, llval;
+  EMoptim *op = (EMoptim *) ex;
+  nSnps_c = op->dat->nSnps;
+  EM_untransform(op, x);
+  llval = EM_score(op->dat, op->wk, op->r_c, op->ep_c, op->grad_r, &grad_ep);
+  // chain rule: dr/dx = r*(1 - r/rmax) and dep/dx = ep*(1-ep)
+  for(k = 0; k < op->nr; k++){
+    r = op->r_c[op->rIndx[k]];
+    op->gval[k] = op->grad_r[op->rIndx[k]];
+    if(!op->sexSpec)
+      op->gval[k] = op->gval[k] + op->grad_r[op->rIndx[k] + nSnps_c-1];
+    op->gval[k] = -op->gval[k] * r * (1 - r/op->rmax);
+  }
+  if(op->seqError)
+    op->gval[op->nr] = -grad_ep * op->ep_c * (1 - op->ep_c);
+  for(k = 0; k < n; k++)
+    op->xval[k] = x[k];
+  op->fval = -llval;
+  R_CheckUserInterrupt();
+  return op->fval;
+}
+
+// Gradient of the negative log-likelihood (optimgr)
+static void EM_optim_gr(int n, double *x, double *gr, void *ex){
+  int k;
+  EMoptim *op = (EMoptim *) ex;
+  for(k = 0; k < n; k++){
+    if(x[k] != op->xval[k]){
+      EM_optim_fn(n, x, ex);
+      break;
     }
-    //Rprintf("llvalue :%.8f at iter %i\n", llval, iter);
-    //Rprintf("prellval :%.8f at iter %i\n", prellval, iter);
-    //Rprintf("diff in lik :%.8f at iter %i\n", (llval - prellval) , iter);
-    //Rprintf("llvalue :%.22f at iter %i\n", llval, iter);
-    //Rprintf("ep :%.22f at iter %i\n", ep_c, iter);
-    //for(snp = 0; snp < nSnps_c - 1; snp++){
-    //    Rprintf("r_c :%.22f at iter %i\n", r_c[snp], iter);
-    //}
   }
-  
-  // Set up the R output object.
+  for(k = 0; k < n; k++)
+    gr[k] = op->gval[k];
+}
+
+// Optimize the likelihood with L-BFGS-B.
+// Input variables are as for EM_engine, with para = (maxit, factr, pgtol) and rmax the upper bound of the r.f.'s.
+// On exit, fail and counts (function and gradient evaluations) are as in optim.
+static double EM_optim(double *r_c, double *ep_c, EMdata *dat, int sexSpec_c, int seqError_c, double rmax,
+                       int *pss_rf, double *para, int nThreads, int *fail, int *counts){
+  int k, snp, npar, nSnps_c = dat->nSnps;
+  double r, Fmin, lim;
+  char msg[60];
+  EMwork wk;
+  EMoptim op;
+  EM_setup(dat, &wk, nThreads, 0, 0);
+  op.dat = dat;
+  op.wk = &wk;
+  op.sexSpec = sexSpec_c;
+  op.seqError = seqError_c;
+  op.rmax = rmax;
+  op.r_c = r_c;
+  op.ep_c = *ep_c;
+  // Work out which r.f.'s are parameters
+  op.rIndx = (int *) R_alloc(2 * (size_t) (nSnps_c-1), sizeof(int));
+  op.nr = 0;
+  for(snp = 0; snp < (sexSpec_c ? 2 : 1)*(nSnps_c-1); snp++){
+    if(!sexSpec_c || pss_rf[snp] == 1)
+      op.rIndx[op.nr++] = snp;
+    else
+      r_c[snp] = 0;
+  }
+  npar = op.nr + (seqError_c ? 1 : 0);
+  op.grad_r = (double *) R_alloc(2 * (size_t) (nSnps_c-1), sizeof(double));
+  op.xval = (double *) R_alloc(npar + 1, sizeof(double));
+  op.gval = (double *) R_alloc(npar + 1, sizeof(double));
+  double *x = (double *) R_alloc(npar + 1, sizeof(double));
+  double *lower = (double *) R_alloc(npar + 1, sizeof(double));
+  double *upper = (double *) R_alloc(npar + 1, sizeof(double));
+  int *nbd = (int *) R_alloc(npar + 1, sizeof(int));
+  // Starting values (kept away from the boundaries where the transformation is infinite)
+  lim = 1e-10;
+  for(k = 0; k < op.nr; k++){
+    r = r_c[op.rIndx[k]];
+    r = (r < lim*rmax) ? lim*rmax : ((r > (1-lim)*rmax) ? (1-lim)*rmax : r);
+    x[k] = log(r/(rmax - r));
+  }
+  if(seqError_c){
+    r = (*ep_c < lim) ? lim : ((*ep_c > 1-lim) ? 1-lim : *ep_c);
+    x[op.nr] = log(r/(1 - r));
+  }
+  for(k = 0; k < npar; k++)
+    nbd[k] = 0;   // unbounded
+  *fail = 0;
+  counts[0] = counts[1] = 0;
+  if(npar > 0){
+    lbfgsb(npar, 5, x, lower, upper, nbd, &Fmin, EM_optim_fn, EM_optim_gr, fail, (void *) &op,
+           para[1], para[2], &counts[0], &counts[1], (int) para[0], msg, 0, 10);
+  }
+  // Final values (and log-likelihood) at the optimum
+  Fmin = EM_optim_fn(npar, x, (void *) &op);
+  *ep_c = op.ep_c;
+  return -Fmin;
+}
+
+
+// Set up the R output object of the EM algorithm. If counts is not NULL, the number of iterations
+// and E-steps (see EM_engine) are added as the fourth element.
+static SEXP EM_output(double *r_c, double ep_c, double llval, int nSnps_c, int *counts){
+  int snp, parent;
+  double *prout, *pepout, *pllout;
+  SEXP rout = PROTECT(allocVector(REALSXP, 2*(nSnps_c-1)));
+  SEXP epout = PROTECT(allocVector(REALSXP, 1));
+  SEXP llout = PROTECT(allocVector(REALSXP, 1));
+  prout = REAL(rout);
+  pepout = REAL(epout);
+  pllout = REAL(llout);
+  SEXP pout = PROTECT(allocVector(VECSXP, counts ? 4 : 3));
   for(snp = 0; snp < nSnps_c - 1; snp++){
     for(parent = 0; parent < 2; parent++){
       prout[snp+parent*(nSnps_c-1)] = r_c[snp+parent*(nSnps_c-1)];
@@ -519,346 +1250,790 @@ SEXP EM_HMM(SEXP r, SEXP ep, SEXP depth_Ref, SEXP depth_Alt, SEXP OPGP, SEXP noF
   SET_VECTOR_ELT(pout, 0, rout);
   SET_VECTOR_ELT(pout, 1, epout);
   SET_VECTOR_ELT(pout, 2, llout);
-  // Return the parameter estimates of log-likelihood value
+  if(counts){
+    SEXP cout = allocVector(INTSXP, 2);
+    SET_VECTOR_ELT(pout, 3, cout);
+    INTEGER(cout)[0] = counts[0];
+    INTEGER(cout)[1] = counts[1];
+  }
   UNPROTECT(4);
   return pout;
 }
 
 
+// Number of threads for the E-step. This is the (optional) third element of the para vector.
+static int EM_nThreads(SEXP para){
+  if(LENGTH(para) > 2)
+    return (int) REAL(para)[2];
+  return 1;
+}
+
+// Whether to use the accelerated EM algorithm. This is the (optional) fourth element of the para vector.
+static int EM_accel(SEXP para){
+  if(LENGTH(para) > 3)
+    return REAL(para)[3] != 0;
+  return 0;
+}
+
+// Whether to store the forward probabilities in single precision. This is the (optional) fifth element
+// of the para vector.
+static int EM_single(SEXP para){
+  if(LENGTH(para) > 4)
+    return REAL(para)[4] != 0;
+  return 0;
+}
+
+// Number of SNPs between the checkpoints of the forward probabilities (0 to store them at every SNP and
+// negative for the square root of the number of SNPs, see EMstore). This is the (optional) sixth element
+// of the para vector.
+static int EM_ckpt(SEXP para){
+  if(LENGTH(para) > 5)
+    return (int) REAL(para)[5];
+  return 0;
+}
+
+
+// Set the read counts of the E-step from the R input, which are either integer matrices with the
+// individuals as rows, or sparse matrices stored by individual (see sparse_depth in R) as lists of
+// (p, j, x, Dim), where the nonzero cells of individual ind are p[ind],...,p[ind+1]-1 with the (0-based)
+// SNPs in j and the read counts in x. The sparse matrices of both alleles have the same nonzero cells.
+static void EM_depth(EMdata *dat, SEXP depth_Ref, SEXP depth_Alt){
+  int fam, nTotal = 0;
+  SEXP ptr, snp, altPtr, altSnp;
+  if(!isNewList(depth_Ref)){
+    dat->depth_Ref = INTEGER(depth_Ref);
+    dat->depth_Alt = INTEGER(depth_Alt);
+    dat->depth_ptr = dat->depth_snp = NULL;
+    return;
+  }
+  if(!isNewList(depth_Alt) || LENGTH(depth_Ref) < 4 || LENGTH(depth_Alt) < 4)
+    error("The read counts of both alleles must be sparse matrices");
+  for(fam = 0; fam < dat->noFam; fam++)
+    nTotal = nTotal + dat->nInd[fam];
+  ptr = VECTOR_ELT(depth_Ref, 0);
+  snp = VECTOR_ELT(depth_Ref, 1);
+  if(LENGTH(ptr) != nTotal + 1 || INTEGER(VECTOR_ELT(depth_Ref, 3))[1] != dat->nSnps || INTEGER(ptr)[nTotal] != XLENGTH(snp) ||
+     XLENGTH(VECTOR_ELT(depth_Ref, 2)) != XLENGTH(snp) || XLENGTH(VECTOR_ELT(depth_Alt, 2)) != XLENGTH(snp))
+    error("The sparse read count matrices do not match the number of individuals or SNPs");
+  // the nonzero cells are usually the same vectors (and so are only compared when they are not)
+  altPtr = VECTOR_ELT(depth_Alt, 0);
+  altSnp = VECTOR_ELT(depth_Alt, 1);
+  if( (altPtr != ptr && (LENGTH(altPtr) != LENGTH(ptr) || memcmp(INTEGER(altPtr), INTEGER(ptr), LENGTH(ptr)*sizeof(int)))) ||
+      (altSnp != snp && (XLENGTH(altSnp) != XLENGTH(snp) || memcmp(INTEGER(altSnp), INTEGER(snp), XLENGTH(snp)*sizeof(int)))) )
+    error("The sparse read count matrices of the two alleles must have the same nonzero cells");
+  dat->depth_ptr = INTEGER(ptr);
+  dat->depth_snp = INTEGER(snp);
+  dat->depth_Ref = INTEGER(VECTOR_ELT(depth_Ref, 2));
+  dat->depth_Alt = INTEGER(VECTOR_ELT(depth_Alt, 2));
+}
+
+// Set up the data of the E-step from the R input. The genotype matrix is the OPGP matrix when phased
+// is TRUE and the config (segregation type) matrix otherwise.
+static void EM_data(EMdata *dat, SEXP geno, SEXP depth_Ref, SEXP depth_Alt, SEXP noFam, SEXP nInd,
+                    SEXP nSnps, int phased){
+  int fam;
+  dat->noFam = INTEGER(noFam)[0];
+  dat->nSnps = INTEGER(nSnps)[0];
+  dat->nTotal = 0;
+  dat->nInd = (int *) R_alloc(dat->noFam, sizeof(int));
+  for(fam = 0; fam < dat->noFam; fam++){
+    dat->nInd[fam] = INTEGER(nInd)[fam];
+  }
+  dat->indSum = dat->pair = NULL;
+  dat->pAA = dat->pAB = dat->pBB = NULL;
+  dat->geno = INTEGER(geno);
+  EM_depth(dat, depth_Ref, depth_Alt);
+  dat->gtab = phased ? geno_OPGP : geno_config;
+  if(check_geno(dat->geno, (R_xlen_t) dat->noFam * dat->nSnps, phased ? 16 : 5))
+    error(phased ? "Invalid OPGP value" : "Invalid segregation type (config) value");
+}
 
-// Function for extracting entries of the emission probability matrix
-// when the OPGPs are known
-int Iindx_up(int config, int elem){
-  switch(config){
-  case 1:
-    if(elem == 1)
-      return 2;
-    else if ((elem == 2)|(elem == 3))  
-      return 0;
-    else if (elem == 4)
-      return 1;
-  case 2:
-    if ((elem == 1)|(elem == 2))
-      return 0;
-    else if ((elem == 3)|(elem == 4))
-      return 1;
-  case 3:
-    if ((elem == 1)|(elem == 2))
-      return 2;
-    else if ((elem == 3)|(elem == 4))
-      return 0;
-  case 4:
-    if ((elem == 1)|(elem == 3))
-      return 0;
-    else if ((elem == 2)|(elem == 4))
-      return 1;
-  case 5:
-    if ((elem == 1)|(elem == 3))
-      return 2;
-    else if ((elem == 2)|(elem == 4))
-      return 0;
-  } // end of Switch
-  return -1;
+// Estimate of the memory (in bytes) allocated by EM_setup for families of nInd individuals, nSnps SNPs,
+// nCells cells whose depth pair index is stored (see EM_pairs) and read counts of at most maxDepth, with
+// the number of threads, single and checkpoint arguments in para (see EM_HMM). It is an upper bound for the
+// unique depth pairs and the SNPs with reads of the groups of lanes of EM_lanes_sparse, which depend on the
+// read counts, and includes the hash table of depth_pairs (which is freed at the end of EM_pairs).
+SEXP EM_memory(SEXP nInd, SEXP nSnps, SEXP maxDepth, SEXP nCells, SEXP para){
+  int fam, blockSize, nRows, noFam_c = LENGTH(nInd), nSnps_c = INTEGER(nSnps)[0], nTotal = 0;
+  int nThreads = EM_threads(EM_nThreads(para)), single = EM_single(para), ckpt = EM_ckpt(para);
+  double nBlocks = 0, nGroups = 0, nPairs, mem;
+  for(fam = 0; fam < noFam_c; fam++)
+    nTotal = nTotal + INTEGER(nInd)[fam];
+  blockSize = EM_block_size(nTotal);
+  for(fam = 0; fam < noFam_c; fam++){
+    nBlocks = nBlocks + (INTEGER(nInd)[fam] + blockSize - 1)/blockSize;
+    // the last block of a family can have a group with unused lanes
+    nGroups = nGroups + (INTEGER(nInd)[fam]/blockSize) * (blockSize/NLANE) +
+      (INTEGER(nInd)[fam] % blockSize + NLANE - 1)/NLANE;
+  }
+  nRows = EM_rows(nSnps_c, &ckpt);
+  if(ckpt > 0)
+    single = 0;
+  // Unique depth pairs (see depth_pairs): their depths, the hash table and the emission probabilities
+  nPairs = fmin(REAL(nCells)[0] + 1, R_pow_di(INTEGER(maxDepth)[0] + 1.0, 2));
+  mem = nPairs * (2*sizeof(int) + 4*sizeof(int) + 3*sizeof(double)) + 2 * (INTEGER(maxDepth)[0] + 1.0) * sizeof(double);
+  // Index of the depth pair of each cell and the families
+  mem = mem + (REAL(nCells)[0] + 1) * sizeof(int) + 2.0 * noFam_c * sizeof(int);
+  // Blocks, their accumulators, the transition matrices and the parameter vectors of EM_squarem
+  mem = mem + nBlocks * (3*sizeof(int) + (2*(nSnps_c - 1) + 3.0) * sizeof(double)) +
+    4 * (nSnps_c - 1.0) * sizeof(double) + 5 * (2*(nSnps_c - 1) + 1.0) * sizeof(double);
+  // Stored forward probabilities, depth pairs and work array of EM_lanes_sparse of each thread
+  mem = mem + nThreads * (sizeof(EMstore) + (double) NLANE * nRows * (4*(single ? sizeof(float) : sizeof(double)) + sizeof(double)) +
+                          (double) NLANE * nSnps_c * sizeof(int) + (ckpt == 0) * nSnps_c * (double) sizeof(double));
+  // Number of SNPs with reads, order and sort key of the individuals, and the steps of the groups of lanes
+  // (at most EM_SPARSE of the SNPs in each group, only without checkpoints)
+  mem = mem + (double) nTotal * (3*sizeof(int) + sizeof(double) + sizeof(R_xlen_t)) +
+    (ckpt == 0) * nGroups * NLANE * floor(EM_SPARSE * nSnps_c) * 2 * sizeof(int);
+  return ScalarReal(mem);
 }
 
 
+SEXP EM_HMM(SEXP r, SEXP ep, SEXP depth_Ref, SEXP depth_Alt, SEXP OPGP, SEXP noFam, SEXP nInd, SEXP nSnps,
+            SEXP sexSpec, SEXP seqError, SEXP para, SEXP ss_rf){
+  // Initialize variables
+  int snp, nSnps_c;
+  int counts[2];
+  double *r_c, ep_c, llval;
+  // Copy values of R input into C objects
+  nSnps_c = INTEGER(nSnps)[0];
+  r_c = (double *) R_alloc(2 * (size_t) (nSnps_c - 1), sizeof(double));
+  for(snp = 0; snp < 2*(nSnps_c - 1); snp++){
+    r_c[snp] = REAL(r)[snp];
+  }
+  ep_c = REAL(ep)[0];
+  // Set up the data
+  EMdata dat;
+  EM_data(&dat, OPGP, depth_Ref, depth_Alt, noFam, nInd, nSnps, 1);
+  // Run the EM algorithm
+  llval = EM_engine(r_c, &ep_c, &dat, INTEGER(sexSpec)[0], INTEGER(seqError)[0],
+                    REAL(para)[0], REAL(para)[1], INTEGER(ss_rf), EM_nThreads(para), EM_accel(para),
+                    EM_single(para), EM_ckpt(para), counts);
+  // Return the parameter estimates, log-likelihood value and number of iterations
+  return EM_output(r_c, ep_c, llval, nSnps_c, counts);
+}
+
 
 SEXP EM_HMM_UP(SEXP r, SEXP ep, SEXP depth_Ref, SEXP depth_Alt, SEXP config, SEXP noFam, SEXP nInd, SEXP nSnps,
                SEXP seqError, SEXP para, SEXP ss_rf){
   // Initialize variables
-  int s1, s2, fam, ind, snp, g, iter, nIter, indx, parent, noFam_c, nSnps_c, seqError_c;
-  double sum, sumA, sumB, a, b, delta;
+  int snp, nSnps_c;
+  int counts[2];
+  double *r_c, ep_c, llval;
   // Copy values of R input into C objects
   nSnps_c = INTEGER(nSnps)[0];
-  double r_c[(nSnps_c-1)*2], ep_c;
-  for(snp = 0; snp < nSnps_c - 1; snp++){
-    for(parent = 0; parent < 2; parent++){
-      r_c[snp+parent*(nSnps_c-1)] = REAL(r)[snp+parent*(nSnps_c-1)];
-    }
+  r_c = (double *) R_alloc(2 * (size_t) (nSnps_c - 1), sizeof(double));
+  for(snp = 0; snp < 2*(nSnps_c - 1); snp++){
+    r_c[snp] = REAL(r)[snp];
   }
   ep_c = REAL(ep)[0];
-  seqError_c = INTEGER(seqError)[0];
-  noFam_c = INTEGER(noFam)[0];
-  int nInd_c[noFam_c], nTotal, indSum[noFam_c];
-  nTotal = 0;
-  for(fam = 0; fam < noFam_c; fam++){
-    nInd_c[fam] = INTEGER(nInd)[fam];
-    nTotal = nTotal + nInd_c[fam];
-    indSum[fam] = nTotal - nInd_c[fam];
+  // Set up the data
+  EMdata dat;
+  EM_data(&dat, config, depth_Ref, depth_Alt, noFam, nInd, nSnps, 0);
+  // Run the EM algorithm (the r.f.'s are always sex-specific when the phase is unknown)
+  llval = EM_engine(r_c, &ep_c, &dat, 1, INTEGER(seqError)[0],
+                    REAL(para)[0], REAL(para)[1], INTEGER(ss_rf), EM_nThreads(para), EM_accel(para),
+                    EM_single(para), EM_ckpt(para), counts);
+  // Return the parameter estimates, log-likelihood value and number of iterations
+  return EM_output(r_c, ep_c, llval, nSnps_c, counts);
+}
+
+
+// Log-likelihood (excluding the binomial coefficients) of all the families at the given r.f.'s (paternal
+// followed by maternal) and sequencing error parameter. The emission probabilities are built in C from
+// the raw read counts, so nothing other than the parameter vector needs to be allocated in R.
+SEXP ll_HMM(SEXP r, SEXP ep, SEXP depth_Ref, SEXP depth_Alt, SEXP geno, SEXP noFam, SEXP nInd, SEXP nSnps,
+            SEXP phased, SEXP nThreads){
+  EMdata dat;
+  EMwork wk;
+  EM_data(&dat, geno, depth_Ref, depth_Alt, noFam, nInd, nSnps, asLogical(phased));
+  if(XLENGTH(r) != 2 * (R_xlen_t) (dat.nSnps - 1))
+    error("The vector of r.f.'s must have length 2*(nSnps-1)");
+  EM_setup(&dat, &wk, asInteger(nThreads), 0, 0);
+  EM_expect(&dat, &wk, REAL(r), REAL(ep)[0]);
+  return ScalarReal(wk.acc[wk.lenAcc-3]);
+}
+
+// Log-likelihood (excluding the binomial coefficients) and its gradient with respect to the
+// r.f.'s (paternal followed by maternal) and the sequencing error parameter (see EM_score).
+SEXP score_HMM(SEXP r, SEXP ep, SEXP depth_Ref, SEXP depth_Alt, SEXP geno, SEXP noFam, SEXP nInd, SEXP nSnps,
+               SEXP phased, SEXP nThreads){
+  int snp, nSnps_c;
+  double llval, grad_ep;
+  EMdata dat;
+  EMwork wk;
+  EM_data(&dat, geno, depth_Ref, depth_Alt, noFam, nInd, nSnps, asLogical(phased));
+  nSnps_c = dat.nSnps;
+  double *r_c = (double *) R_alloc(2 * (size_t) (nSnps_c - 1), sizeof(double));
+  for(snp = 0; snp < 2*(nSnps_c - 1); snp++){
+    r_c[snp] = REAL(r)[snp];
+  }
+  EM_setup(&dat, &wk, asInteger(nThreads), 0, 0);
+  SEXP grad = PROTECT(allocVector(REALSXP, 2*(nSnps_c-1)));
+  llval = EM_score(&dat, &wk, r_c, REAL(ep)[0], REAL(grad), &grad_ep);
+  SEXP pout = PROTECT(allocVector(VECSXP, 3));
+  SET_VECTOR_ELT(pout, 0, ScalarReal(llval));
+  SET_VECTOR_ELT(pout, 1, grad);
+  SET_VECTOR_ELT(pout, 2, ScalarReal(grad_ep));
+  UNPROTECT(2);
+  return pout;
+}
+
+
+// Maximum likelihood estimates using L-BFGS-B with the exact gradient (see EM_optim).
+// The input is as for EM_HMM (or EM_HMM_UP when phased is FALSE, in which case the r.f.'s are
+// sex-specific) with para = (maxit, factr, pgtol, nThreads).
+// Returns the list of EM_output followed by the convergence code and the number of
+// function and gradient evaluations, as in optim.
+SEXP optim_HMM(SEXP r, SEXP ep, SEXP depth_Ref, SEXP depth_Alt, SEXP geno, SEXP noFam, SEXP nInd, SEXP nSnps,
+               SEXP phased, SEXP sexSpec, SEXP seqError, SEXP para, SEXP ss_rf){
+  int k, snp, nSnps_c, phased_c, fail, counts[2];
+  double ep_c, llval;
+  EMdata dat;
+  phased_c = asLogical(phased);
+  EM_data(&dat, geno, depth_Ref, depth_Alt, noFam, nInd, nSnps, phased_c);
+  nSnps_c = dat.nSnps;
+  double *r_c = (double *) R_alloc(2 * (size_t) (nSnps_c - 1), sizeof(double));
+  for(snp = 0; snp < 2*(nSnps_c - 1); snp++){
+    r_c[snp] = REAL(r)[snp];
   }
-  nIter = REAL(para)[0];
+  ep_c = REAL(ep)[0];
+  llval = EM_optim(r_c, &ep_c, &dat, phased_c ? asLogical(sexSpec) : 1, asLogical(seqError),
+                   phased_c ? 0.5 : 1.0, INTEGER(ss_rf), REAL(para), (int) REAL(para)[3], &fail, counts);
+  SEXP est = PROTECT(EM_output(r_c, ep_c, llval, nSnps_c, NULL));
+  SEXP pout = PROTECT(allocVector(VECSXP, 5));
+  for(k = 0; k < 3; k++)
+    SET_VECTOR_ELT(pout, k, VECTOR_ELT(est, k));
+  SET_VECTOR_ELT(pout, 3, ScalarInteger(fail));
+  SEXP cout = PROTECT(allocVector(INTSXP, 2));
+  INTEGER(cout)[0] = counts[0];
+  INTEGER(cout)[1] = counts[1];
+  SET_VECTOR_ELT(pout, 4, cout);
+  UNPROTECT(3);
+  return pout;
+}
+
+
+//////////// Batch of EM runs (e.g., one for each chromosome) /////////////////////
+// Each job is an independent run of the EM algorithm (as in EM_HMM when phased is TRUE and EM_HMM_UP
+// otherwise), with the list of input (r, ep, depth_Ref, depth_Alt, geno, noFam, nInd, nSnps, phased,
+// sexSpec, seqError, ss_rf). The jobs are run in decreasing order of their cost (the number of individuals
+// times the number of SNPs), so that the largest jobs are not left until last, in rounds of nThreads jobs
+// with one job on each thread (which uses a single thread in the E-step). As R cannot be called from the
+// threads, the data and working arrays of the jobs of a round are set up before the round and released
+// after it, so the memory used is that of the nThreads jobs of the largest round rather than of all the jobs.
+// para = (maxit, reltol, nThreads, accel, single, ckpt). Returns the list of the EM_output of each job.
+SEXP EM_batch(SEXP jobs, SEXP para){
+  int k, k0, nRound, snp, fam, nJobs = LENGTH(jobs), nThreads, accel, single, ckpt, nIter, *order, *counts;
+  double delta, *cost, *llval;
+  EMdata *dat = (EMdata *) R_alloc(nJobs, sizeof(EMdata));
+  EMwork *wk = (EMwork *) R_alloc(nJobs, sizeof(EMwork));
+  double **r_c = (double **) R_alloc(nJobs, sizeof(double *));
+  double *ep_c = (double *) R_alloc(nJobs, sizeof(double));
+  int *sexSpec_c = (int *) R_alloc(nJobs, sizeof(int));
+  int *seqError_c = (int *) R_alloc(nJobs, sizeof(int));
+  int **pss_rf = (int **) R_alloc(nJobs, sizeof(int *));
+  nIter = (int) REAL(para)[0];
   delta = REAL(para)[1];
-  // Initialize some more variables
-  double alphaTilde[4][nTotal][nSnps_c], alphaDot[4];
-  double betaTilde[4][nTotal][nSnps_c], betaDot[4];
-  double w_new, log_w[nTotal][nSnps_c];
-  double uProb[4][nTotal][nSnps_c], vProb[4][4][nTotal][nSnps_c-1];
-  // Define the pointers to the other input R variables
-  int *pconfig, *pdepth_Ref, *pdepth_Alt;
-  pconfig = INTEGER(config);
-  pdepth_Ref = INTEGER(depth_Ref);
-  pdepth_Alt = INTEGER(depth_Alt);
-  int *pss_rf;
-  pss_rf = INTEGER(ss_rf);
-  // if sex-specific rf
-  for(snp = 0; snp < nSnps_c-1; snp++){
-    if(pss_rf[snp]==0){
-      r_c[snp] = 0;
+  nThreads = EM_threads(EM_nThreads(para));
+  accel = EM_accel(para);
+  single = EM_single(para);
+  ckpt = EM_ckpt(para);
+  order = (int *) R_alloc(nJobs, sizeof(int));
+  cost = (double *) R_alloc(nJobs, sizeof(double));
+  llval = (double *) R_alloc(nJobs, sizeof(double));
+  counts = (int *) R_alloc(2 * (size_t) nJobs, sizeof(int));
+  for(k = 0; k < nJobs; k++){
+    SEXP job = VECTOR_ELT(jobs, k);
+    order[k] = k;
+    cost[k] = 0;
+    for(fam = 0; fam < asInteger(VECTOR_ELT(job, 5)); fam++)
+      cost[k] = cost[k] + INTEGER(VECTOR_ELT(job, 6))[fam];
+    cost[k] = cost[k] * asInteger(VECTOR_ELT(job, 7));
+  }
+  revsort(cost, order, nJobs);
+  for(k0 = 0; k0 < nJobs; k0 = k0 + nThreads){
+    nRound = (nJobs - k0 < nThreads) ? nJobs - k0 : nThreads;
+    // Set up the jobs of the round (the estimates are kept, while the rest is released after the round)
+    for(k = k0; k < k0 + nRound; k++){
+      int j = order[k];
+      SEXP job = VECTOR_ELT(jobs, j);
+      int phased = asLogical(VECTOR_ELT(job, 8));
+      r_c[j] = (double *) R_alloc(2 * (size_t) (asInteger(VECTOR_ELT(job, 7)) - 1), sizeof(double));
+      ep_c[j] = asReal(VECTOR_ELT(job, 1));
+      // the r.f.'s are always sex-specific when the phase is unknown
+      sexSpec_c[j] = phased ? asLogical(VECTOR_ELT(job, 9)) : 1;
+      seqError_c[j] = asLogical(VECTOR_ELT(job, 10));
+      pss_rf[j] = INTEGER(VECTOR_ELT(job, 11));
     }
-    if(pss_rf[snp+nSnps_c-1]==0){
-      r_c[snp + nSnps_c-1] = 0;
+    const void *vmax = vmaxget();
+    for(k = k0; k < k0 + nRound; k++){
+      int j = order[k];
+      SEXP job = VECTOR_ELT(jobs, j);
+      EM_data(dat + j, VECTOR_ELT(job, 4), VECTOR_ELT(job, 2), VECTOR_ELT(job, 3), VECTOR_ELT(job, 5),
+              VECTOR_ELT(job, 6), VECTOR_ELT(job, 7), asLogical(VECTOR_ELT(job, 8)));
+      if(XLENGTH(VECTOR_ELT(job, 0)) != 2 * (R_xlen_t) (dat[j].nSnps - 1))
+        error("The vector of r.f.'s must have length 2*(nSnps-1)");
+      for(snp = 0; snp < 2*(dat[j].nSnps - 1); snp++)
+        r_c[j][snp] = REAL(VECTOR_ELT(job, 0))[snp];
+      EM_setup(dat + j, wk + j, 1, single, ckpt);
+      wk[j].interrupt = 0;
     }
-  }
-  
-  // Probability matrics
-  double pAA[nTotal][nSnps_c];
-  double pAB[nTotal][nSnps_c];
-  double pBB[nTotal][nSnps_c];
-  double bin_coef[nTotal][nSnps_c];
-  double *ppAA, *ppBB, *pbin_coef;
-  int Iaa[4][nTotal][nSnps_c], Ibb[4][nTotal][nSnps_c];
-  ppAA = &pAA[0][0];
-  ppBB = &pBB[0][0];
-  pbin_coef = &bin_coef[0][0];
-  //double (*pbin_coef)[nSnps_c] = &bin_coef;
-  // Compute the probs for the heterozygous calls
-  for(fam = 0; fam < noFam_c; fam++){
-    for(ind = 0; ind < nInd_c[fam]; ind++){
-      indx = ind + indSum[fam];
-      for(snp = 0; snp < nSnps_c; snp++){
-        bin_coef[indx][snp] = 1; //binomial(pdepth_Ref[indx + nTotal*snp] + pdepth_Alt[indx + nTotal*snp], pdepth_Ref[indx + nTotal*snp]);
-        pAB[indx][snp] = bin_coef[indx][snp] * powl(0.5,pdepth_Ref[indx + nTotal*snp] + pdepth_Alt[indx + nTotal*snp]);
-        for(s1 = 0; s1 < 4; s1++){
-          g = Iindx_up(pconfig[snp*noFam_c + fam], s1 + 1);
-          if( g == 1 ){
-            Iaa[s1][indx][snp] = 1;
-            Ibb[s1][indx][snp] = 0;
-          }
-          else if( g == 2 ){
-            Ibb[s1][indx][snp] = 1;
-            Iaa[s1][indx][snp] = 0;
-          }
-          else{
-            Iaa[s1][indx][snp] = 0;
-            Ibb[s1][indx][snp] = 0;
-          }
-        }
-      }
+    // Run the jobs of the round
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(nRound) schedule(dynamic, 1)
+#endif
+    for(k = k0; k < k0 + nRound; k++){
+      int j = order[k];
+      llval[j] = EM_run(r_c[j], ep_c + j, dat + j, wk + j, sexSpec_c[j], seqError_c[j], nIter, delta,
+                        pss_rf[j], accel, counts + 2*j);
     }
+    vmaxset(vmax);
+    R_CheckUserInterrupt();
   }
-  // Define the output variable
-  double *prout, *pepout, *pllout;
-  SEXP rout = PROTECT(allocVector(REALSXP, 2*(nSnps_c-1)));
-  SEXP epout = PROTECT(allocVector(REALSXP, 1));
-  SEXP llout = PROTECT(allocVector(REALSXP, 1));
-  prout = REAL(rout);
-  pepout = REAL(epout);
-  pllout = REAL(llout);
-  SEXP pout = PROTECT(allocVector(VECSXP, 3));
-  double llval = 0, prellval = 0;
+  SEXP pout = PROTECT(allocVector(VECSXP, nJobs));
+  for(k = 0; k < nJobs; k++)
+    SET_VECTOR_ELT(pout, k, EM_output(r_c[k], ep_c[k], llval[k], asInteger(VECTOR_ELT(VECTOR_ELT(jobs, k), 7)),
+                                      counts + 2*k));
+  UNPROTECT(1);
+  return pout;
+}
 
-  /////// Start algorithm
+
+//////////// Two-point r.f. estimates for all pairs of SNPs (phase unknown) /////////////////////
+// For two SNPs, the likelihood of an individual only depends on the r.f.'s through
+//   L = w[0]*(1-r_p)*(1-r_m) + w[1]*(1-r_p)*r_m + w[2]*r_p*(1-r_m) + w[3]*r_p*r_m,
+// where w[2*p + m] = sum_s Q1[s] * Q2[s ^ (2*p + m)] (p, m = 1 if the paternal (maternal) allele changes)
+// and Q1 and Q2 are the emission probabilities of the individual at the two SNPs. This is the two SNP case of
+// the HMM of EM_HMM_UP, so the EM algorithm for a pair of SNPs only requires the four numbers w of each
+// individual. Individuals with no reads at either SNP (or a SNP which is not informative in their family,
+// i.e., a config larger than 5) have the same likelihood for all r.f.'s and are left out.
+// The SNPs are processed in tiles of TWOPT_TILE SNPs: for each pair of tiles, the emission probabilities of
+// all the individuals at the SNPs of the two tiles are computed once and kept in the working arrays of the
+// thread, and the pairs of tiles are handed out dynamically to the threads.
+
+#define TWOPT_TILE 16
+
+// EM algorithm for the r.f.'s of a pair of SNPs, given the normalized w (sum(w) = 1) of the nObs individuals
+// that contribute to the likelihood out of nTotal. The r.f. of a parent is only estimated when estP (estM)
+// is non-zero and is zero otherwise (as in EM_engine). Returns the log-likelihood ratio (base 10) of the
+// estimates against r_p = r_m = 0.5 (the LOD score).
+static double twopt_EM(const double *w, int nObs, int nTotal, int estP, int estM, int nIter, double delta,
+                       double *rp, double *rm){
+  int iter, obs;
+  double L, recP, accP, accM, prod, llval = 0, prellval = 0;
+  *rp = estP ? 0.5 : 0;
+  *rm = estM ? 0.5 : 0;
+  if(nObs == 0 || (!estP && !estM))
+    return 0;
   iter = 0;
   while( (iter < 2) || ((iter < nIter) & ((llval - prellval) > delta))){
     iter = iter + 1;
     prellval = llval;
     llval = 0;
-    
-    // unpdate the probabilites for pAA and pBB given the parameter values and data.
-    computeProb(ppAA, ppBB, pbin_coef, ep_c, pdepth_Ref, pdepth_Alt, nTotal, nSnps_c);
-    
-    // Compute the forward and backward probabilities for each individual
-    for(fam = 0; fam < noFam_c; fam++){
-      for(ind = 0; ind < nInd_c[fam]; ind++){
-        indx = ind + indSum[fam];
-        //Rprintf("indSum %i\n", indSum[fam]);
-        //Rprintf("indx %i\n", indx);
-        //Rprintf("bin_coef %f at snp %i: ind %i:\n",bin_coef[indx][0], 0, indx);
-        //Rprintf("pAA %f at snp %i: ind %i:\n",pAA[indx][0], 0, indx);
-        //Rprintf("pAB %f at snp %i: ind %i:\n",pAB[indx][0], 0, indx);
-        //Rprintf("pBB %f at snp %i: ind %i:\n",pBB[indx][0], 0, indx);
-        /////////////////////////////////////////
-        // Compute forward probabilities at snp 1
-        sum = 0;
-        //Rprintf("config :%.6f at snp %i in ind %i\n", pconfig[fam], 0, ind);
-        for(s1 = 0; s1 < 4; s1++){
-          //Rprintf("Q value :%.6f at snp %i in ind %i\n", Qentry_up(pconfig[fam], pAA[indx][0], pAB[indx][0], pBB[indx][0], s1+1), 0, ind);
-          alphaDot[s1] = 0.25 * Qentry_up(pconfig[fam], pAA[indx][0], pAB[indx][0], pBB[indx][0], s1+1);
-          sum = sum + alphaDot[s1];
-          //Rprintf("pAA %.16f, pAB %.16f pBB %.16f at snp %i in ind %i\n", pAA[indx][0], pAB[indx][0], pBB[indx][0], 0, ind);
-          //Rprintf("Q value :%.22f at snp %i in ind %i\n", Qentry_up(pconfig[fam], pAA[indx][0], pAB[indx][0], pBB[indx][0], s1+1), 0, ind);
-        }
-        // Scale forward probabilities
-        for(s1 = 0; s1 < 4; s1++){
-          alphaTilde[s1][indx][0] = alphaDot[s1]/sum;
-          //Rprintf("alphaTilde :%.6f at state %i, snp %i and ind %i\n", alphaTilde[s1][indx][0], s1, 0, ind);
-        }
-        //Rprintf("New weight :%.6f at snp %i\n", sum, 1);
-        
-        // add contribution to likelihood
-        log_w[indx][0] = log(sum);
-        llval = llval + log(sum);
-        //w_logcumsum = log(sum);
-        //llval = llval + w_logcumsum;
-        // llval = llval - log(sum);
-        //Rprintf("llvalue :%.6f at snp %i\n", llval, 0);
-        
-        // iterate over the remaining SNPs
-        for(snp = 1; snp < nSnps_c; snp++){
-          //Rprintf("snp %i\n", snp );
-          //Rprintf("nSnps %i\n", nSnps_c );
-          // compute the next forward probabilities for snp j
-          //Rprintf("pAA %f at snp %i: ind %i:\n",pAA[indx][snp], snp, ind);
-          //Rprintf("pAB %f at snp %i: ind %i:\n",pAB[indx][snp], snp, ind);
-          //Rprintf("pBB %f at snp %i: ind %i:\n",pBB[indx][snp], snp, ind);
-          for(s2 = 0; s2 < 4; s2++){
-            sum = 0;
-            for(s1 = 0; s1 < 4; s1++){
-              sum = sum + Tmat_ss(s1, s2, r_c[snp-1], r_c[snp-1+nSnps_c-1]) * alphaTilde[s1][indx][snp-1];
-              //Rprintf("Tmat %.16f", Tmat_ss(s1, s2, r_c[snp-1], r_c[snp-1+nSnps_c-1]));
-            }
-            //Rprintf("sum :%.16f at state %i, snp %i and ind %i\n", sum, s2, snp, ind);
-            //Rprintf("pAA %.16f, pAB %.16f pBB %.16f at snp %i in ind %i\n", pAA[indx][snp], pAB[indx][snp], pBB[indx][snp], snp, indx);
-            //Rprintf("Q value :%.16f at snp %i in ind %i\n", Qentry_up(pconfig[snp*noFam_c + fam], pAA[indx][snp], pAB[indx][snp], pBB[indx][snp], s2+1), snp, ind);
-            alphaDot[s2] = Qentry_up(pconfig[snp*noFam_c + fam], pAA[indx][snp], pAB[indx][snp], pBB[indx][snp], s2+1) * sum;
-            //Rprintf("alphaDot :%.22f at state %i, snp %i and ind %i\n", alphaDot[s2], s2, snp, ind);
-          }
-          
-          // Compute the weight for snp \ell
-          w_new = 0;
-          for(s2 = 0; s2 < 4; s2++){
-            w_new = w_new + alphaDot[s2];
-          }
-          // Add contribution to the likelihood
-          //llval = llval + log(w_new) + w_logcumsum;
-          //w_logcumsum = w_logcumsum + log(w_new);
-          log_w[indx][snp] = log(w_new);
-          // Scale the forward probability vector
-          for(s2 = 0; s2 < 4; s2++){
-            alphaTilde[s2][indx][snp] = alphaDot[s2]/w_new;
-          }
-          // Add contribution to the likelihood
-          llval = llval + log(w_new);
-          //Rprintf("llvalue :%.8f at ind %i\n", llval, indx);
-        }
-        //////////////////////
-        // Compute the backward probabilities
-        for(s1 = 0; s1 < 4; s1++){
-          betaTilde[s1][indx][nSnps_c-1] = 1/exp(log_w[indx][nSnps_c-1]);
-          //sum = log(betaTilde[s1][indx][nSnps_c-1]) - (log(1) -  log_w[indx][nSnps_c-1]);
-          //Rprintf("log(beta) :%.22f at state %i, snp %i and ind %i\n", exp(sum), s1, nSnps_c-1, ind);
-        }
-        // iterate over the remaining SNPs
-        sum = 0;
-        for(snp = nSnps_c-2; snp > -1; snp--){
-          for(s1 = 0; s1 < 4; s1++){
-            sum = 0;
-            for(s2 = 0; s2 < 4; s2++){
-              sum = sum + Qentry_up(pconfig[(snp+1)*noFam_c + fam], pAA[indx][snp+1], pAB[indx][snp+1], pBB[indx][snp+1], s2+1) * 
-                Tmat_ss(s1, s2, r_c[snp], r_c[snp+nSnps_c-1]) * betaTilde[s2][indx][snp+1];
-            }
-            betaDot[s1] = sum;
-          }
-          // Scale the backward probability vector
-          for(s1 = 0; s1 < 4; s1++){
-            betaTilde[s1][indx][snp] = betaDot[s1]/exp(log_w[indx][snp]);
-            //Rprintf("betaTilde :%.6f at state %i, snp %i and ind %i\n", betaTilde[s1][indx][snp], s1, snp, ind);
-          }
-        }
-        ///////// E-step:
-        for(snp = 0; snp < nSnps_c - 1; snp++){
-          for(s1 = 0; s1 < 4; s1++){
-            uProb[s1][indx][snp] = (alphaTilde[s1][indx][snp] * betaTilde[s1][indx][snp])/exp(-log_w[indx][snp]);
-            for(s2 = 0; s2 < 4; s2++){
-              vProb[s1][s2][indx][snp] = alphaTilde[s1][indx][snp] * Tmat_ss(s1, s2, r_c[snp], r_c[snp+nSnps_c-1]) *
-                Qentry_up(pconfig[(snp+1)*noFam_c + fam], pAA[indx][snp+1], pAB[indx][snp+1], pBB[indx][snp+1], s2+1)  * 
-                betaTilde[s2][indx][snp+1];
-            }
-          }
-        }
-        snp = nSnps_c - 1;
-        for(s1 = 0; s1 < 4; s1++){
-          uProb[s1][indx][snp] = (alphaTilde[s1][indx][snp] * betaTilde[s1][indx][snp])/exp(-log_w[indx][snp]); 
-        }
-      }  
-    }
-    // The recombination fractions
-    for(snp = 0; snp < nSnps_c-1; snp++){
-      // Paternal
-      if(pss_rf[snp] == 1){
-        sum = 0;
-        for(fam = 0; fam < noFam_c; fam++){
-          for(ind = 0; ind < nInd_c[fam]; ind++){
-            indx = ind + indSum[fam];
-            for(s1 = 0; s1 < 2; s1++){
-              for(s2 = 2; s2 < 4; s2++){
-                sum = sum + vProb[s1][s2][indx][snp] + vProb[s1+2][s2-2][indx][snp];
-              }
-            }
-          }
-        }
-        r_c[snp] = 1.0/nTotal * sum;
+    prod = 1;
+    accP = 0;
+    accM = 0;
+    // E-step: expected number of recombinations divided by the r.f. (as in EM_lanes)
+    for(obs = 0; obs < nObs; obs++){
+      const double *wo = w + 4*obs;
+      recP = wo[2]*(1 - *rm) + wo[3] * *rm;
+      L = (1 - *rp) * (wo[0]*(1 - *rm) + wo[1] * *rm) + *rp * recP;
+      accP = accP + recP/L;
+      accM = accM + (wo[1]*(1 - *rp) + wo[3] * *rp)/L;
+      // As L <= 1 (sum(w) = 1), the likelihoods are multiplied together and the log is only taken
+      // before the product could underflow
+      if(L < 1e-100)
+        llval = llval + log(L);
+      else
+        prod = prod * L;
+      if(prod < 1e-150){
+        llval = llval + log(prod);
+        prod = 1;
       }
-      // Maternal
-      if(pss_rf[snp+nSnps_c-1] == 1){
-        sum = 0;
-        for(fam = 0; fam < noFam_c; fam++){
-          for(ind = 0; ind < nInd_c[fam]; ind++){
-            indx = ind + indSum[fam];
-            for(s1 = 0; s1 < 2; s1++){
-              for(s2 = 0; s2 < 2; s2++){
-                sum = sum + vProb[2*s1][1+2*s2][indx][snp] + vProb[1+2*s1][2*s2][indx][snp];
-              }
-            }
-          }
-        }
-        r_c[snp + nSnps_c-1] = 1.0/nTotal * sum;
+    }
+    llval = llval + log(prod);
+    // M-step (the individuals left out have the same expected number of recombinations as the r.f.)
+    if(estP)
+      *rp = *rp * (accP + nTotal - nObs)/nTotal;
+    if(estM)
+      *rm = *rm * (accM + nTotal - nObs)/nTotal;
+  }
+  // The likelihood of an individual at r_p = r_m = 0.5 is sum(w)/4
+  return (llval - nObs * log(0.25))/M_LN10;
+}
+
+// Data and working arrays of the two-point estimates
+typedef struct {
+  EMdata dat;
+  EMwork wk;
+  int nIter;
+  double delta;
+  int *famOf;                // family of each individual
+  int *het;                  // parents heterozygous at each SNP in each family (bit 0: paternal, bit 1: maternal)
+  int nTiles, nTP;
+  int *tileI, *tileJ;        // the pairs of tiles
+  size_t lenQ;
+  double *work;              // emission probabilities of the two tiles and w of each thread
+  // For sparse read counts, the nonzero cells by SNP: the cells of SNP snp are snpPtr[snp],...,snpPtr[snp+1]-1,
+  // with the individuals in snpInd and the depth pairs in snpPair
+  int *snpPtr, *snpInd, *snpPair;
+} TwoptData;
+
+// Emission probabilities of individual ind at snp with depth pair p (Q[0] = -1 for the cells left out)
+static inline void twopt_cell(EMdata *dat, int *famOf, int snp, int ind, int p, double *Q){
+  int g = dat->geno[snp*dat->noFam + famOf[ind]];
+  if(g > 5 || dat->pairRef[p] + dat->pairAlt[p] == 0)
+    Q[0] = -1;
+  else
+    Qvec(geno_config[g-1], dat->pAA[p], dat->pAB[p], dat->pBB[p], Q);
+}
+
+// Emission probabilities of all the individuals at the SNPs first:(first+n-1), stored in
+// Q[((snp-first)*nTotal + ind)*4 + s]. Q[...*4] is set to -1 for the cells left out (see above).
+static void twopt_emission(TwoptData *tw, int first, int n, double *Q){
+  int snp, ind, k;
+  double *Qs;
+  EMdata *dat = &tw->dat;
+  for(snp = first; snp < first + n; snp++){
+    Qs = Q + 4*((R_xlen_t) (snp-first)*dat->nTotal);
+    if(dat->depth_ptr){
+      for(ind = 0; ind < dat->nTotal; ind++)
+        Qs[4*ind] = -1;
+      for(k = tw->snpPtr[snp]; k < tw->snpPtr[snp+1]; k++)
+        twopt_cell(dat, tw->famOf, snp, tw->snpInd[k], tw->snpPair[k], Qs + 4*tw->snpInd[k]);
+    }
+    else{
+      for(ind = 0; ind < dat->nTotal; ind++)
+        twopt_cell(dat, tw->famOf, snp, ind, dat->pair[(R_xlen_t) snp*dat->nTotal + ind], Qs + 4*ind);
+    }
+  }
+}
+
+// Set up the two-point estimates. The config values can be from 1 to 9 (where 6-9 are SNPs which are
+// not informative in the family) and para = (maxit, reltol, nThreads) control the EM algorithm.
+static void twopt_setup(TwoptData *tw, SEXP ep, SEXP depth_Ref, SEXP depth_Alt, SEXP config, SEXP noFam,
+                        SEXP nInd, SEXP nSnps, SEXP para){
+  int fam, ind, snp, k, ti, tj, tp, noFam_c, nSnps_c;
+  R_xlen_t cell;
+  EMdata *dat = &tw->dat;
+  noFam_c = asInteger(noFam);
+  nSnps_c = asInteger(nSnps);
+  dat->noFam = noFam_c;
+  dat->nSnps = nSnps_c;
+  dat->nInd = INTEGER(nInd);
+  dat->geno = INTEGER(config);
+  EM_depth(dat, depth_Ref, depth_Alt);
+  dat->gtab = geno_config;
+  // The configs 6-9 are checked here as the table of EM_HMM_UP only has configs 1-5
+  if(check_geno(dat->geno, (R_xlen_t) noFam_c * nSnps_c, 9))
+    error("Invalid segregation type (config) value");
+  tw->nIter = (int) REAL(para)[0];
+  tw->delta = REAL(para)[1];
+  tw->wk.nThreads = EM_threads((int) REAL(para)[2]);
+  EM_pairs(dat, &tw->wk);
+  computeProb(dat->pAA, dat->pBB, asReal(ep), dat->pairRef, dat->pairAlt, tw->wk.nPairs, tw->wk.maxDepth,
+              tw->wk.powTab);
+  tw->famOf = (int *) R_alloc(dat->nTotal, sizeof(int));
+  for(fam = 0; fam < noFam_c; fam++){
+    for(ind = 0; ind < dat->nInd[fam]; ind++)
+      tw->famOf[dat->indSum[fam] + ind] = fam;
+  }
+  // The nonzero cells of the sparse read counts by SNP (rather than by individual)
+  tw->snpPtr = tw->snpInd = tw->snpPair = NULL;
+  if(dat->depth_ptr){
+    tw->snpPtr = (int *) R_alloc((size_t) nSnps_c + 1, sizeof(int));
+    tw->snpInd = (int *) R_alloc((size_t) dat->depth_ptr[dat->nTotal] + 1, sizeof(int));
+    tw->snpPair = (int *) R_alloc((size_t) dat->depth_ptr[dat->nTotal] + 1, sizeof(int));
+    for(snp = 0; snp <= nSnps_c; snp++)
+      tw->snpPtr[snp] = 0;
+    for(k = 0; k < dat->depth_ptr[dat->nTotal]; k++)
+      tw->snpPtr[dat->depth_snp[k] + 1]++;
+    for(snp = 0; snp < nSnps_c; snp++)
+      tw->snpPtr[snp + 1] = tw->snpPtr[snp + 1] + tw->snpPtr[snp];
+    for(ind = 0; ind < dat->nTotal; ind++){
+      for(k = dat->depth_ptr[ind]; k < dat->depth_ptr[ind+1]; k++){
+        tw->snpInd[tw->snpPtr[dat->depth_snp[k]]] = ind;
+        tw->snpPair[tw->snpPtr[dat->depth_snp[k]]++] = dat->pair[k];
       }
     }
-    // Error parameter:
-    if(seqError_c){
-      sumA = 0;
-      sumB = 0;
-      for(snp = 0; snp < nSnps_c; snp++){
-        for(fam = 0; fam < noFam_c; fam++){
-          for(ind = 0; ind < nInd_c[fam]; ind++){
-            indx = ind + indSum[fam];
-            a = pdepth_Ref[indx + nTotal*snp];
-            b = pdepth_Alt[indx + nTotal*snp];
-            for(s1 = 0; s1 < 4; s1++){
-              sumA = sumA + uProb[s1][indx][snp]*(b*Iaa[s1][indx][snp] +  a*Ibb[s1][indx][snp]);
-              sumB = sumB + uProb[s1][indx][snp]*(a*Iaa[s1][indx][snp] +  b*Ibb[s1][indx][snp]);
-            }
-          }
+    for(snp = nSnps_c; snp > 0; snp--)
+      tw->snpPtr[snp] = tw->snpPtr[snp - 1];
+    tw->snpPtr[0] = 0;
+  }
+  tw->het = (int *) R_alloc((size_t) noFam_c * nSnps_c, sizeof(int));
+  for(cell = 0; cell < (R_xlen_t) noFam_c * nSnps_c; cell++){
+    int g = dat->geno[cell];
+    tw->het[cell] = ((g == 1 || g == 2 || g == 3) ? 1 : 0) + ((g == 1 || g == 4 || g == 5) ? 2 : 0);
+  }
+  tw->nTiles = (nSnps_c + TWOPT_TILE - 1)/TWOPT_TILE;
+  tw->nTP = tw->nTiles*(tw->nTiles + 1)/2;
+  tw->tileI = (int *) R_alloc(tw->nTP, sizeof(int));
+  tw->tileJ = (int *) R_alloc(tw->nTP, sizeof(int));
+  tp = 0;
+  for(ti = 0; ti < tw->nTiles; ti++){
+    for(tj = ti; tj < tw->nTiles; tj++){
+      tw->tileI[tp] = ti;
+      tw->tileJ[tp] = tj;
+      tp++;
+    }
+  }
+  tw->lenQ = 4 * (size_t) TWOPT_TILE * dat->nTotal;
+  tw->work = (double *) R_alloc(3 * tw->lenQ * tw->wk.nThreads, sizeof(double));
+}
+
+// Two-point estimates of all the pairs of SNPs i < j in the pair of tiles tp, using the working arrays of
+// the thread. The SNPs of each pair are returned in pi and pj and the paternal r.f., maternal r.f. and
+// LOD score in est[3*k], est[3*k+1] and est[3*k+2]. Returns the number of pairs (at most TWOPT_TILE^2).
+static int twopt_tile(TwoptData *tw, int tp, int thread, int *pi, int *pj, double *est){
+  int i, j, i0, j0, ni, nj, k, s, nObs, inf, nPair = 0;
+  int nTotal = tw->dat.nTotal, nSnps_c = tw->dat.nSnps, noFam_c = tw->dat.noFam;
+  double *QI, *QJ, *w, *a, *b, sum, rp, rm, lod;
+  QI = tw->work + 3 * tw->lenQ * thread;
+  QJ = QI + tw->lenQ;
+  w = QJ + tw->lenQ;
+  i0 = tw->tileI[tp]*TWOPT_TILE;
+  j0 = tw->tileJ[tp]*TWOPT_TILE;
+  ni = (i0 + TWOPT_TILE < nSnps_c) ? TWOPT_TILE : nSnps_c - i0;
+  nj = (j0 + TWOPT_TILE < nSnps_c) ? TWOPT_TILE : nSnps_c - j0;
+  twopt_emission(tw, i0, ni, QI);
+  if(j0 != i0)
+    twopt_emission(tw, j0, nj, QJ);
+  else
+    QJ = QI;
+  for(i = i0; i < i0 + ni; i++){
+    for(j = (j0 > i) ? j0 : i + 1; j < j0 + nj; j++){
+      // Which r.f.'s can be estimated
+      inf = 0;
+      for(k = 0; k < noFam_c; k++)
+        inf = inf | (tw->het[i*noFam_c + k] & tw->het[j*noFam_c + k]);
+      // w of each individual
+      nObs = 0;
+      for(k = 0; k < nTotal && inf; k++){
+        a = QI + 4*((R_xlen_t) (i-i0)*nTotal + k);
+        b = QJ + 4*((R_xlen_t) (j-j0)*nTotal + k);
+        if(a[0] < 0 || b[0] < 0)
+          continue;
+        sum = 0;
+        for(s = 0; s < 4; s++){
+          w[4*nObs + s] = a[0]*b[s] + a[1]*b[s ^ 1] + a[2]*b[s ^ 2] + a[3]*b[s ^ 3];
+          sum = sum + w[4*nObs + s];
         }
+        for(s = 0; s < 4; s++)
+          w[4*nObs + s] = w[4*nObs + s]/sum;
+        nObs++;
       }
-      ep_c = sumA/(sumA + sumB);
+      lod = twopt_EM(w, nObs, nTotal, inf & 1, inf & 2, tw->nIter, tw->delta, &rp, &rm);
+      pi[nPair] = i;
+      pj[nPair] = j;
+      est[3*nPair]     = (inf & 1) ? rp : NA_REAL;
+      est[3*nPair + 1] = (inf & 2) ? rm : NA_REAL;
+      est[3*nPair + 2] = lod;
+      nPair++;
     }
-    //Rprintf("llvalue :%.8f at iter %i\n", llval, iter);
-    //Rprintf("prellval :%.8f at iter %i\n", prellval, iter);
-    //Rprintf("diff in lik :%.8f at iter %i\n", (llval - prellval) , iter);
-    //Rprintf("ep :%.22f at iter %i\n", ep_c, iter);
-    //for(snp = 0; snp < nSnps_c - 1; snp++){
-    //  Rprintf("r_c :%.22f at iter %i\n", r_c[snp], iter);
-    //}
   }
+  return nPair;
+}
 
-  
-  // Set up the R output object.
-  for(snp = 0; snp < nSnps_c - 1; snp++){
-    for(parent = 0; parent < 2; parent++){
-      prout[snp+parent*(nSnps_c-1)] = r_c[snp+parent*(nSnps_c-1)];
+// Two-point r.f. estimates and LOD scores of all the pairs of SNPs when the phase is unknown
+// (see twopt_setup for the input).
+// The results are returned in packed form (as in the 'dist' objects of R): the values for the SNPs i < j
+// (0-based) are at index nSnps*i - i*(i+1)/2 + j-i-1. The r.f.'s of a parent which is not heterozygous at
+// both SNPs in any family are NA.
+SEXP rf_2pt(SEXP ep, SEXP depth_Ref, SEXP depth_Alt, SEXP config, SEXP noFam, SEXP nInd, SEXP nSnps,
+            SEXP para){
+  int tp, nSnps_c;
+  R_xlen_t nOut;
+  TwoptData tw;
+  twopt_setup(&tw, ep, depth_Ref, depth_Alt, config, noFam, nInd, nSnps, para);
+  nSnps_c = tw.dat.nSnps;
+  // The pairs of each thread
+  int *pairs = (int *) R_alloc(2 * (size_t) TWOPT_TILE * TWOPT_TILE * tw.wk.nThreads, sizeof(int));
+  double *est = (double *) R_alloc(3 * (size_t) TWOPT_TILE * TWOPT_TILE * tw.wk.nThreads, sizeof(double));
+  nOut = (R_xlen_t) nSnps_c * (nSnps_c - 1)/2;
+  SEXP rpout = PROTECT(allocVector(REALSXP, nOut));
+  SEXP rmout = PROTECT(allocVector(REALSXP, nOut));
+  SEXP lodout = PROTECT(allocVector(REALSXP, nOut));
+  double *prp = REAL(rpout), *prm = REAL(rmout), *plod = REAL(lodout);
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(tw.wk.nThreads) schedule(dynamic, 1)
+#endif
+  for(tp = 0; tp < tw.nTP; tp++){
+    int thread = 0, k, n, i, j;
+    R_xlen_t indx;
+#ifdef _OPENMP
+    thread = omp_get_thread_num();
+#endif
+    int *pi = pairs + 2 * (size_t) TWOPT_TILE * TWOPT_TILE * thread, *pj = pi + TWOPT_TILE * TWOPT_TILE;
+    double *pest = est + 3 * (size_t) TWOPT_TILE * TWOPT_TILE * thread;
+    n = twopt_tile(&tw, tp, thread, pi, pj, pest);
+    for(k = 0; k < n; k++){
+      i = pi[k];
+      j = pj[k];
+      indx = (R_xlen_t) nSnps_c*i - (R_xlen_t) i*(i+1)/2 + j-i-1;
+      prp[indx] = pest[3*k];
+      prm[indx] = pest[3*k + 1];
+      plod[indx] = pest[3*k + 2];
     }
   }
-  pepout[0] = ep_c;
-  pllout[0] = llval;
-  SET_VECTOR_ELT(pout, 0, rout);
-  SET_VECTOR_ELT(pout, 1, epout);
-  SET_VECTOR_ELT(pout, 2, llout);
-  // Return the parameter estimates of log-likelihood value
+  SEXP pout = PROTECT(allocVector(VECSXP, 3));
+  SET_VECTOR_ELT(pout, 0, rpout);
+  SET_VECTOR_ELT(pout, 1, rmout);
+  SET_VECTOR_ELT(pout, 2, lodout);
   UNPROTECT(4);
   return pout;
 }
 
 
+//////////// Linkage groups from the two-point LOD scores /////////////////////
+// The pairs of SNPs are computed as in rf_2pt, but only the pairs with a LOD score of at least LODthres
+// (the edges of the LOD graph) are kept and the linkage groups are the connected components of the graph,
+// found with a union-find structure. The edges are kept in chunks of TWOPT_CHUNK edges, so the memory
+// required is proportional to the number of edges rather than the number of pairs. The tile pairs are
+// computed in parallel in batches, after which the edges of the batch are added (in the order of the
+// tile pairs, so that the output does not depend on the number of threads).
+
+#define TWOPT_CHUNK 65536
+
+typedef struct TwoptChunk {
+  int n;
+  int *i, *j;
+  double *est;     // r_p, r_m and LOD of each edge (see twopt_tile)
+  struct TwoptChunk *next;
+} TwoptChunk;
+
+static TwoptChunk *twopt_chunk(void){
+  TwoptChunk *chunk = (TwoptChunk *) R_alloc(1, sizeof(TwoptChunk));
+  chunk->n = 0;
+  chunk->i = (int *) R_alloc(TWOPT_CHUNK, sizeof(int));
+  chunk->j = (int *) R_alloc(TWOPT_CHUNK, sizeof(int));
+  chunk->est = (double *) R_alloc(3 * (size_t) TWOPT_CHUNK, sizeof(double));
+  chunk->next = NULL;
+  return chunk;
+}
+
+// Root of the set of x (with path halving)
+static int uf_find(int *parent, int x){
+  while(parent[x] != x){
+    parent[x] = parent[parent[x]];
+    x = parent[x];
+  }
+  return x;
+}
+
+// Merge the sets of x and y (union by size)
+static void uf_union(int *parent, int *size, int x, int y){
+  x = uf_find(parent, x);
+  y = uf_find(parent, y);
+  if(x == y)
+    return;
+  if(size[x] < size[y]){
+    int tmp = x;
+    x = y;
+    y = tmp;
+  }
+  parent[y] = x;
+  size[x] = size[x] + size[y];
+}
 
+// Linkage groups of the SNPs (see above). The input is as for rf_2pt, with the LOD threshold LODthres.
+// Returns the group of each SNP (numbered in the order of the first SNP of each group, NA for SNPs not
+// linked to any other SNP) and the edges: the two SNPs (1-based) and the r_p, r_m and LOD score of the
+// edges (in this order, as the columns of a matrix).
+SEXP LG_2pt(SEXP ep, SEXP depth_Ref, SEXP depth_Alt, SEXP config, SEXP noFam, SEXP nInd, SEXP nSnps,
+            SEXP para, SEXP LODthres){
+  int k, b, tp, nBatch, snp, nGroups, nSnps_c, *parent, *size, *group;
+  R_xlen_t e, nEdges;
+  double thres = asReal(LODthres);
+  TwoptData tw;
+  TwoptChunk *first, *last, *chunk;
+  twopt_setup(&tw, ep, depth_Ref, depth_Alt, config, noFam, nInd, nSnps, para);
+  nSnps_c = tw.dat.nSnps;
+  parent = (int *) R_alloc(nSnps_c, sizeof(int));
+  size = (int *) R_alloc(nSnps_c, sizeof(int));
+  for(snp = 0; snp < nSnps_c; snp++){
+    parent[snp] = snp;
+    size[snp] = 1;
+  }
+  // The pairs of each tile pair in a batch
+  nBatch = 8 * tw.wk.nThreads;
+  int *nPair = (int *) R_alloc(nBatch, sizeof(int));
+  int *pairs = (int *) R_alloc(2 * (size_t) TWOPT_TILE * TWOPT_TILE * nBatch, sizeof(int));
+  double *est = (double *) R_alloc(3 * (size_t) TWOPT_TILE * TWOPT_TILE * nBatch, sizeof(double));
+  first = last = twopt_chunk();
+  nEdges = 0;
+  for(tp = 0; tp < tw.nTP; tp = tp + nBatch){
+    int nb = (tp + nBatch < tw.nTP) ? nBatch : tw.nTP - tp;
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(tw.wk.nThreads) schedule(dynamic, 1)
+#endif
+    for(b = 0; b < nb; b++){
+      int thread = 0;
+#ifdef _OPENMP
+      thread = omp_get_thread_num();
+#endif
+      int *pi = pairs + 2 * (size_t) TWOPT_TILE * TWOPT_TILE * b;
+      nPair[b] = twopt_tile(&tw, tp + b, thread, pi, pi + TWOPT_TILE * TWOPT_TILE,
+                            est + 3 * (size_t) TWOPT_TILE * TWOPT_TILE * b);
+    }
+    // Keep the edges and merge the groups
+    for(b = 0; b < nb; b++){
+      int *pi = pairs + 2 * (size_t) TWOPT_TILE * TWOPT_TILE * b, *pj = pi + TWOPT_TILE * TWOPT_TILE;
+      double *pest = est + 3 * (size_t) TWOPT_TILE * TWOPT_TILE * b;
+      for(k = 0; k < nPair[b]; k++){
+        if(!(pest[3*k + 2] >= thres))
+          continue;
+        if(last->n == TWOPT_CHUNK){
+          last->next = twopt_chunk();
+          last = last->next;
+        }
+        last->i[last->n] = pi[k];
+        last->j[last->n] = pj[k];
+        memcpy(last->est + 3*last->n, pest + 3*k, 3*sizeof(double));
+        last->n++;
+        nEdges++;
+        uf_union(parent, size, pi[k], pj[k]);
+      }
+    }
+    R_CheckUserInterrupt();
+  }
+  // Number the groups in the order of their first SNP (size holds the size of the group of each root)
+  int *label = (int *) R_alloc(nSnps_c, sizeof(int));
+  for(snp = 0; snp < nSnps_c; snp++)
+    label[snp] = 0;
+  SEXP groupout = PROTECT(allocVector(INTSXP, nSnps_c));
+  group = INTEGER(groupout);
+  nGroups = 0;
+  for(snp = 0; snp < nSnps_c; snp++){
+    int root = uf_find(parent, snp);
+    if(size[root] == 1)
+      group[snp] = NA_INTEGER;
+    else{
+      if(label[root] == 0)
+        label[root] = ++nGroups;
+      group[snp] = label[root];
+    }
+  }
+  // The edges
+  SEXP iout = PROTECT(allocVector(INTSXP, nEdges));
+  SEXP jout = PROTECT(allocVector(INTSXP, nEdges));
+  SEXP estout = PROTECT(allocVector(REALSXP, 3*nEdges));
+  double *pest = REAL(estout);
+  e = 0;
+  for(chunk = first; chunk != NULL; chunk = chunk->next){
+    for(k = 0; k < chunk->n; k++){
+      INTEGER(iout)[e] = chunk->i[k] + 1;
+      INTEGER(jout)[e] = chunk->j[k] + 1;
+      pest[e] = chunk->est[3*k];
+      pest[e + nEdges] = chunk->est[3*k + 1];
+      pest[e + 2*nEdges] = chunk->est[3*k + 2];
+      e++;
+    }
+  }
+  SEXP pout = PROTECT(allocVector(VECSXP, 4));
+  SET_VECTOR_ELT(pout, 0, groupout);
+  SET_VECTOR_ELT(pout, 1, iout);
+  SET_VECTOR_ELT(pout, 2, jout);
+  SET_VECTOR_ELT(pout, 3, estout);
+  UNPROTECT(5);
+  return pout;
+}
@@ -0,0 +1,256 @@
+/*
+##########################################################################
+# Genotyping Uncertainty with Sequencing data and linkage MAPping (GUSMap)
+# Copyright 2017-2018 Timothy P. Bilton <tbilton@maths.otago.ac.nz>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#########################################################################
+*/
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rmath.h>
+#include <R_ext/Random.h>
+#include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+
+//////////// Filtering of the SNPs of the full-sib families in readRA /////////////////////
+// The genotype calls are taken from the read counts as in readRA: 2 (only reference reads), 1 (both
+// alleles), 0 (only alternate reads) and missing (no reads).
+
+enum { PAR_NA, PAR_AA, PAR_AB, PAR_BB };
+
+#define GENON(ref, alt) (((ref) > 0) + ((alt) == 0))
+
+// Rows (0-based) of the samples of an individual
+typedef struct {
+  const int *rows;
+  int n;
+} ParRows;
+
+// Samples of a parent and of its father and mother (grand[0].n < 0 if the grandparents are unknown),
+// taken from the R objects before the SNPs are filtered in parallel
+typedef struct {
+  ParRows par, grand[2];
+} ParInfo;
+
+static ParRows par_rows(SEXP rows){
+  ParRows r;
+  r.rows = INTEGER(rows);
+  r.n = LENGTH(rows);
+  return r;
+}
+
+static ParInfo par_info(SEXP par, SEXP grand){
+  ParInfo p;
+  p.par = par_rows(par);
+  if(isNull(grand)){
+    p.grand[0].rows = p.grand[1].rows = NULL;
+    p.grand[0].n = p.grand[1].n = -1;
+  }
+  else{
+    p.grand[0] = par_rows(VECTOR_ELT(grand, 0));
+    p.grand[1] = par_rows(VECTOR_ELT(grand, 1));
+  }
+  return p;
+}
+
+// Genotype class of a parent (the samples r.rows[0], ..., r.rows[r.n-1]) at the SNP with read counts
+// ref and alt: AB if any sample is heterozygous and otherwise AA or BB if the samples are all
+// homozygous for the same allele with a total depth above minDepth.
+static int parent_class(const int *ref, const int *alt, ParRows r, double minDepth, int *mixed){
+  int k, g, nAA = 0, nBB = 0;
+  const int *rows = r.rows;
+  double depth = 0;
+  *mixed = 0;
+  for(k = 0; k < r.n; k++){
+    depth += (double) ref[rows[k]] + alt[rows[k]];
+    if(ref[rows[k]] + alt[rows[k]] == 0)
+      continue;
+    g = GENON(ref[rows[k]], alt[rows[k]]);
+    if(g == 1)
+      return PAR_AB;
+    nAA += (g == 2);
+    nBB += (g == 0);
+  }
+  if(depth <= minDepth)
+    return PAR_NA;
+  if(nBB == 0)
+    return PAR_AA;
+  if(nAA == 0)
+    return PAR_BB;
+  *mixed = 1;
+  return PAR_NA;
+}
+
+// Genotype class of a parent, which is found from the grandparents (p->grand[0] and p->grand[1], if
+// given) when the samples of the parent are homozygous for different alleles
+static int parent_geno(const int *ref, const int *alt, const ParInfo *p, double minDepth){
+  int mixed, gd, gm;
+  int cl = parent_class(ref, alt, p->par, minDepth, &mixed);
+  if(!mixed || p->grand[0].n < 0)
+    return cl;
+  gd = parent_class(ref, alt, p->grand[0], minDepth, &mixed);
+  gm = parent_class(ref, alt, p->grand[1], minDepth, &mixed);
+  if((gd == PAR_AA && gm == PAR_BB) || (gd == PAR_BB && gm == PAR_AA))
+    return PAR_AB;
+  if(gd == PAR_AA && gm == PAR_AA)
+    return PAR_AA;
+  if(gd == PAR_BB && gm == PAR_BB)
+    return PAR_BB;
+  return PAR_NA;
+}
+
+// Segregation type (config) of the SNP from the genotype classes of the father and mother
+static int seg_type(int pat, int mat){
+  if(pat == PAR_AB)
+    return (mat == PAR_AB) ? 1 : (mat == PAR_AA) ? 2 : (mat == PAR_BB) ? 3 : NA_INTEGER;
+  if(mat == PAR_AB)
+    return (pat == PAR_AA) ? 4 : (pat == PAR_BB) ? 5 : NA_INTEGER;
+  return NA_INTEGER;
+}
+
+// Filter the SNPs of one family. The read counts are those of all the samples (samples x SNPs), of
+// which prog are the progeny, par = list(father, mother) the parents and grand = list(paternal,
+// maternal) the grandparents (list(grandfather, grandmother), or NULL if unknown), all given as 0-based
+// rows. filter = (MAF, MISS, DEPTH, PVALUE). For each SNP, the segregation type is inferred from the
+// parents and set to NA if the progeny fail the segregation test, which is the chi-square test of the
+// genotype counts of the progeny with the expected proportions adjusted for the probability K that
+// a heterozygous genotype is called homozygous at low depth (Bilton et al., 2017). Returns
+// list(config, keep), where keep is TRUE for the SNPs with a config which pass the MAF and missing
+// data filters.
+SEXP RA_filter(SEXP depth_Ref, SEXP depth_Alt, SEXP prog, SEXP par, SEXP grand, SEXP filter, SEXP nThreads){
+  int nSnps_c = ncols(depth_Ref), nInd_c = nrows(depth_Ref), nProg = LENGTH(prog), nThreads_c = INTEGER(nThreads)[0];
+  int snp, *config, *keep, *progRow = INTEGER(prog), *refAll = INTEGER(depth_Ref), *altAll = INTEGER(depth_Alt);
+  // The rows of the parents and grandparents are taken out of the R lists here, since the R API is not
+  // used in the parallel region
+  ParInfo father = par_info(VECTOR_ELT(par, 0), isNull(grand) ? grand : VECTOR_ELT(grand, 0));
+  ParInfo mother = par_info(VECTOR_ELT(par, 1), isNull(grand) ? grand : VECTOR_ELT(grand, 1));
+  double fMAF = REAL(filter)[0], fMISS = REAL(filter)[1], fDEPTH = REAL(filter)[2], fPVALUE = REAL(filter)[3];
+
+#ifdef _OPENMP
+  if(nThreads_c > omp_get_num_procs())
+    nThreads_c = omp_get_num_procs();
+#endif
+  if(nThreads_c < 1)
+    nThreads_c = 1;
+
+  SEXP pout = PROTECT(allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(pout, 0, allocVector(INTSXP, nSnps_c));
+  SET_VECTOR_ELT(pout, 1, allocVector(LGLSXP, nSnps_c));
+  config = INTEGER(VECTOR_ELT(pout, 0));
+  keep = LOGICAL(VECTOR_ELT(pout, 1));
+
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(nThreads_c) schedule(static, 256)
+#endif
+  for(snp = 0; snp < nSnps_c; snp++){
+    const int *ref = refAll + (size_t) nInd_c * snp, *alt = altAll + (size_t) nInd_c * snp;
+    int k, d, g, nCalled = 0, nAA = 0, nAB = 0, nBB = 0;
+    double K = 0, maf, stat, n, p[3], x[3];
+    config[snp] = seg_type(parent_geno(ref, alt, &father, fDEPTH), parent_geno(ref, alt, &mother, fDEPTH));
+    // Genotype counts of the progeny
+    for(k = 0; k < nProg; k++){
+      d = ref[progRow[k]] + alt[progRow[k]];
+      if(d == 0)
+        continue;
+      nCalled++;
+      K += ((d > 1023) ? 0 : ldexp(1.0, -d)) * 0.5;
+      g = GENON(ref[progRow[k]], alt[progRow[k]]);
+      nAA += (g == 2);
+      nAB += (g == 1);
+      nBB += (g == 0);
+    }
+    // Segregation test, for the SNPs with enough genotype calls
+    if(config[snp] != NA_INTEGER && (double) nCalled / nProg > 1 - fMISS){
+      K /= nCalled;
+      p[1] = 0.5 - 2 * K;
+      p[0] = (config[snp] == 1) ? 0.25 + K : (config[snp] == 2 || config[snp] == 4) ? K : 0.5 + K;
+      p[2] = (config[snp] == 1) ? 0.25 + K : (config[snp] == 2 || config[snp] == 4) ? 0.5 + K : K;
+      x[0] = nBB;
+      x[1] = nAB;
+      x[2] = nAA;
+      n = nCalled;
+      for(k = 0, stat = 0; k < 3; k++)
+        stat += (x[k] - n * p[k]) * (x[k] - n * p[k]) / (n * p[k]);
+      if(pchisq(stat, 2, 0, 0) < fPVALUE)
+        config[snp] = NA_INTEGER;
+    }
+    // MAF and proportion of missing genotypes of the progeny
+    maf = (nCalled > 0) ? (2.0 * nAA + nAB) / nCalled / 2 : 0;
+    maf = fmin2(maf, 1 - maf);
+    keep[snp] = nCalled > 0 && maf > fMAF && (double) (nProg - nCalled) / nProg < fMISS && config[snp] != NA_INTEGER;
+  }
+  UNPROTECT(1);
+  return pout;
+}
+
+// Keep one SNP (chosen at random) from each bin of SNPs on the same chromosome (given by the codes
+// chrom = 1, ..., nChrom in order of their first SNP) which are no more than BIN apart. As in readRA,
+// the random numbers of each chromosome are generated with the seed 58473 plus the (1-based) index of
+// its first SNP, so the SNPs kept are the same as those kept by sample() in R.
+SEXP RA_bin(SEXP chrom, SEXP pos, SEXP BIN){
+  int nSnps_c = LENGTH(chrom), nChrom = 0, c, snp, start, prev, size, *first, *last, *next, *keep;
+  int *chrom_c = INTEGER(chrom), *pos_c = INTEGER(pos);
+  double BIN_c = REAL(BIN)[0];
+
+  // Link the SNPs of each chromosome
+  for(snp = 0; snp < nSnps_c; snp++)
+    nChrom = imax2(nChrom, chrom_c[snp]);
+  first = (int *) R_alloc(nChrom, sizeof(int));
+  next = (int *) R_alloc(nSnps_c, sizeof(int));
+  last = (int *) R_alloc(nChrom, sizeof(int));
+  for(c = 0; c < nChrom; c++)
+    first[c] = -1;
+  for(snp = 0; snp < nSnps_c; snp++){
+    c = chrom_c[snp] - 1;
+    next[snp] = -1;
+    if(first[c] < 0)
+      first[c] = snp;
+    else
+      next[last[c]] = snp;
+    last[c] = snp;
+  }
+  SEXP pout = PROTECT(allocVector(LGLSXP, nSnps_c));
+  keep = LOGICAL(pout);
+  for(snp = 0; snp < nSnps_c; snp++)
+    keep[snp] = FALSE;
+  for(c = 0; c < nChrom; c++){
+    if(first[c] < 0)
+      continue;
+    SEXP seed = PROTECT(lang2(install("set.seed"), ScalarInteger(58473 + first[c] + 1)));
+    eval(seed, R_GlobalEnv);
+    UNPROTECT(1);
+    GetRNGstate();
+    // Bins: runs of SNPs (in order) with gaps of at most BIN
+    for(start = first[c]; start >= 0; start = snp){
+      size = 1;
+      for(prev = start, snp = next[start]; snp >= 0; prev = snp, snp = next[snp]){
+        if(pos_c[snp] == NA_INTEGER || pos_c[prev] == NA_INTEGER || (double) pos_c[snp] - pos_c[prev] > BIN_c)
+          break;
+        size++;
+      }
+      size = (size > 1) ? (int) R_unif_index(size) : 0;
+      for(prev = start; size > 0; size--)
+        prev = next[prev];
+      keep[prev] = TRUE;
+    }
+    PutRNGstate();
+  }
+  UNPROTECT(1);
+  return pout;
+}
@@ -24,11 +24,29 @@
 
 
 static const R_CallMethodDef callMethods[] = {
-  {"ll_fs_scaled_err_c",       (DL_FUNC) &ll_fs_scaled_err_c,		7},
-  {"ll_fs_ss_scaled_err_c",    (DL_FUNC) &ll_fs_ss_scaled_err_c,	7},
-  {"ll_fs_up_ss_scaled_err_c", (DL_FUNC) &ll_fs_up_ss_scaled_err_c,	7},
+  {"ll_fs_scaled_err_c",       (DL_FUNC) &ll_fs_scaled_err_c,		8},
+  {"ll_fs_ss_scaled_err_c",    (DL_FUNC) &ll_fs_ss_scaled_err_c,	8},
+  {"ll_fs_up_ss_scaled_err_c", (DL_FUNC) &ll_fs_up_ss_scaled_err_c,	8},
   {"EM_HMM",                   (DL_FUNC) &EM_HMM,               	12},
   {"EM_HMM_UP",                (DL_FUNC) &EM_HMM_UP,            	11},
+  {"EM_batch",                 (DL_FUNC) &EM_batch,             	2},
+  {"EM_memory",                (DL_FUNC) &EM_memory,            	5},
+  {"ll_HMM",                   (DL_FUNC) &ll_HMM,               	10},
+  {"score_HMM",                (DL_FUNC) &score_HMM,            	10},
+  {"optim_HMM",                (DL_FUNC) &optim_HMM,            	13},
+  {"FSmodel_create",           (DL_FUNC) &FSmodel_create,       	9},
+  {"FSmodel_info",             (DL_FUNC) &FSmodel_info,         	1},
+  {"FSmodel_drop",             (DL_FUNC) &FSmodel_drop,         	4},
+  {"FSmodel_insert",           (DL_FUNC) &FSmodel_insert,       	7},
+  {"FSmodel_order",            (DL_FUNC) &FSmodel_order,        	3},
+  {"rf_2pt",                   (DL_FUNC) &rf_2pt,               	8},
+  {"LG_2pt",                   (DL_FUNC) &LG_2pt,               	9},
+  {"read_vcf",                 (DL_FUNC) &read_vcf,             	2},
+  {"read_ra",                  (DL_FUNC) &read_ra,              	5},
+  {"write_cache",              (DL_FUNC) &write_cache,          	5},
+  {"read_cache",               (DL_FUNC) &read_cache,           	7},
+  {"RA_filter",                (DL_FUNC) &RA_filter,            	7},
+  {"RA_bin",                   (DL_FUNC) &RA_bin,               	3},
   {NULL,		       NULL,				        0}
 };
 
@@ -43,4 +61,22 @@ void R_init_GUSMap(DllInfo *info){
   R_RegisterCCallable("GUSMap","ll_fs_up_ss_scaled_err_c",      (DL_FUNC) &ll_fs_up_ss_scaled_err_c);
   R_RegisterCCallable("GUSMap","EM_HMM",                        (DL_FUNC) &EM_HMM);
   R_RegisterCCallable("GUSMap","EM_HMM_UP",                     (DL_FUNC) &EM_HMM_UP);
+  R_RegisterCCallable("GUSMap","EM_batch",                      (DL_FUNC) &EM_batch);
+  R_RegisterCCallable("GUSMap","EM_memory",                     (DL_FUNC) &EM_memory);
+  R_RegisterCCallable("GUSMap","ll_HMM",                        (DL_FUNC) &ll_HMM);
+  R_RegisterCCallable("GUSMap","score_HMM",                     (DL_FUNC) &score_HMM);
+  R_RegisterCCallable("GUSMap","optim_HMM",                     (DL_FUNC) &optim_HMM);
+  R_RegisterCCallable("GUSMap","FSmodel_create",                (DL_FUNC) &FSmodel_create);
+  R_RegisterCCallable("GUSMap","FSmodel_info",                  (DL_FUNC) &FSmodel_info);
+  R_RegisterCCallable("GUSMap","FSmodel_drop",                  (DL_FUNC) &FSmodel_drop);
+  R_RegisterCCallable("GUSMap","FSmodel_insert",                (DL_FUNC) &FSmodel_insert);
+  R_RegisterCCallable("GUSMap","FSmodel_order",                 (DL_FUNC) &FSmodel_order);
+  R_RegisterCCallable("GUSMap","rf_2pt",                        (DL_FUNC) &rf_2pt);
+  R_RegisterCCallable("GUSMap","LG_2pt",                        (DL_FUNC) &LG_2pt);
+  R_RegisterCCallable("GUSMap","read_vcf",                      (DL_FUNC) &read_vcf);
+  R_RegisterCCallable("GUSMap","read_ra",                       (DL_FUNC) &read_ra);
+  R_RegisterCCallable("GUSMap","write_cache",                   (DL_FUNC) &write_cache);
+  R_RegisterCCallable("GUSMap","read_cache",                    (DL_FUNC) &read_cache);
+  R_RegisterCCallable("GUSMap","RA_filter",                     (DL_FUNC) &RA_filter);
+  R_RegisterCCallable("GUSMap","RA_bin",                        (DL_FUNC) &RA_bin);
 }
@@ -1,277 +1,360 @@
-/*
-##########################################################################
-# Genotyping Uncertainty with Sequencing data and linkage MAPping (GUSMap)
-# Copyright 2017 Timothy P. Bilton <tbilton@maths.otago.ac.nz>
-#
-# This program is free software: you can redistribute it and/or modify
-# it under the terms of the GNU General Public License as published by
-# the Free Software Foundation, either version 3 of the License, or
-# (at your option) any later version.
-#
-# This program is distributed in the hope that it will be useful,
-# but WITHOUT ANY WARRANTY; without even the implied warranty of
-# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-# GNU General Public License for more details.
-# 
-# You should have received a copy of the GNU General Public License
-# along with this program.  If not, see <http://www.gnu.org/licenses/>.
-#########################################################################
-*/
-
-#include <R.h>
-#include <Rinternals.h>
-#include <Rmath.h>
-#include <math.h>
-#include "probFun.h"
-
-
-// Function for returning a specified enetry of the transition matrix for a given recombination fraction value
-double Tmat(int s1, int s2, double rval){
-  int sSum = s1 + s2*4;
-  if((sSum == 0)|(sSum == 5)|(sSum == 10)|(sSum == 15))
-    return (1-rval)*(1-rval);
-  else if((sSum == 3)|(sSum == 6)|(sSum == 9)|(sSum == 12))
-    return rval*rval;
-  else
-    return (1-rval)*rval;
-}
-
-//////////// likelihood functions for multipoint likelihood in full sib-families using GBS data /////////////////////
-// Input variables for likelihoods
-//  - r: recombination fraction values
-//  - genon: matrix of genotype calls. Format in C is a 1-D vector
-//  - depth: matrix of depth values. Format in C is a 1-D vector
-//  - OPGP: The OPGP of all the SNPs.
-//  - nInd: Number of individuals.
-//  - nSnps: Number of SNPs.
-//  - config: Parental genotype configurations (or segregation type)
-//            1 = Informative, 2 = paternal segregating, 3 = maternal segregating
-
-
-//// Scaled versions of the likelihood to deal with overflow issues
-
-
-//// likelihood 3:
-// Not sex-specific (assumed equal) 
-// r.f constrainted to range [0,1/2].
-// OPGP's (or phase) are assumed to be known
-// Include error parameters
-SEXP ll_fs_scaled_err_c(SEXP r, SEXP Kaa, SEXP Kab, SEXP Kbb, SEXP OPGP, SEXP nInd, SEXP nSnps){
-  // Initialize variables
-  int s1, s2, ind, snp, nInd_c, nSnps_c, *pOPGP;
-  double *pll, *pr, *pKaa, *pKab, *pKbb;
-  double alphaTilde[4], alphaDot[4], sum, w_new;
-  // Load R input variables into C
-  nInd_c = INTEGER(nInd)[0];
-  nSnps_c = INTEGER(nSnps)[0];
-  // Define the pointers to the other input R variables
-  pOPGP = INTEGER(OPGP);
-  pKaa = REAL(Kaa);
-  pKab = REAL(Kab);
-  pKbb = REAL(Kbb);
-  pr = REAL(r);  
-  // Define the output variable
-  SEXP ll;
-  PROTECT(ll = allocVector(REALSXP, 1));
-  pll = REAL(ll);
-  double llval = 0;
-
-  // Now compute the likelihood
-  for(ind = 0; ind < nInd_c; ind++){
-    // Compute forward probabilities at snp 1
-    sum = 0;
-    for(s1 = 0; s1 < 4; s1++){
-      //Rprintf("Q value :%.6f at snp %i in ind %i\n", Qentry(pOPGP[0], pKaa[ind], pKab[ind], pKbb[ind], s1+1, delta_c), 0, ind);
-      alphaDot[s1] = 0.25 * Qentry(pOPGP[0], pKaa[ind], pKab[ind], pKbb[ind], s1+1);
-      sum = sum + alphaDot[s1];
-    }
-    // Scale forward probabilities
-    for(s1 = 0; s1 < 4; s1++){
-      alphaTilde[s1] = alphaDot[s1]/sum;
-    }
-    //Rprintf("New weight :%.6f at snp %i\n", sum, 1);
-
-    // add contribution to likelihood
-    //w_logcumsum = log(sum);
-    llval = llval + log(sum);
-
-    // iterate over the remaining SNPs
-    for(snp = 1; snp < nSnps_c; snp++){
-      // compute the next forward probabilities for snp \ell
-      for(s2 = 0; s2 < 4; s2++){
-        sum = 0;
-        for(s1 = 0; s1 < 4; s1++){
-          sum = sum + Tmat(s1, s2, pr[snp-1]) * alphaTilde[s1];
-        }
-        //Rprintf("Q value :%.6f at snp %i in ind %i\n", Qentry(pOPGP[snp], pKaa[ind + nInd_c*snp], pKab[ind + nInd_c*snp], pKbb[ind + nInd_c*snp], s2+1, delta_c), snp, ind);
-        alphaDot[s2] = Qentry(pOPGP[snp], pKaa[ind + nInd_c*snp], pKab[ind + nInd_c*snp], pKbb[ind + nInd_c*snp], s2+1) * sum;
-      }
-      // Compute the weight for snp \ell
-      w_new = 0;
-      for(s2 = 0; s2 < 4; s2++){
-        w_new = w_new + alphaDot[s2];
-      }
-      // Add contribution to the likelihood
-      llval = llval + log(w_new);
-      //w_logcumsum = w_logcumsum + log(w_new);
-      // Scale the forward probability vector
-      for(s2 = 0; s2 < 4; s2++){
-        alphaTilde[s2] = alphaDot[s2]/w_new;
-      }
-    }
-  }
-  
-  pll[0] = -1*llval;
-  // Clean up and return likelihood value
-  UNPROTECT(1);
-  return ll;
-}
-
-//// likelihood 2:
-// sex-specific
-// r.f constrainted to range [0,1/2].
-// OPGP's (or phase) are assumed to be known
-SEXP ll_fs_ss_scaled_err_c(SEXP r, SEXP Kaa, SEXP Kab, SEXP Kbb, SEXP OPGP, SEXP nInd, SEXP nSnps){
-  // Initialize variables
-  int s1, s2, ind, snp, nInd_c, nSnps_c, *pOPGP;
-  double *pll, *pr, *pKaa, *pKab, *pKbb;
-  double alphaTilde[4], alphaDot[4], sum, w_new;
-  // Load R input variables into C
-  nInd_c = INTEGER(nInd)[0];
-  nSnps_c = INTEGER(nSnps)[0];
-  // Define the pointers to the other input R variables
-  pOPGP = INTEGER(OPGP);
-  pKaa = REAL(Kaa);
-  pKab = REAL(Kab);
-  pKbb = REAL(Kbb);
-  pr = REAL(r);  
-  // Define the output variable
-  SEXP ll;
-  PROTECT(ll = allocVector(REALSXP, 1));
-  pll = REAL(ll);
-  double llval = 0;
-  
-  // Now compute the likelihood
-  for(ind = 0; ind < nInd_c; ind++){
-    // Compute forward probabilities at snp 1
-    sum = 0;
-    for(s1 = 0; s1 < 4; s1++){
-      alphaDot[s1] = 0.25 * Qentry(pOPGP[0], pKaa[ind], pKab[ind], pKbb[ind], s1+1);
-      sum = sum + alphaDot[s1];
-    }
-    // Scale forward probabilities
-    for(s1 = 0; s1 < 4; s1++){
-      alphaTilde[s1] = alphaDot[s1]/sum;
-    }
-    //Rprintf("New weight :%.6f at snp %i\n", sum, 1);
-    
-    // add contribution to likelihood
-    //w_logcumsum = log(sum);
-    llval = llval + log(sum);
-
-    // iterate over the remaining SNPs
-    for(snp = 1; snp < nSnps_c; snp++){
-      // compute the next forward probabilities for snp \ell
-      for(s2 = 0; s2 < 4; s2++){
-        sum = 0;
-        for(s1 = 0; s1 < 4; s1++){
-          sum = sum + Tmat_ss(s1, s2, pr[snp-1], pr[snp-1+nSnps_c-1]) * alphaTilde[s1];
-        }
-        alphaDot[s2] = Qentry(pOPGP[snp], pKaa[ind + nInd_c*snp], pKab[ind + nInd_c*snp], pKbb[ind + nInd_c*snp], s2+1) * sum;
-      }
-      // Compute the weight for snp \ell
-      w_new = 0;
-      for(s2 = 0; s2 < 4; s2++){
-        w_new = w_new + alphaDot[s2];
-      }
-      // Add contribution to the likelihood
-      llval = llval + log(w_new);
-      //w_logcumsum = w_logcumsum + log(w_new);
-      // Scale the forward probability vector
-      for(s2 = 0; s2 < 4; s2++){
-        alphaTilde[s2] = alphaDot[s2]/w_new;
-      }
-    }
-  }
-  
-  pll[0] = -1*llval;
-  // Clean up and return likelihood value
-  UNPROTECT(1);
-  return ll;
-}
-
-
-//// likelihood 3: For sex-specific unphased data
-// sex-specific
-// r.f constrainted to range [0,1].
-// OPGP's (or phase) are not known
-SEXP ll_fs_up_ss_scaled_err_c(SEXP r, SEXP Kaa, SEXP Kab, SEXP Kbb, SEXP config, SEXP nInd, SEXP nSnps){
-  // Initialize variables
-  int s1, s2, ind, snp, nInd_c, nSnps_c, *pconfig;
-  double *pll, *pr, *pKaa, *pKab, *pKbb;
-  double alphaTilde[4], alphaDot[4], sum, w_new;
-  // Load R input variables into C
-  nInd_c = INTEGER(nInd)[0];
-  nSnps_c = INTEGER(nSnps)[0];
-  // Define the pointers to the other input R variables
-  pconfig = INTEGER(config);
-  pKaa = REAL(Kaa);
-  pKab = REAL(Kab);
-  pKbb = REAL(Kbb);
-  pr = REAL(r);  
-  // Define the output variable
-  SEXP ll;
-  PROTECT(ll = allocVector(REALSXP, 1));
-  pll = REAL(ll);
-  double llval = 0;
-  
-  // Now compute the likelihood
-  for(ind = 0; ind < nInd_c; ind++){
-    // Compute forward probabilities at snp 1
-    sum = 0;
-    for(s1 = 0; s1 < 4; s1++){
-      //Rprintf("Q value :%.6f at snp %i in ind %i\n", Qentry_up(pconfig[0], pKaa[ind], pKab[ind], pKbb[ind], s1+1, delta_c), 0, ind);
-      alphaDot[s1] = 0.25 * Qentry_up(pconfig[0], pKaa[ind], pKab[ind], pKbb[ind], s1+1);
-      sum = sum + alphaDot[s1];
-    }
-    // Scale forward probabilities
-    for(s1 = 0; s1 < 4; s1++){
-      alphaTilde[s1] = alphaDot[s1]/sum;
-    }
-    //Rprintf("New weight :%.6f at snp %i\n", sum, 1);
-    
-    // add contribution to likelihood
-    //w_logcumsum = log(sum);
-    llval = llval + log(sum);
-    
-    // iterate over the remaining SNPs
-    for(snp = 1; snp < nSnps_c; snp++){
-      // compute the next forward probabilities for snp \ell
-      for(s2 = 0; s2 < 4; s2++){
-        sum = 0;
-        for(s1 = 0; s1 < 4; s1++){
-          sum = sum + Tmat_ss(s1, s2, pr[snp-1], pr[snp-1+nSnps_c-1]) * alphaTilde[s1];
-        }
-        //Rprintf("Q value :%.6f at snp %i in ind %i\n", Qentry_up(pconfig[0], pKaa[ind + nInd_c*snp], pKab[ind + nInd_c*snp], pKbb[ind + nInd_c*snp], s2+1, delta_c), snp, ind);
-        alphaDot[s2] = Qentry_up(pconfig[snp], pKaa[ind + nInd_c*snp], pKab[ind + nInd_c*snp], pKbb[ind + nInd_c*snp], s2+1) * sum;
-      }
-      // Compute the weight for snp \ell
-      w_new = 0;
-      for(s2 = 0; s2 < 4; s2++){
-        w_new = w_new + alphaDot[s2];
-      }
-      // Add contribution to the likelihood
-      llval = llval + log(w_new);
-      //w_logcumsum = w_logcumsum + log(w_new);
-      // Scale the forward probability vector
-      for(s2 = 0; s2 < 4; s2++){
-        alphaTilde[s2] = alphaDot[s2]/w_new;
-      }
-    }
-  }
-  
-  pll[0] = -1*llval;
-  // Clean up and return likelihood value
-  UNPROTECT(1);
-  return ll;
-}
+/*
+##########################################################################
+# Genotyping Uncertainty with Sequencing data and linkage MAPping (GUSMap)
+# Copyright 2017 Timothy P. Bilton <tbilton@maths.otago.ac.nz>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+# 
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#########################################################################
+*/
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rmath.h>
+#include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "probFun.h"
+
+
+//////////// likelihood functions for multipoint likelihood in full sib-families using GBS data /////////////////////
+// Input variables for likelihoods
+//  - r: recombination fraction values
+//  - genon: matrix of genotype calls. Format in C is a 1-D vector
+//  - depth: matrix of depth values. Format in C is a 1-D vector
+//  - OPGP: The OPGP of all the SNPs.
+//  - nInd: Number of individuals.
+//  - nSnps: Number of SNPs.
+//  - config: Parental genotype configurations (or segregation type)
+//            1 = Informative, 2 = paternal segregating, 3 = maternal segregating
+//  - nThreads: Number of threads over which the groups of individuals are split (see ll_fam).
+
+
+//// Scaled versions of the likelihood to deal with overflow issues
+
+// Scaled forward recursion for the nl (<= NLANE) individuals ind[0:(nl-1)] (see the lane kernels in probFun.h).
+// The log-likelihood of individual ind[l] is stored in llind[ind[l]].
+//  - Tc: transition matrix cache of each interval (see Tmat_cache)
+//  - pgeno: OPGP (or config) of each SNP and gtab the corresponding table of genotypes (geno_OPGP or geno_config)
+static LANE_KERNEL void ll_lanes(double *Tc, double *pKaa, double *pKab, double *pKbb, int *pgeno,
+                                 const int *ind, int nl, int nInd_c, int nSnps_c, const int (*gtab)[4], double *llind){
+  int s1, s2, snp, l;
+  R_xlen_t cell;
+  double alphaTilde[4*NLANE], alphaDot[4*NLANE], Talpha[4*NLANE], sum[NLANE], llval[NLANE];
+  double Kaa[NLANE], Kab[NLANE], Kbb[NLANE];
+  const double *Q[4];
+  // Compute forward probabilities at snp 1
+  lane_gather(pKaa, ind, nl, Kaa);
+  lane_gather(pKab, ind, nl, Kab);
+  lane_gather(pKbb, ind, nl, Kbb);
+  Qlanes(gtab[pgeno[0]-1], Kaa, Kab, Kbb, Q);
+  for(l = 0; l < NLANE; l++)
+    sum[l] = 0;
+  for(s1 = 0; s1 < 4; s1++){
+    for(l = 0; l < NLANE; l++){
+      alphaDot[s1*NLANE + l] = 0.25 * Q[s1][l];
+      sum[l] = sum[l] + alphaDot[s1*NLANE + l];
+    }
+  }
+  // Scale forward probabilities
+  for(s1 = 0; s1 < 4; s1++){
+    for(l = 0; l < NLANE; l++)
+      alphaTilde[s1*NLANE + l] = alphaDot[s1*NLANE + l]/sum[l];
+  }
+  // add contribution to likelihood
+  for(l = 0; l < NLANE; l++)
+    llval[l] = log(sum[l]);
+
+  // iterate over the remaining SNPs
+  for(snp = 1; snp < nSnps_c; snp++){
+    cell = (R_xlen_t)nInd_c*snp;
+    // compute the next forward probabilities for snp \ell
+    Tmult_lanes(Tc + 4*(snp-1), alphaTilde, Talpha);
+    lane_gather(pKaa + cell, ind, nl, Kaa);
+    lane_gather(pKab + cell, ind, nl, Kab);
+    lane_gather(pKbb + cell, ind, nl, Kbb);
+    Qlanes(gtab[pgeno[snp]-1], Kaa, Kab, Kbb, Q);
+    for(s2 = 0; s2 < 4; s2++){
+      for(l = 0; l < NLANE; l++)
+        alphaDot[s2*NLANE + l] = Q[s2][l] * Talpha[s2*NLANE + l];
+    }
+    // Compute the weight for snp \ell
+    for(l = 0; l < NLANE; l++)
+      sum[l] = 0;
+    for(s2 = 0; s2 < 4; s2++){
+      for(l = 0; l < NLANE; l++)
+        sum[l] = sum[l] + alphaDot[s2*NLANE + l];
+    }
+    // Add contribution to the likelihood
+    for(l = 0; l < NLANE; l++)
+      llval[l] = llval[l] + log(sum[l]);
+    // Scale the forward probability vector
+    for(s2 = 0; s2 < 4; s2++){
+      for(l = 0; l < NLANE; l++)
+        alphaTilde[s2*NLANE + l] = alphaDot[s2*NLANE + l]/sum[l];
+    }
+  }
+  for(l = 0; l < nl; l++)
+    llind[ind[l]] = llval[l];
+}
+
+// A cell without reads has the same emission probability for every state (one when it is computed from
+// the read counts), which only adds its log to the log-likelihood and leaves the forward probabilities as
+// they are after the transition.
+static inline int ll_uninformative(double *pKaa, double *pKab, double *pKbb, R_xlen_t cell){
+  return pKaa[cell] == pKab[cell] && pKab[cell] == pKbb[cell];
+}
+
+// Sparse version of ll_lanes for groups of individuals with many SNPs without reads (as EM_lanes_sparse
+// in 'em.c'): each lane only steps through the informative SNPs of its individual, which are
+// obsSnp[obsPtr[ind]],...,obsSnp[obsPtr[ind+1]-1], with the transition over the whole gap between two of them
+// (see Tgap), and llc[ind] is the log of the emission probabilities at the other SNPs. The forward probabilities
+// stay at the (stationary) uniform distribution up to the first informative SNP and lanes with fewer than nStep
+// steps are padded with empty steps. The k-th step of lane l is put in obs[k*NLANE + l].
+static LANE_KERNEL void ll_lanes_sparse(double *Tc, double *pKaa, double *pKab, double *pKbb, int *pgeno,
+                                        const int *ind, int nl, int nInd_c, const int (*gtab)[4], int nStep,
+                                        R_xlen_t *obsPtr, int *obsSnp, double *llc, int *obs, double *llind){
+  int s, k, l, b, nObs;
+  R_xlen_t cell;
+  double alpha[4*NLANE], Talpha[4*NLANE], Tl[4*NLANE], Q[4*NLANE], T[4], K[3], sum[NLANE], llval[NLANE];
+  const int *geno;
+  for(l = 0; l < NLANE; l++){
+    nObs = (l < nl) ? obsPtr[ind[l]+1] - obsPtr[ind[l]] : 0;
+    for(k = 0; k < nStep; k++)
+      obs[k*NLANE + l] = (k < nObs) ? obsSnp[obsPtr[ind[l]] + k] : -1;
+    llval[l] = (l < nl) ? llc[ind[l]] : 0;
+  }
+  for(s = 0; s < 4*NLANE; s++)
+    alpha[s] = 0.25;
+  for(k = 0; k < nStep; k++){
+    // Transition over the gap from the previous step (the identity for the first and the empty steps)
+    // and emission probabilities at the SNP of the step
+    for(l = 0; l < NLANE; l++){
+      b = obs[k*NLANE + l];
+      if(b < 0){
+        T[0] = T[2] = 1;
+        T[1] = T[3] = 0;
+        K[0] = K[1] = K[2] = 1;
+        geno = gtab[0];
+      }
+      else{
+        Tgap(Tc, k ? obs[(k-1)*NLANE + l] : b, b, T);
+        cell = ind[l] + (R_xlen_t)nInd_c*b;
+        K[0] = pKab[cell];
+        K[1] = pKaa[cell];
+        K[2] = pKbb[cell];
+        geno = gtab[pgeno[b]-1];
+      }
+      for(s = 0; s < 4; s++){
+        Tl[s*NLANE + l] = T[s];
+        Q[s*NLANE + l] = K[geno[s]];
+      }
+    }
+    Tmult_lanes_var(Tl, alpha, Talpha);
+    for(l = 0; l < NLANE; l++)
+      sum[l] = 0;
+    for(s = 0; s < 4; s++){
+      for(l = 0; l < NLANE; l++){
+        Talpha[s*NLANE + l] = Q[s*NLANE + l] * Talpha[s*NLANE + l];
+        sum[l] = sum[l] + Talpha[s*NLANE + l];
+      }
+    }
+    // the empty steps leave the forward probabilities unchanged
+    for(l = 0; l < NLANE; l++){
+      if(obs[k*NLANE + l] < 0)
+        sum[l] = 1;
+      llval[l] = llval[l] + log(sum[l]);
+    }
+    for(s = 0; s < 4; s++){
+      for(l = 0; l < NLANE; l++)
+        alpha[s*NLANE + l] = Talpha[s*NLANE + l]/sum[l];
+    }
+  }
+  for(l = 0; l < nl; l++)
+    llind[ind[l]] = llval[l];
+}
+
+// Log-likelihood of all the individuals of a family, summed in order.
+// As in EM_setup (see 'em.c'), the individuals with at most EM_SPARSE of the SNPs informative use
+// ll_lanes_sparse, for which they are put after the other individuals and sorted by their number of
+// informative SNPs (in decreasing order and then by index), so that they are in the same groups of lanes.
+// The groups of lanes are split over nThreads threads, each with its own steps buffer (obs), and as the
+// log-likelihood of each individual is summed in order afterwards, the result does not depend on nThreads.
+static double ll_fam(double *Tc, double *pKaa, double *pKab, double *pKbb, int *pgeno,
+                     int nInd_c, int nSnps_c, const int (*gtab)[4], int nThreads){
+  int ind, snp, anySparse = 0;
+  R_xlen_t cell;
+  double llval = 0;
+  double *llind = (double *) R_alloc(nInd_c, sizeof(double)), *llc = (double *) R_alloc(nInd_c, sizeof(double)), *key;
+  int *nObs = (int *) R_alloc(nInd_c, sizeof(int)), *order = (int *) R_alloc(nInd_c, sizeof(int)), *obsSnp;
+#ifdef _OPENMP
+  if(nThreads > omp_get_num_procs())
+    nThreads = omp_get_num_procs();
+#endif
+  if(nThreads < 1)
+    nThreads = 1;
+  int *obs = (int *) R_alloc(NLANE * (size_t) nSnps_c * nThreads, sizeof(int));
+  R_xlen_t *obsPtr = (R_xlen_t *) R_alloc((size_t) nInd_c + 1, sizeof(R_xlen_t));
+  R_xlen_t *next = (R_xlen_t *) R_alloc(nInd_c, sizeof(R_xlen_t));
+  // Number of informative SNPs of each individual (see ll_uninformative)
+  for(ind = 0; ind < nInd_c; ind++){
+    nObs[ind] = 0;
+    llc[ind] = 0;
+    order[ind] = ind;
+  }
+  for(snp = 0; snp < nSnps_c; snp++){
+    for(ind = 0; ind < nInd_c; ind++)
+      nObs[ind] = nObs[ind] + !ll_uninformative(pKaa, pKab, pKbb, ind + (R_xlen_t)nInd_c*snp);
+  }
+  // The informative SNPs of the individuals which use ll_lanes_sparse (in obsSnp) and the log of the
+  // emission probabilities at their other SNPs (in llc)
+  obsPtr[0] = 0;
+  for(ind = 0; ind < nInd_c; ind++){
+    next[ind] = obsPtr[ind];
+    obsPtr[ind+1] = obsPtr[ind] + ((nObs[ind] <= EM_SPARSE * nSnps_c) ? nObs[ind] : 0);
+    anySparse = anySparse || (nObs[ind] <= EM_SPARSE * nSnps_c);
+  }
+  obsSnp = (int *) R_alloc((size_t) obsPtr[nInd_c] + 1, sizeof(int));
+  for(snp = 0; snp < nSnps_c && anySparse; snp++){
+    for(ind = 0; ind < nInd_c; ind++){
+      if(nObs[ind] > EM_SPARSE * nSnps_c)
+        continue;
+      cell = ind + (R_xlen_t)nInd_c*snp;
+      if(!ll_uninformative(pKaa, pKab, pKbb, cell))
+        obsSnp[next[ind]++] = snp;
+      else if(pKaa[cell] != 1)
+        llc[ind] = llc[ind] + log(pKaa[cell]);
+    }
+  }
+  if(anySparse){
+    key = (double *) R_alloc(nInd_c, sizeof(double));
+    for(ind = 0; ind < nInd_c; ind++)
+      key[ind] = (double) (nObs[ind] <= EM_SPARSE * nSnps_c ? nObs[ind] : nSnps_c + 1) * nInd_c + (nInd_c - 1 - ind);
+    revsort(key, order, nInd_c);
+  }
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(nThreads) schedule(dynamic, 1)
+#endif
+  for(ind = 0; ind < nInd_c; ind = ind + NLANE){
+    int l, thread = 0, nl = (nInd_c - ind < NLANE) ? nInd_c - ind : NLANE, nStep = 0;
+#ifdef _OPENMP
+    thread = omp_get_thread_num();
+#endif
+    for(l = 0; l < nl; l++){
+      if(nObs[order[ind + l]] > nStep)
+        nStep = nObs[order[ind + l]];
+    }
+    if(nStep <= EM_SPARSE * nSnps_c)
+      ll_lanes_sparse(Tc, pKaa, pKab, pKbb, pgeno, order + ind, nl, nInd_c, gtab, nStep, obsPtr, obsSnp, llc,
+                      obs + NLANE * (size_t) nSnps_c * thread, llind);
+    else
+      ll_lanes(Tc, pKaa, pKab, pKbb, pgeno, order + ind, nl, nInd_c, nSnps_c, gtab, llind);
+  }
+  for(ind = 0; ind < nInd_c; ind++)
+    llval = llval + llind[ind];
+  return llval;
+}
+
+//// likelihood 1:
+// Not sex-specific (assumed equal) 
+// r.f constrainted to range [0,1/2].
+// OPGP's (or phase) are assumed to be known
+// Include error parameters
+SEXP ll_fs_scaled_err_c(SEXP r, SEXP Kaa, SEXP Kab, SEXP Kbb, SEXP OPGP, SEXP nInd, SEXP nSnps, SEXP nThreads){
+  // Initialize variables
+  int nInd_c, nSnps_c;
+  double *pr;
+  // Load R input variables into C
+  nInd_c = INTEGER(nInd)[0];
+  nSnps_c = INTEGER(nSnps)[0];
+  pr = REAL(r);  
+  if(check_geno(INTEGER(OPGP), nSnps_c, 16))
+    error("Invalid OPGP value");
+  // Compute the transition matrices
+  double *Tc = (double *) R_alloc(4 * (size_t) (nSnps_c-1), sizeof(double));
+  Tmat_cache(Tc, pr, pr, nSnps_c-1);
+  // Define the output variable
+  SEXP ll;
+  PROTECT(ll = allocVector(REALSXP, 1));
+
+  // Now compute the likelihood
+  double llval = ll_fam(Tc, REAL(Kaa), REAL(Kab), REAL(Kbb), INTEGER(OPGP), nInd_c, nSnps_c, geno_OPGP, asInteger(nThreads));
+  
+  REAL(ll)[0] = -1*llval;
+  // Clean up and return likelihood value
+  UNPROTECT(1);
+  return ll;
+}
+
+//// likelihood 2:
+// sex-specific
+// r.f constrainted to range [0,1/2].
+// OPGP's (or phase) are assumed to be known
+SEXP ll_fs_ss_scaled_err_c(SEXP r, SEXP Kaa, SEXP Kab, SEXP Kbb, SEXP OPGP, SEXP nInd, SEXP nSnps, SEXP nThreads){
+  // Initialize variables
+  int nInd_c, nSnps_c;
+  double *pr;
+  // Load R input variables into C
+  nInd_c = INTEGER(nInd)[0];
+  nSnps_c = INTEGER(nSnps)[0];
+  pr = REAL(r);  
+  if(check_geno(INTEGER(OPGP), nSnps_c, 16))
+    error("Invalid OPGP value");
+  // Compute the transition matrices
+  double *Tc = (double *) R_alloc(4 * (size_t) (nSnps_c-1), sizeof(double));
+  Tmat_cache(Tc, pr, pr + nSnps_c-1, nSnps_c-1);
+  // Define the output variable
+  SEXP ll;
+  PROTECT(ll = allocVector(REALSXP, 1));
+  
+  // Now compute the likelihood
+  double llval = ll_fam(Tc, REAL(Kaa), REAL(Kab), REAL(Kbb), INTEGER(OPGP), nInd_c, nSnps_c, geno_OPGP, asInteger(nThreads));
+  
+  REAL(ll)[0] = -1*llval;
+  // Clean up and return likelihood value
+  UNPROTECT(1);
+  return ll;
+}
+
+
+//// likelihood 3: For sex-specific unphased data
+// sex-specific
+// r.f constrainted to range [0,1].
+// OPGP's (or phase) are not known
+SEXP ll_fs_up_ss_scaled_err_c(SEXP r, SEXP Kaa, SEXP Kab, SEXP Kbb, SEXP config, SEXP nInd, SEXP nSnps, SEXP nThreads){
+  // Initialize variables
+  int nInd_c, nSnps_c;
+  double *pr;
+  // Load R input variables into C
+  nInd_c = INTEGER(nInd)[0];
+  nSnps_c = INTEGER(nSnps)[0];
+  pr = REAL(r);  
+  if(check_geno(INTEGER(config), nSnps_c, 5))
+    error("Invalid segregation type (config) value");
+  // Compute the transition matrices
+  double *Tc = (double *) R_alloc(4 * (size_t) (nSnps_c-1), sizeof(double));
+  Tmat_cache(Tc, pr, pr + nSnps_c-1, nSnps_c-1);
+  // Define the output variable
+  SEXP ll;
+  PROTECT(ll = allocVector(REALSXP, 1));
+  
+  // Now compute the likelihood
+  double llval = ll_fam(Tc, REAL(Kaa), REAL(Kab), REAL(Kbb), INTEGER(config), nInd_c, nSnps_c, geno_config, asInteger(nThreads));
+  
+  REAL(ll)[0] = -1*llval;
+  // Clean up and return likelihood value
+  UNPROTECT(1);
+  return ll;
+}
+
@@ -0,0 +1,1028 @@
+/*
+##########################################################################
+# Genotyping Uncertainty with Sequencing data and linkage MAPping (GUSMap)
+# Copyright 2017 Timothy P. Bilton <tbilton@maths.otago.ac.nz>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#########################################################################
+*/
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rmath.h>
+#include <math.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "probFun.h"
+
+
+//////////// Fitted model for full-sib families (phase known) with incremental marker edits /////////////////////
+// The model keeps the scaled forward (alphaTilde) and backward (betaTilde) probabilities of every
+// individual at every SNP, together with the log of their scaling factors (la and lb), so that
+//   log L_i = la[snp] + lb[snp] + log(sum_s alphaTilde[snp](s) * betaTilde[snp](s))
+// for any snp. Removing a SNP (or adding a new one) only changes the chain between its neighbours,
+// so the log-likelihood after the edit and the r.f.'s of the new intervals can be computed from the
+// stored forward probabilities of the left neighbour and backward probabilities of the right neighbour,
+// at a cost of O(nInd) per EM iteration (see FSwindow). When an edit is applied, the forward
+// probabilities to the right of the edit and the backward probabilities to the left of it are updated.
+// Note: The binomial coefficients are included in the log-likelihood (as in rf_est_FS).
+
+typedef struct {
+  int noFam, nTotal, nSnps, cap, nThreads;  // cap: number of SNPs for which memory is allocated
+  int *famInd;                 // family of each individual
+  int *geno;                   // OPGP of each SNP and family (geno[snp*noFam + fam])
+  int *pair;                   // depth pair of each SNP and individual (pair[snp*nTotal + ind], see depth_pairs)
+  int nPairs, maxDepth;        // number of unique depth pairs and largest read count
+  int *pairRef, *pairAlt;      // read counts of each depth pair
+  double *pAA, *pAB, *pBB;     // emission probabilities of each depth pair (see computeProb)
+  double *r_f, *r_m;           // paternal and maternal r.f. of each interval
+  double ep;                   // sequencing error parameter
+  double *alphaTilde, *betaTilde;   // scaled forward and backward probabilities ([(snp*nTotal + ind)*4 + s])
+  double *la, *lb;             // log of the scaling factors of alphaTilde and betaTilde ([snp*nTotal + ind])
+  double *lbin;                // sum of the log binomial coefficients of each SNP
+  int *id;                     // index of each SNP in the data used to create the model (-1 for added SNPs)
+} FSmodel;
+
+// Transition matrix cache of an interval (see Tmat_cache)
+static inline void Tc_set(double *Tc, double r_f, double r_m){
+  Tc[0] = 1 - r_f;
+  Tc[1] = r_f;
+  Tc[2] = 1 - r_m;
+  Tc[3] = r_m;
+}
+
+// Emission probabilities of the four states of a cell with OPGP g and depth pair k
+static inline void Qcell(FSmodel *m, int g, int k, double *Q){
+  Qvec(geno_OPGP[g-1], m->pAA[k], m->pAB[k], m->pBB[k], Q);
+}
+
+static inline void FSmodel_Q(FSmodel *m, int snp, int ind, double *Q){
+  Qcell(m, m->geno[snp*m->noFam + m->famInd[ind]], m->pair[(R_xlen_t) snp*m->nTotal + ind], Q);
+}
+
+// Find the depth pairs of n cells with read counts depth_Ref and depth_Alt (in pair) among the depth pairs
+// of the model. The pairs which are not in the model yet are added to it, and the emission probabilities
+// of all the pairs are then recomputed at the sequencing error of the model, as in EM_pairs (see 'em.c').
+static void FSmodel_pairs(FSmodel *m, int *depth_Ref, int *depth_Alt, R_xlen_t n, int *pair){
+  int k, j, nNew, maxDepth, nOld = m->nPairs, *ref, *alt, *map;
+  R_xlen_t cell;
+  nNew = depth_pairs(depth_Ref, depth_Alt, n, pair, &ref, &alt, &maxDepth);
+  // The pairs of the cells are unique, so they only need to be looked up among the pairs already in the model
+  map = (int *) R_alloc(nNew > 0 ? nNew : 1, sizeof(int));
+  for(k = 0; k < nNew; k++){
+    for(j = 0; j < nOld && (m->pairRef[j] != ref[k] || m->pairAlt[j] != alt[k]); j++)
+      ;
+    map[k] = (j < nOld) ? j : -1;
+    m->nPairs = m->nPairs + (j == nOld);
+  }
+  if(m->nPairs > nOld){
+    m->pairRef = Realloc(m->pairRef, m->nPairs, int);
+    m->pairAlt = Realloc(m->pairAlt, m->nPairs, int);
+    m->pAA = Realloc(m->pAA, m->nPairs, double);
+    m->pAB = Realloc(m->pAB, m->nPairs, double);
+    m->pBB = Realloc(m->pBB, m->nPairs, double);
+    for(k = 0, j = nOld; k < nNew; k++){
+      if(map[k] >= 0)
+        continue;
+      m->pairRef[j] = ref[k];
+      m->pairAlt[j] = alt[k];
+      map[k] = j++;
+    }
+    if(maxDepth > m->maxDepth)
+      m->maxDepth = maxDepth;
+    computeProb(m->pAA, m->pBB, m->ep, m->pairRef, m->pairAlt, m->nPairs, m->maxDepth,
+                (double *) R_alloc(2 * ((size_t) m->maxDepth + 1), sizeof(double)));
+    for(k = 0; k < m->nPairs; k++)
+      m->pAB[k] = ldexp(1.0, -(m->pairRef[k] + m->pairAlt[k]));
+  }
+  for(cell = 0; cell < n; cell++)
+    pair[cell] = map[pair[cell]];
+}
+
+// Scaled forward recursion of an individual from SNP 'from' onwards
+static void FSmodel_forward(FSmodel *m, int ind, int from){
+  int snp, s;
+  double Q[4], Talpha[4], Tc[4], sum, llprev;
+  double *alpha;
+  for(snp = from; snp < m->nSnps; snp++){
+    alpha = m->alphaTilde + 4*((R_xlen_t) snp*m->nTotal + ind);
+    FSmodel_Q(m, snp, ind, Q);
+    if(snp == 0){
+      for(s = 0; s < 4; s++)
+        alpha[s] = 0.25 * Q[s];
+      llprev = 0;
+    }
+    else{
+      Tc_set(Tc, m->r_f[snp-1], m->r_m[snp-1]);
+      Tmult(Tc, alpha - 4*(R_xlen_t) m->nTotal, Talpha);
+      for(s = 0; s < 4; s++)
+        alpha[s] = Q[s] * Talpha[s];
+      llprev = m->la[(R_xlen_t) (snp-1)*m->nTotal + ind];
+    }
+    sum = alpha[0] + alpha[1] + alpha[2] + alpha[3];
+    for(s = 0; s < 4; s++)
+      alpha[s] = alpha[s]/sum;
+    m->la[(R_xlen_t) snp*m->nTotal + ind] = llprev + log(sum);
+  }
+}
+
+// Scaled backward recursion of an individual from SNP 'to' back to the first SNP
+static void FSmodel_backward(FSmodel *m, int ind, int to){
+  int snp, s;
+  double Q[4], Qbeta[4], Tc[4], sum;
+  double *beta;
+  for(snp = to; snp >= 0; snp--){
+    beta = m->betaTilde + 4*((R_xlen_t) snp*m->nTotal + ind);
+    if(snp == m->nSnps - 1){
+      for(s = 0; s < 4; s++)
+        beta[s] = 1;
+      m->lb[(R_xlen_t) snp*m->nTotal + ind] = 0;
+      continue;
+    }
+    FSmodel_Q(m, snp+1, ind, Q);
+    for(s = 0; s < 4; s++)
+      Qbeta[s] = Q[s] * beta[4*(R_xlen_t) m->nTotal + s];
+    Tc_set(Tc, m->r_f[snp], m->r_m[snp]);
+    Tmult(Tc, Qbeta, beta);
+    sum = beta[0] + beta[1] + beta[2] + beta[3];
+    for(s = 0; s < 4; s++)
+      beta[s] = beta[s]/sum;
+    m->lb[(R_xlen_t) snp*m->nTotal + ind] = m->lb[(R_xlen_t) (snp+1)*m->nTotal + ind] + log(sum);
+  }
+}
+
+// Log-likelihood of the current model
+static double FSmodel_loglik(FSmodel *m){
+  int ind, snp;
+  double llval = 0;
+  for(ind = 0; ind < m->nTotal; ind++)
+    llval = llval + m->la[(R_xlen_t) (m->nSnps-1)*m->nTotal + ind];
+  for(snp = 0; snp < m->nSnps; snp++)
+    llval = llval + m->lbin[snp];
+  return llval;
+}
+
+// Update the forward probabilities from SNP 'from' onwards and the backward probabilities from SNP 'to' back
+static void FSmodel_update(FSmodel *m, int from, int to){
+  int ind;
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(m->nThreads) schedule(static)
+#endif
+  for(ind = 0; ind < m->nTotal; ind++){
+    FSmodel_forward(m, ind, from);
+    FSmodel_backward(m, ind, to);
+  }
+}
+
+// Make sure that there is memory for nSnps SNPs
+static void FSmodel_reserve(FSmodel *m, int nSnps){
+  size_t nT = m->nTotal;
+  if(nSnps <= m->cap)
+    return;
+  m->cap = (nSnps > 2*m->cap) ? nSnps : 2*m->cap;
+  m->geno      = Realloc(m->geno, (size_t) m->cap * m->noFam, int);
+  m->pair      = Realloc(m->pair, (size_t) m->cap * nT, int);
+  m->r_f       = Realloc(m->r_f, (size_t) m->cap, double);
+  m->r_m       = Realloc(m->r_m, (size_t) m->cap, double);
+  m->alphaTilde = Realloc(m->alphaTilde, 4 * (size_t) m->cap * nT, double);
+  m->betaTilde  = Realloc(m->betaTilde, 4 * (size_t) m->cap * nT, double);
+  m->la        = Realloc(m->la, (size_t) m->cap * nT, double);
+  m->lb        = Realloc(m->lb, (size_t) m->cap * nT, double);
+  m->lbin      = Realloc(m->lbin, (size_t) m->cap, double);
+  m->id        = Realloc(m->id, (size_t) m->cap, int);
+}
+
+// Move the per-SNP data of SNPs from:(nSnps-1) by shift SNPs (-1 removes SNP from-1, +1 opens a gap at from)
+static void FSmodel_shift(FSmodel *m, int from, int shift){
+  size_t n = m->nSnps - from, nT = m->nTotal;
+  memmove(m->geno + (size_t) (from+shift)*m->noFam, m->geno + (size_t) from*m->noFam, n*m->noFam*sizeof(int));
+  memmove(m->pair + (from+shift)*nT, m->pair + from*nT, n*nT*sizeof(int));
+  memmove(m->alphaTilde + 4*(from+shift)*nT, m->alphaTilde + 4*from*nT, 4*n*nT*sizeof(double));
+  memmove(m->betaTilde + 4*(from+shift)*nT, m->betaTilde + 4*from*nT, 4*n*nT*sizeof(double));
+  memmove(m->la + (from+shift)*nT, m->la + from*nT, n*nT*sizeof(double));
+  memmove(m->lb + (from+shift)*nT, m->lb + from*nT, n*nT*sizeof(double));
+  memmove(m->lbin + from+shift, m->lbin + from, n*sizeof(double));
+  memmove(m->id + from+shift, m->id + from, n*sizeof(int));
+}
+
+// Same for the intervals from:(nSnps-2)
+static void FSmodel_shift_rf(FSmodel *m, int from, int shift){
+  size_t n = m->nSnps - 1 - from;
+  memmove(m->r_f + from+shift, m->r_f + from, n*sizeof(double));
+  memmove(m->r_m + from+shift, m->r_m + from, n*sizeof(double));
+}
+
+static double SNP_lbin(int *depth_Ref, int *depth_Alt, int nTotal){
+  int ind;
+  double lbin = 0;
+  for(ind = 0; ind < nTotal; ind++)
+    lbin = lbin + lchoose(depth_Ref[ind] + depth_Alt[ind], depth_Ref[ind]);
+  return lbin;
+}
+
+static void FSmodel_finalize(SEXP ptr){
+  FSmodel *m = (FSmodel *) R_ExternalPtrAddr(ptr);
+  if(m == NULL)
+    return;
+  Free(m->famInd);
+  Free(m->geno);
+  Free(m->pair);
+  Free(m->pairRef);
+  Free(m->pairAlt);
+  Free(m->pAA);
+  Free(m->pAB);
+  Free(m->pBB);
+  Free(m->r_f);
+  Free(m->r_m);
+  Free(m->alphaTilde);
+  Free(m->betaTilde);
+  Free(m->la);
+  Free(m->lb);
+  Free(m->lbin);
+  Free(m->id);
+  Free(m);
+  R_ClearExternalPtr(ptr);
+}
+
+static FSmodel *FSmodel_get(SEXP model){
+  if(TYPEOF(model) != EXTPTRSXP)
+    error("The model is not a fitted model object (see FS_model)");
+  FSmodel *m = (FSmodel *) R_ExternalPtrAddr(model);
+  if(m == NULL)
+    error("The model is no longer available (e.g., it has been saved and reloaded). Please create it again");
+  return m;
+}
+
+
+//// The window between the neighbours of an edit
+// x: forward probabilities into the window (alphaTilde of the left neighbour, or the initial distribution)
+// y: backward probabilities out of the window (emission times betaTilde of the right neighbour, or one)
+// off: log of the scaling factors of x and y
+// Qmid: emission probabilities of a new SNP in the window (NULL when a SNP is removed)
+// The r.f.'s of the window are r_c = (r_f, r_m) of the left interval followed by those of the right
+// interval. Without a new SNP, there is a single interval (when both neighbours exist) or none.
+typedef struct {
+  int nTotal, hasL, hasR;
+  double *x, *y, *off, *Qmid;
+} FSwindow;
+
+static void FSwindow_setup(FSmodel *m, FSwindow *w, int left, int right, double *Qmid){
+  int ind, s;
+  double Q[4];
+  w->nTotal = m->nTotal;
+  w->hasL = (left >= 0);
+  w->hasR = (right < m->nSnps);
+  w->Qmid = Qmid;
+  w->x = (double *) R_alloc(4 * (size_t) m->nTotal, sizeof(double));
+  w->y = (double *) R_alloc(4 * (size_t) m->nTotal, sizeof(double));
+  w->off = (double *) R_alloc(m->nTotal, sizeof(double));
+  for(ind = 0; ind < m->nTotal; ind++){
+    w->off[ind] = 0;
+    for(s = 0; s < 4; s++){
+      w->x[4*ind + s] = 0.25;
+      w->y[4*ind + s] = 1;
+    }
+    if(w->hasL){
+      for(s = 0; s < 4; s++)
+        w->x[4*ind + s] = m->alphaTilde[4*((R_xlen_t) left*m->nTotal + ind) + s];
+      w->off[ind] = w->off[ind] + m->la[(R_xlen_t) left*m->nTotal + ind];
+    }
+    if(w->hasR){
+      FSmodel_Q(m, right, ind, Q);
+      for(s = 0; s < 4; s++)
+        w->y[4*ind + s] = Q[s] * m->betaTilde[4*((R_xlen_t) right*m->nTotal + ind) + s];
+      w->off[ind] = w->off[ind] + m->lb[(R_xlen_t) right*m->nTotal + ind];
+    }
+  }
+}
+
+// Unnormalized expected number of paternal and maternal recombinations in an interval, given the forward
+// probabilities x into it and the backward probabilities y out of it. The paternal (maternal) part of the
+// transition matrix is obtained by setting the diagonal of the paternal (maternal) factor to zero.
+static inline void FSwindow_rec(const double *Tc, const double *x, const double *y, double *rec){
+  int s;
+  double Tp[4] = {0, Tc[1], Tc[2], Tc[3]}, Tm[4] = {Tc[0], Tc[1], 0, Tc[3]}, Ty[4];
+  Tmult(Tp, y, Ty);
+  rec[0] = 0;
+  for(s = 0; s < 4; s++)
+    rec[0] = rec[0] + x[s]*Ty[s];
+  Tmult(Tm, y, Ty);
+  rec[1] = 0;
+  for(s = 0; s < 4; s++)
+    rec[1] = rec[1] + x[s]*Ty[s];
+}
+
+// Log-likelihood (excluding the binomial coefficients) of the edited model at the r.f.'s r_c of the window.
+// If acc is not NULL, the expected number of recombinations in each interval (in the same order as r_c)
+// summed over the individuals are returned in acc.
+static double FSwindow_ll(FSwindow *w, double *r_c, double *acc){
+  int ind, s, k;
+  double Tc1[4], Tc2[4], f[4], g[4], h[4], rec[2], L, llval = 0;
+  const double *x, *y;
+  Tc_set(Tc1, r_c[0], r_c[1]);
+  Tc_set(Tc2, r_c[2], r_c[3]);
+  if(acc){
+    for(k = 0; k < 4; k++)
+      acc[k] = 0;
+  }
+  for(ind = 0; ind < w->nTotal; ind++){
+    x = w->x + 4*ind;
+    y = w->y + 4*ind;
+    if(w->Qmid){
+      // forward probabilities at the new SNP (f) and backward probabilities out of it (g)
+      if(w->hasL)
+        Tmult(Tc1, x, f);
+      else
+        memcpy(f, x, 4*sizeof(double));
+      for(s = 0; s < 4; s++)
+        f[s] = f[s] * w->Qmid[4*ind + s];
+      if(w->hasR)
+        Tmult(Tc2, y, g);
+      else
+        memcpy(g, y, 4*sizeof(double));
+      L = 0;
+      for(s = 0; s < 4; s++)
+        L = L + f[s]*g[s];
+      if(acc && w->hasL){
+        for(s = 0; s < 4; s++)
+          h[s] = w->Qmid[4*ind + s] * g[s];
+        FSwindow_rec(Tc1, x, h, rec);
+        acc[0] = acc[0] + rec[0]/L;
+        acc[1] = acc[1] + rec[1]/L;
+      }
+      if(acc && w->hasR){
+        FSwindow_rec(Tc2, f, y, rec);
+        acc[2] = acc[2] + rec[0]/L;
+        acc[3] = acc[3] + rec[1]/L;
+      }
+    }
+    else{
+      if(w->hasL && w->hasR){
+        Tmult(Tc1, y, g);
+        if(acc){
+          FSwindow_rec(Tc1, x, y, rec);
+        }
+      }
+      else
+        memcpy(g, y, 4*sizeof(double));
+      L = 0;
+      for(s = 0; s < 4; s++)
+        L = L + x[s]*g[s];
+      if(acc && w->hasL && w->hasR){
+        acc[0] = acc[0] + rec[0]/L;
+        acc[1] = acc[1] + rec[1]/L;
+      }
+    }
+    llval = llval + log(L) + w->off[ind];
+  }
+  return llval;
+}
+
+// EM algorithm for the r.f.'s of the window (the other r.f.'s and the sequencing error are fixed).
+// r_c contains the starting values on input and the estimates on output. The intervals which are
+// not in the window are ignored. Returns the log-likelihood (excluding the binomial coefficients).
+static double FSwindow_fit(FSwindow *w, double *r_c, int sexSpec, int nIter, double delta){
+  int iter, k;
+  double acc[4], llval = 0, prellval = 0;
+  int present[2];
+  present[0] = w->Qmid ? w->hasL : (w->hasL && w->hasR);
+  present[1] = w->Qmid ? w->hasR : 0;
+  if(!present[0] && !present[1])
+    return FSwindow_ll(w, r_c, NULL);
+  // The EM algorithm for non sex-specific r.f.'s needs to start from equal values
+  if(!sexSpec){
+    for(k = 0; k < 2; k++){
+      r_c[2*k] = 0.5*(r_c[2*k] + r_c[2*k+1]);
+      r_c[2*k+1] = r_c[2*k];
+    }
+  }
+  iter = 0;
+  while( (iter < 2) || ((iter < nIter) & ((llval - prellval) > delta))){
+    iter = iter + 1;
+    prellval = llval;
+    llval = FSwindow_ll(w, r_c, acc);
+    for(k = 0; k < 2; k++){
+      if(!present[k])
+        continue;
+      if(sexSpec){
+        r_c[2*k]   = acc[2*k]/w->nTotal;
+        r_c[2*k+1] = acc[2*k+1]/w->nTotal;
+      }
+      else{
+        r_c[2*k]   = (acc[2*k] + acc[2*k+1])/(2.0*w->nTotal);
+        r_c[2*k+1] = r_c[2*k];
+      }
+    }
+  }
+  return FSwindow_ll(w, r_c, NULL);
+}
+
+#define FS_WINDOW_MAXIT 1000
+#define FS_WINDOW_TOL 1e-10
+
+// r.f. between two SNPs from the r.f.'s r1 and r2 between them and a SNP in between (no interference)
+static inline double rf_combine(double r1, double r2){
+  return r1 + r2 - 2*r1*r2;
+}
+
+// r.f. of the two halves of an interval with r.f. r (the inverse of rf_combine with r1 = r2)
+static inline double rf_split(double r){
+  if(r > 0.5)
+    r = 0.5;
+  return 0.5*(1 - sqrt(1 - 2*r));
+}
+
+// Starting value of the local EM algorithm: r.f.'s of exactly zero are not updated by the EM algorithm.
+static inline double rf_start(double r){
+  return (r < 0.01) ? 0.01 : r;
+}
+
+// Output of the window edits: the r.f.'s of the window (NA for the intervals not in the window) and the log-likelihood
+static SEXP FSwindow_output(FSwindow *w, double *r_c, double llval){
+  int k;
+  int present[2];
+  present[0] = w->Qmid ? w->hasL : (w->hasL && w->hasR);
+  present[1] = w->Qmid ? w->hasR : 0;
+  SEXP rout = PROTECT(allocVector(REALSXP, w->Qmid ? 4 : 2));
+  for(k = 0; k < LENGTH(rout); k++)
+    REAL(rout)[k] = present[k/2] ? r_c[k] : NA_REAL;
+  SEXP pout = PROTECT(allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(pout, 0, rout);
+  SET_VECTOR_ELT(pout, 1, ScalarReal(llval));
+  UNPROTECT(2);
+  return pout;
+}
+
+
+//// R interface
+
+// Create the model from the data and parameter values (as for EM_HMM, with the r.f.'s r = (paternal, maternal))
+SEXP FSmodel_create(SEXP r, SEXP ep, SEXP depth_Ref, SEXP depth_Alt, SEXP OPGP, SEXP noFam, SEXP nInd,
+                    SEXP nSnps, SEXP nThreads){
+  int fam, ind, snp, nTotal, noFam_c, nSnps_c, nThreads_c;
+  noFam_c = INTEGER(noFam)[0];
+  nSnps_c = INTEGER(nSnps)[0];
+  if(nSnps_c < 2)
+    error("The model requires at least two SNPs");
+  if(check_geno(INTEGER(OPGP), (R_xlen_t) noFam_c * nSnps_c, 16))
+    error("Invalid OPGP value");
+  nThreads_c = asInteger(nThreads);
+#ifdef _OPENMP
+  if(nThreads_c > omp_get_num_procs())
+    nThreads_c = omp_get_num_procs();
+#endif
+  if(nThreads_c < 1)
+    nThreads_c = 1;
+  nTotal = 0;
+  for(fam = 0; fam < noFam_c; fam++)
+    nTotal = nTotal + INTEGER(nInd)[fam];
+  // Set up the model
+  FSmodel *m = Calloc(1, FSmodel);
+  // (registered first, so that the model is freed if the read counts are invalid)
+  SEXP model = PROTECT(R_MakeExternalPtr(m, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(model, FSmodel_finalize, TRUE);
+  m->noFam = noFam_c;
+  m->nTotal = nTotal;
+  m->nSnps = nSnps_c;
+  m->nThreads = nThreads_c;
+  m->ep = REAL(ep)[0];
+  m->cap = 0;
+  m->famInd = Calloc(nTotal, int);
+  nTotal = 0;
+  for(fam = 0; fam < noFam_c; fam++){
+    for(ind = 0; ind < INTEGER(nInd)[fam]; ind++)
+      m->famInd[nTotal + ind] = fam;
+    nTotal = nTotal + INTEGER(nInd)[fam];
+  }
+  FSmodel_reserve(m, nSnps_c);
+  memcpy(m->geno, INTEGER(OPGP), (size_t) noFam_c * nSnps_c * sizeof(int));
+  FSmodel_pairs(m, INTEGER(depth_Ref), INTEGER(depth_Alt), (R_xlen_t) nTotal * nSnps_c, m->pair);
+  for(snp = 0; snp < nSnps_c - 1; snp++){
+    m->r_f[snp] = REAL(r)[snp];
+    m->r_m[snp] = REAL(r)[snp + nSnps_c-1];
+  }
+  for(snp = 0; snp < nSnps_c; snp++)
+    m->lbin[snp] = SNP_lbin(INTEGER(depth_Ref) + (size_t) snp*nTotal, INTEGER(depth_Alt) + (size_t) snp*nTotal, nTotal);
+  for(snp = 0; snp < nSnps_c; snp++)
+    m->id[snp] = snp;
+  // Compute the forward and backward probabilities
+  FSmodel_update(m, 0, nSnps_c - 1);
+  UNPROTECT(1);
+  return model;
+}
+
+// The r.f.'s (paternal followed by maternal), sequencing error and log-likelihood of the model and the
+// index of each SNP in the original data (1-based, NA for the SNPs added to the model)
+SEXP FSmodel_info(SEXP model){
+  int snp;
+  FSmodel *m = FSmodel_get(model);
+  SEXP rout = PROTECT(allocVector(REALSXP, 2*(m->nSnps-1)));
+  for(snp = 0; snp < m->nSnps - 1; snp++){
+    REAL(rout)[snp] = m->r_f[snp];
+    REAL(rout)[snp + m->nSnps-1] = m->r_m[snp];
+  }
+  SEXP idout = PROTECT(allocVector(INTSXP, m->nSnps));
+  for(snp = 0; snp < m->nSnps; snp++)
+    INTEGER(idout)[snp] = (m->id[snp] < 0) ? NA_INTEGER : m->id[snp] + 1;
+  SEXP pout = PROTECT(allocVector(VECSXP, 4));
+  SET_VECTOR_ELT(pout, 0, rout);
+  SET_VECTOR_ELT(pout, 1, ScalarReal(m->ep));
+  SET_VECTOR_ELT(pout, 2, ScalarReal(FSmodel_loglik(m)));
+  SET_VECTOR_ELT(pout, 3, idout);
+  UNPROTECT(3);
+  return pout;
+}
+
+// Remove SNP snp (0-based). The r.f. between its neighbours is estimated and the log-likelihood of the
+// model without the SNP is returned. If update is TRUE, the SNP is removed from the model.
+SEXP FSmodel_drop(SEXP model, SEXP snp, SEXP sexSpec, SEXP update){
+  int j, k, nSnps_c, from, to;
+  double r_c[4] = {0, 0, 0, 0}, llval;
+  FSwindow w;
+  FSmodel *m = FSmodel_get(model);
+  j = asInteger(snp);
+  nSnps_c = m->nSnps;
+  if(j == NA_INTEGER || j < 0 || j >= nSnps_c)
+    error("The SNP to be removed is not in the model");
+  if(nSnps_c <= 2)
+    error("The model requires at least two SNPs");
+  FSwindow_setup(m, &w, j-1, j+1, NULL);
+  if(w.hasL && w.hasR){
+    r_c[0] = rf_start(rf_combine(m->r_f[j-1], m->r_f[j]));
+    r_c[1] = rf_start(rf_combine(m->r_m[j-1], m->r_m[j]));
+  }
+  llval = FSwindow_fit(&w, r_c, asLogical(sexSpec), FS_WINDOW_MAXIT, FS_WINDOW_TOL);
+  for(k = 0; k < nSnps_c; k++){
+    if(k != j)
+      llval = llval + m->lbin[k];
+  }
+  if(asLogical(update)){
+    // Remove the interval(s) of the SNP and replace them with the new interval
+    if(j == 0)
+      FSmodel_shift_rf(m, 1, -1);
+    else if(j < nSnps_c - 1){
+      m->r_f[j-1] = r_c[0];
+      m->r_m[j-1] = r_c[1];
+      FSmodel_shift_rf(m, j+1, -1);
+    }
+    FSmodel_shift(m, j+1, -1);
+    m->nSnps = nSnps_c - 1;
+    // The forward probabilities to the left and backward probabilities to the right are unchanged
+    from = j;
+    to = (j == m->nSnps) ? m->nSnps - 1 : j - 1;
+    FSmodel_update(m, from, to);
+  }
+  return FSwindow_output(&w, r_c, llval);
+}
+
+// Add a new SNP at position pos (0-based, i.e., before the current SNP pos) with read counts depth_Ref and
+// depth_Alt (one for each individual) and OPGP (one for each family). The r.f.'s between the new SNP and its
+// neighbours are estimated and the log-likelihood of the model with the new SNP is returned. If update is TRUE,
+// the SNP is added to the model.
+SEXP FSmodel_insert(SEXP model, SEXP pos, SEXP depth_Ref, SEXP depth_Alt, SEXP OPGP, SEXP sexSpec, SEXP update){
+  int p, ind, k, nSnps_c, nTotal;
+  double r_c[4] = {0, 0, 0, 0}, llval, lbin, *Qmid;
+  int *pdepth_Ref, *pdepth_Alt, *pOPGP, *pair;
+  FSwindow w;
+  FSmodel *m = FSmodel_get(model);
+  p = asInteger(pos);
+  nSnps_c = m->nSnps;
+  nTotal = m->nTotal;
+  if(p == NA_INTEGER || p < 0 || p > nSnps_c)
+    error("The position of the new SNP is outside the model");
+  if(XLENGTH(depth_Ref) != nTotal || XLENGTH(depth_Alt) != nTotal)
+    error("The read counts of the new SNP must be given for every individual");
+  if(LENGTH(OPGP) != m->noFam)
+    error("The OPGP of the new SNP must be given for every family");
+  pdepth_Ref = INTEGER(depth_Ref);
+  pdepth_Alt = INTEGER(depth_Alt);
+  pOPGP = INTEGER(OPGP);
+  if(check_geno(pOPGP, m->noFam, 16))
+    error("Invalid OPGP value");
+  // Emission probabilities of the new SNP (the depth pairs which are new are added to the model even when
+  // the SNP is not, which only makes the tables of the pairs larger)
+  pair = (int *) R_alloc(nTotal, sizeof(int));
+  FSmodel_pairs(m, pdepth_Ref, pdepth_Alt, nTotal, pair);
+  Qmid = (double *) R_alloc(4 * (size_t) nTotal, sizeof(double));
+  for(ind = 0; ind < nTotal; ind++)
+    Qcell(m, pOPGP[m->famInd[ind]], pair[ind], Qmid + 4*ind);
+  FSwindow_setup(m, &w, p-1, p, Qmid);
+  // Starting values: split the interval the SNP is added to, or start from 0.01 at the ends
+  if(w.hasL && w.hasR){
+    r_c[0] = r_c[2] = rf_start(rf_split(m->r_f[p-1]));
+    r_c[1] = r_c[3] = rf_start(rf_split(m->r_m[p-1]));
+  }
+  else{
+    for(k = 0; k < 4; k++)
+      r_c[k] = rf_start(0);
+  }
+  llval = FSwindow_fit(&w, r_c, asLogical(sexSpec), FS_WINDOW_MAXIT, FS_WINDOW_TOL);
+  lbin = SNP_lbin(pdepth_Ref, pdepth_Alt, nTotal);
+  llval = llval + lbin;
+  for(k = 0; k < nSnps_c; k++)
+    llval = llval + m->lbin[k];
+  if(asLogical(update)){
+    FSmodel_reserve(m, nSnps_c + 1);
+    // Open a gap for the new SNP and its interval(s)
+    if(p == 0){
+      FSmodel_shift_rf(m, 0, 1);
+      m->r_f[0] = r_c[2];
+      m->r_m[0] = r_c[3];
+    }
+    else if(p == nSnps_c){
+      m->r_f[p-1] = r_c[0];
+      m->r_m[p-1] = r_c[1];
+    }
+    else{
+      FSmodel_shift_rf(m, p, 1);
+      m->r_f[p-1] = r_c[0];
+      m->r_m[p-1] = r_c[1];
+      m->r_f[p] = r_c[2];
+      m->r_m[p] = r_c[3];
+    }
+    FSmodel_shift(m, p, 1);
+    m->nSnps = nSnps_c + 1;
+    memcpy(m->geno + (size_t) p*m->noFam, pOPGP, m->noFam*sizeof(int));
+    memcpy(m->pair + (size_t) p*nTotal, pair, nTotal*sizeof(int));
+    m->lbin[p] = lbin;
+    m->id[p] = -1;
+    // The forward probabilities to the left and backward probabilities to the right are unchanged
+    FSmodel_update(m, p, p);
+  }
+  return FSwindow_output(&w, r_c, llval);
+}
+
+
+//////////// Marker ordering /////////////////////
+// Local search over the order of the SNPs in the model. Each candidate move rearranges the SNPs at
+// positions first:last (the segment):
+//  - reversal: the segment is reversed. The r.f.'s within the segment are kept (in reverse order) and
+//    the r.f.'s between the segment and its neighbours are estimated. A reversal of two SNPs is a swap
+//    of adjacent SNPs and reversals of longer segments are the 2-opt moves for an ordering.
+//  - exchange: the first and last SNPs of the segment are exchanged. The r.f.'s of the four intervals
+//    next to the two SNPs are estimated.
+// As for FSwindow, the log-likelihood of the candidate order only requires the forward probabilities
+// of the SNP before the segment and the backward probabilities of the SNP after it, so each move is
+// scored by computing the recursions over the segment only. The new r.f.'s are estimated by the EM
+// algorithm (with the other r.f.'s and the sequencing error fixed). All candidate moves are scored in
+// parallel and the best move is applied, until no move increases the log-likelihood by more than delta.
+
+#define FS_MOVE_REVERSE 0
+#define FS_MOVE_EXCHANGE 1
+#define FS_MOVE_MAXEST 4      // maximum number of r.f. intervals estimated in a move
+#define FS_MOVE_SCREEN 5      // number of EM iterations used to score the candidate moves
+
+// Set up the segment of a move: the SNPs in the new order (seg), the r.f.'s of the L+1 intervals into
+// (k = 0), within and out of (k = L) the segment (r, paternal and maternal of each interval, with the
+// starting values for the estimated intervals) and which intervals are estimated (est). Interval 0 does
+// not exist when first = 0 and interval L does not exist when last = nSnps-1.
+static int FSmove_segment(FSmodel *m, int type, int first, int last, int *seg, double *r, int *est){
+  int k, L = last - first + 1;
+  for(k = 0; k <= L; k++){
+    est[k] = 0;
+    r[2*k] = r[2*k+1] = 0;
+  }
+  if(type == FS_MOVE_REVERSE){
+    for(k = 0; k < L; k++)
+      seg[k] = last - k;
+    for(k = 1; k < L; k++){
+      r[2*k]   = m->r_f[last-k];
+      r[2*k+1] = m->r_m[last-k];
+    }
+  }
+  else{
+    seg[0] = last;
+    seg[L-1] = first;
+    for(k = 1; k < L-1; k++)
+      seg[k] = first + k;
+    for(k = 2; k < L-1; k++){
+      r[2*k]   = m->r_f[first+k-1];
+      r[2*k+1] = m->r_m[first+k-1];
+    }
+    est[1] = est[L-1] = 1;
+    r[2]   = rf_start(m->r_f[first]);
+    r[3]   = rf_start(m->r_m[first]);
+    r[2*(L-1)]   = rf_start(m->r_f[last-1]);
+    r[2*(L-1)+1] = rf_start(m->r_m[last-1]);
+  }
+  if(first > 0){
+    est[0] = 1;
+    r[0] = rf_start(m->r_f[first-1]);
+    r[1] = rf_start(m->r_m[first-1]);
+  }
+  if(last < m->nSnps - 1){
+    est[L] = 1;
+    r[2*L]   = rf_start(m->r_f[last]);
+    r[2*L+1] = rf_start(m->r_m[last]);
+  }
+  return L;
+}
+
+// Emission probabilities of the SNPs seg for each individual (Q[(ind*(L+1) + k)*4 + s]), which do not
+// depend on the r.f.'s. The emission probabilities of the SNP after the segment times its backward
+// probabilities are stored at k = L (or ones at the end of the map).
+static void FSmove_emission(FSmodel *m, int first, int L, int *seg, double *Q){
+  int ind, k, s, last = first + L - 1;
+  double *Qi;
+  for(ind = 0; ind < m->nTotal; ind++){
+    Qi = Q + 4*(R_xlen_t) ind*(L+1);
+    for(k = 0; k < L; k++)
+      FSmodel_Q(m, seg[k], ind, Qi + 4*k);
+    if(last < m->nSnps - 1){
+      FSmodel_Q(m, last+1, ind, Qi + 4*L);
+      for(s = 0; s < 4; s++)
+        Qi[4*L + s] = Qi[4*L + s] * m->betaTilde[4*((R_xlen_t) (last+1)*m->nTotal + ind) + s];
+    }
+    else{
+      for(s = 0; s < 4; s++)
+        Qi[4*L + s] = 1;
+    }
+  }
+}
+
+// Log-likelihood (excluding the binomial coefficients) of the model with the segment first:(first+L-1)
+// replaced by the SNPs seg and the r.f.'s r (see FSmove_segment), given the emission probabilities Q
+// (see FSmove_emission). If acc is not NULL, the expected number of paternal and maternal recombinations
+// in each of the estimated intervals are returned in acc[2*k] and acc[2*k+1]. work must have space for
+// 4*L values.
+static double FSmove_ll(FSmodel *m, int first, int L, double *Q, double *r, int *est, double *acc, double *work){
+  int ind, k, s, last = first + L - 1, nTotal = m->nTotal;
+  int hasL = (first > 0), hasR = (last < m->nSnps - 1);
+  double *fwd = work, *Qs, *y, Tc[4], v[4], Tv[4], b[4], h[4], rec[2];
+  double sum, Z, logsum, llval = 0;
+  if(acc){
+    for(k = 0; k < 2*(L+1); k++)
+      acc[k] = 0;
+  }
+  for(ind = 0; ind < nTotal; ind++){
+    // Forward recursion over the segment
+    logsum = 0;
+    for(s = 0; s < 4; s++)
+      v[s] = 0.25;
+    if(hasL){
+      memcpy(v, m->alphaTilde + 4*((R_xlen_t) (first-1)*nTotal + ind), 4*sizeof(double));
+      logsum = m->la[(R_xlen_t) (first-1)*nTotal + ind];
+    }
+    Qs = Q + 4*(R_xlen_t) ind*(L+1);
+    y = Qs + 4*L;
+    for(k = 0; k < L; k++){
+      if(k > 0 || hasL){
+        Tc_set(Tc, r[2*k], r[2*k+1]);
+        Tmult(Tc, k > 0 ? fwd + 4*(k-1) : v, Tv);
+      }
+      else
+        memcpy(Tv, v, 4*sizeof(double));
+      sum = 0;
+      for(s = 0; s < 4; s++){
+        fwd[4*k + s] = Tv[s] * Qs[4*k + s];
+        sum = sum + fwd[4*k + s];
+      }
+      for(s = 0; s < 4; s++)
+        fwd[4*k + s] = fwd[4*k + s]/sum;
+      logsum = logsum + log(sum);
+    }
+    // Backward probabilities out of the segment
+    if(hasR){
+      logsum = logsum + m->lb[(R_xlen_t) (last+1)*nTotal + ind];
+      Tc_set(Tc, r[2*L], r[2*L+1]);
+      Tmult(Tc, y, b);
+    }
+    else
+      memcpy(b, y, 4*sizeof(double));
+    Z = 0;
+    for(s = 0; s < 4; s++)
+      Z = Z + fwd[4*(L-1) + s] * b[s];
+    llval = llval + logsum + log(Z);
+    if(!acc)
+      continue;
+    // Backward recursion over the segment and the expected number of recombinations in the estimated
+    // intervals. For interval k, the expected number is rec(x, h)/sum(x * T h), where x is the forward
+    // probability before the interval and h the emission times the backward probability after it.
+    if(est[L]){
+      FSwindow_rec(Tc, fwd + 4*(L-1), y, rec);
+      acc[2*L]   = acc[2*L] + rec[0]/Z;
+      acc[2*L+1] = acc[2*L+1] + rec[1]/Z;
+    }
+    for(k = L-1; k >= 0; k--){
+      // b is the backward probability at position k
+      for(s = 0; s < 4; s++)
+        h[s] = Qs[4*k + s] * b[s];
+      if(k == 0 && !hasL)
+        break;
+      Tc_set(Tc, r[2*k], r[2*k+1]);
+      Tmult(Tc, h, Tv);
+      if(est[k]){
+        const double *x = (k > 0) ? fwd + 4*(k-1) : v;
+        Z = 0;
+        for(s = 0; s < 4; s++)
+          Z = Z + x[s] * Tv[s];
+        FSwindow_rec(Tc, x, h, rec);
+        acc[2*k]   = acc[2*k] + rec[0]/Z;
+        acc[2*k+1] = acc[2*k+1] + rec[1]/Z;
+      }
+      sum = Tv[0] + Tv[1] + Tv[2] + Tv[3];
+      for(s = 0; s < 4; s++)
+        b[s] = Tv[s]/sum;
+    }
+  }
+  return llval;
+}
+
+// Score a move: estimate the r.f.'s of the estimated intervals (see FSwindow_fit) and return the log-likelihood.
+// As the EM algorithm increases the likelihood at each iteration, the log-likelihood after a few iterations
+// is a lower bound for the log-likelihood of the move, which is used to screen the candidate moves.
+static double FSmove_fit(FSmodel *m, int first, int L, int *seg, double *r, int *est, int sexSpec,
+                         int nIter, double delta, double *acc, double *Q, double *work){
+  int iter, k, nEst = 0;
+  double llval = 0, prellval = 0;
+  FSmove_emission(m, first, L, seg, Q);
+  for(k = 0; k <= L; k++){
+    nEst = nEst + est[k];
+    if(est[k] && !sexSpec){
+      r[2*k] = 0.5*(r[2*k] + r[2*k+1]);
+      r[2*k+1] = r[2*k];
+    }
+  }
+  if(nEst == 0)
+    return FSmove_ll(m, first, L, Q, r, est, NULL, work);
+  iter = 0;
+  while( (iter < 2) || ((iter < nIter) & ((llval - prellval) > delta))){
+    iter = iter + 1;
+    prellval = llval;
+    llval = FSmove_ll(m, first, L, Q, r, est, acc, work);
+    for(k = 0; k <= L; k++){
+      if(!est[k])
+        continue;
+      if(sexSpec){
+        r[2*k]   = acc[2*k]/m->nTotal;
+        r[2*k+1] = acc[2*k+1]/m->nTotal;
+      }
+      else{
+        r[2*k]   = (acc[2*k] + acc[2*k+1])/(2.0*m->nTotal);
+        r[2*k+1] = r[2*k];
+      }
+    }
+  }
+  return FSmove_ll(m, first, L, Q, r, est, NULL, work);
+}
+
+// Apply a move with the r.f.'s r (see FSmove_segment) and update the forward and backward probabilities
+static void FSmove_apply(FSmodel *m, int first, int L, int *seg, double *r){
+  int k, nTotal = m->nTotal, noFam = m->noFam, last = first + L - 1;
+  int *geno = (int *) R_alloc((size_t) L * noFam, sizeof(int));
+  int *pair = (int *) R_alloc((size_t) L * nTotal, sizeof(int));
+  int *id = (int *) R_alloc(L, sizeof(int));
+  double *lbin = (double *) R_alloc(L, sizeof(double));
+  for(k = 0; k < L; k++){
+    memcpy(geno + (size_t) k*noFam, m->geno + (size_t) seg[k]*noFam, noFam*sizeof(int));
+    memcpy(pair + (size_t) k*nTotal, m->pair + (size_t) seg[k]*nTotal, nTotal*sizeof(int));
+    id[k] = m->id[seg[k]];
+    lbin[k] = m->lbin[seg[k]];
+  }
+  memcpy(m->geno + (size_t) first*noFam, geno, (size_t) L*noFam*sizeof(int));
+  memcpy(m->pair + (size_t) first*nTotal, pair, (size_t) L*nTotal*sizeof(int));
+  memcpy(m->id + first, id, L*sizeof(int));
+  memcpy(m->lbin + first, lbin, L*sizeof(double));
+  for(k = 0; k <= L; k++){
+    if((k == 0 && first == 0) || (k == L && last == m->nSnps - 1))
+      continue;
+    m->r_f[first-1+k] = r[2*k];
+    m->r_m[first-1+k] = r[2*k+1];
+  }
+  FSmodel_update(m, first, last);
+}
+
+// Order the SNPs in the model by local search.
+// para = (maxBlock, window, maxit, delta): reversals of up to maxBlock SNPs and exchanges of SNPs up to
+// window positions apart are considered, for at most maxit moves, while the best move increases the
+// log-likelihood by more than delta. The model is updated in place.
+// Returns the index of each SNP in the original data (as in FSmodel_info), the log-likelihood and the
+// number of moves made.
+SEXP FSmodel_order(SEXP model, SEXP para, SEXP sexSpec){
+  int k, c, nCand, best, nMoves, maxBlock, window, maxit, Lmax, first, L, sexSpec_c;
+  double delta, llcur, *candll, *candr;
+  int *candType, *candFirst, *candLast;
+  FSmodel *m = FSmodel_get(model);
+  int nSnps_c = m->nSnps, nThreads = m->nThreads;
+  maxBlock = (int) REAL(para)[0];
+  window = (int) REAL(para)[1];
+  maxit = (int) REAL(para)[2];
+  delta = REAL(para)[3];
+  sexSpec_c = asLogical(sexSpec);
+  if(maxBlock > nSnps_c)
+    maxBlock = nSnps_c;
+  if(window > nSnps_c - 1)
+    window = nSnps_c - 1;
+  // Candidate moves
+  nCand = 0;
+  for(first = 0; first < nSnps_c - 1; first++){
+    for(L = 2; L <= maxBlock && first + L <= nSnps_c; L++)
+      nCand++;
+    for(L = 3; L <= window + 1 && first + L <= nSnps_c; L++)
+      nCand++;
+  }
+  candType  = (int *) R_alloc(nCand + 1, sizeof(int));
+  candFirst = (int *) R_alloc(nCand + 1, sizeof(int));
+  candLast  = (int *) R_alloc(nCand + 1, sizeof(int));
+  candll    = (double *) R_alloc(nCand + 1, sizeof(double));
+  candr     = (double *) R_alloc(2 * FS_MOVE_MAXEST * (size_t) (nCand + 1), sizeof(double));
+  nCand = 0;
+  for(first = 0; first < nSnps_c - 1; first++){
+    for(L = 2; L <= maxBlock && first + L <= nSnps_c; L++){
+      if(first == 0 && L == nSnps_c)   // reversing the whole map does not change the likelihood
+        continue;
+      candType[nCand] = FS_MOVE_REVERSE;
+      candFirst[nCand] = first;
+      candLast[nCand] = first + L - 1;
+      nCand++;
+    }
+    for(L = 3; L <= window + 1 && first + L <= nSnps_c; L++){
+      candType[nCand] = FS_MOVE_EXCHANGE;
+      candFirst[nCand] = first;
+      candLast[nCand] = first + L - 1;
+      nCand++;
+    }
+  }
+  Lmax = (maxBlock > window + 1) ? maxBlock : window + 1;
+  // Working arrays of each thread: seg, est (ints) and r, acc, work, Q (doubles)
+#ifdef _OPENMP
+  if(nThreads > nCand)
+    nThreads = (nCand > 0) ? nCand : 1;
+#endif
+  int *iwork = (int *) R_alloc(2 * (size_t) (Lmax + 1) * nThreads, sizeof(int));
+  size_t nWork = 8 * (size_t) (Lmax + 1) + 4 * (size_t) (Lmax + 1) * m->nTotal;
+  double *dwork = (double *) R_alloc(nWork * nThreads, sizeof(double));
+  int *seg0 = (int *) R_alloc(Lmax + 1, sizeof(int)), *est0 = (int *) R_alloc(Lmax + 1, sizeof(int));
+  double *r0 = (double *) R_alloc(2 * (size_t) (Lmax + 1), sizeof(double));
+  llcur = FSmodel_loglik(m);
+  for(k = 0; k < nSnps_c; k++)
+    llcur = llcur - m->lbin[k];
+  nMoves = 0;
+  while(nMoves < maxit && nCand > 0){
+    // Score all the candidate moves
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(nThreads) schedule(dynamic, 1)
+#endif
+    for(c = 0; c < nCand; c++){
+      int thread = 0, j, n, Lc;
+#ifdef _OPENMP
+      thread = omp_get_thread_num();
+#endif
+      int *seg = iwork + 2 * (size_t) (Lmax + 1) * thread, *est = seg + Lmax + 1;
+      double *r = dwork + nWork * thread, *acc = r + 2*(Lmax + 1), *work = acc + 2*(Lmax + 1), *Q = work + 4*(Lmax + 1);
+      Lc = FSmove_segment(m, candType[c], candFirst[c], candLast[c], seg, r, est);
+      candll[c] = FSmove_fit(m, candFirst[c], Lc, seg, r, est, sexSpec_c, FS_MOVE_SCREEN, 0, acc, Q, work);
+      n = 0;
+      for(j = 0; j <= Lc; j++){
+        if(est[j]){
+          candr[2*(FS_MOVE_MAXEST*(size_t) c + n)]     = r[2*j];
+          candr[2*(FS_MOVE_MAXEST*(size_t) c + n) + 1] = r[2*j+1];
+          n++;
+        }
+      }
+    }
+    // The best move (the first one in the case of ties, so that the result does not depend on the threads)
+    best = 0;
+    for(c = 1; c < nCand; c++){
+      if(candll[c] > candll[best])
+        best = c;
+    }
+    if(!(candll[best] - llcur > delta))
+      break;
+    // Fit the r.f.'s of the best move until convergence and apply it
+    L = FSmove_segment(m, candType[best], candFirst[best], candLast[best], seg0, r0, est0);
+    k = 0;
+    for(c = 0; c <= L; c++){
+      if(est0[c]){
+        r0[2*c]   = candr[2*(FS_MOVE_MAXEST*(size_t) best + k)];
+        r0[2*c+1] = candr[2*(FS_MOVE_MAXEST*(size_t) best + k) + 1];
+        k++;
+      }
+    }
+    llcur = FSmove_fit(m, candFirst[best], L, seg0, r0, est0, sexSpec_c, FS_WINDOW_MAXIT, FS_WINDOW_TOL,
+                       dwork + 2*(Lmax + 1), dwork + 8*(Lmax + 1), dwork + 4*(Lmax + 1));
+    FSmove_apply(m, candFirst[best], L, seg0, r0);
+    nMoves++;
+    R_CheckUserInterrupt();
+  }
+  SEXP info = PROTECT(FSmodel_info(model));
+  SEXP pout = PROTECT(allocVector(VECSXP, 3));
+  SET_VECTOR_ELT(pout, 0, VECTOR_ELT(info, 3));
+  SET_VECTOR_ELT(pout, 1, VECTOR_ELT(info, 2));
+  SET_VECTOR_ELT(pout, 2, ScalarInteger(nMoves));
+  UNPROTECT(2);
+  return pout;
+}
@@ -1,138 +1,169 @@
-
-#include <math.h>
-#include "probFun.h"
-
-
-// Function for extracting entries of the emission probability matrix
-// when the OPGPs are known
-double Qentry(int OPGP,double Kaa,double Kab, double Kbb,int elem){
-  switch(OPGP){
-  case 1:
-    if(elem == 1)
-      return Kbb;
-    else if ((elem == 2)|(elem == 3))  
-      return Kab;
-    else if (elem == 4)
-      return Kaa;
-  case 2:
-    if(elem == 3)
-      return Kbb;
-    else if ((elem == 1)|(elem == 4))
-      return Kab;
-    else if (elem == 2)
-      return Kaa;
-  case 3:
-    if(elem == 2) 
-      return Kbb;
-    else if ((elem == 1)|(elem == 4))
-      return Kab;
-    else if (elem == 3)
-      return Kaa;
-  case 4:
-    if(elem == 4) 
-      return Kbb;
-    else if ((elem == 2)|(elem == 3))
-      return Kab;
-    else if (elem == 1)
-      return Kaa;
-  case 5:
-    if ((elem == 1)|(elem == 2))
-      return Kab;
-    else if ((elem == 3)|(elem == 4))
-      return Kaa;
-  case 6:
-    if ((elem == 1)|(elem == 2))
-      return Kaa;
-    else if ((elem == 3)|(elem == 4))
-      return Kab;
-  case 7:
-    if ((elem == 1)|(elem == 2))
-      return Kbb;
-    else if ((elem == 3)|(elem == 4))
-      return Kab;
-  case 8:
-    if ((elem == 1)|(elem == 2))
-      return Kab;
-    else if ((elem == 3)|(elem == 4))
-      return Kbb;
-  case 9:
-    if ((elem == 1)|(elem == 3))
-      return Kab;
-    else if ((elem == 2)|(elem == 4))
-      return Kaa;
-  case 10:
-    if ((elem == 1)|(elem == 3))
-      return Kaa;
-    else if ((elem == 2)|(elem == 4))
-      return Kab;
-  case 11:
-    if ((elem == 1)|(elem == 3))
-      return Kbb;
-    else if ((elem == 2)|(elem == 4))
-      return Kab;
-  case 12:
-    if ((elem == 1)|(elem == 3))
-      return Kab;
-    else if ((elem == 2)|(elem == 4))
-      return Kbb;
-  case 13:
-    return Kaa;
-  case 14:
-    return Kab;
-  case 15:
-    return Kab;
-  case 16:
-    return Kbb;
-  } // end of Switch
-  return -1;
-}
-
-
-// Function for extracting entries of the emission probability matrix
-// when the OPGP are considered the baseline (and so phase is unknown and the r.f's are sex-specific)
-double Qentry_up(int config,double Kaa,double Kab, double Kbb,int elem){
-  switch(config){
-  case 1:
-    if(elem == 1)
-      return Kbb;
-    else if ((elem == 2)|(elem == 3))  
-      return Kab;
-    else if (elem == 4)
-      return Kaa;
-  case 2:
-    if ((elem == 1)|(elem == 2))
-      return Kab;
-    else if ((elem == 3)|(elem == 4))
-      return Kaa;
-  case 3:
-    if ((elem == 1)|(elem == 2))
-      return Kbb;
-    else if ((elem == 3)|(elem == 4))
-      return Kab;
-  case 4:
-    if ((elem == 1)|(elem == 3))
-      return Kab;
-    else if ((elem == 2)|(elem == 4))
-      return Kaa;
-  case 5:
-    if ((elem == 1)|(elem == 3))
-      return Kbb;
-    else if ((elem == 2)|(elem == 4))
-      return Kab;
-  } // end of Switch
-  return -1;
-}
-
-// Function for returning a specified enetry of the transition matrix for a given recombination fraction value
-// when the r.f.'s are sex-specific 
-double Tmat_ss(int s1, int s2, double r_f, double r_m){
-  int sSum = s1 + s2*4;
-  if((sSum == 0)|(sSum == 5)|(sSum == 10)|(sSum == 15))
-    return (1-r_f)*(1-r_m);
-  else if((sSum == 3)|(sSum == 6)|(sSum == 9)|(sSum == 12))
-    return r_f*r_m;
-  else if((sSum == 1)|(sSum == 4)|(sSum == 11)|(sSum == 14))
-    return (1-r_f)*r_m;
-  else 
-    return r_f*(1-r_m);
-}
+
+#include <R.h>
+#include <Rinternals.h>
+#include <math.h>
+#include "probFun.h"
+
+
+// Tables of the genotype of each state (s = 2*(paternal) + (maternal)) for each OPGP and each
+// segregation type (config), where the genotypes are coded as 0 = AB, 1 = AA and 2 = BB.
+// These give the entries of the emission probability matrix (see Qvec in probFun.h).
+
+// when the OPGPs are known
+const int geno_OPGP[16][4] = {
+  {2,0,0,1}, {0,1,2,0}, {0,2,1,0}, {1,0,0,2},   // both parents informative
+  {0,0,1,1}, {1,1,0,0}, {2,2,0,0}, {0,0,2,2},   // paternal informative
+  {0,1,0,1}, {1,0,1,0}, {2,0,2,0}, {0,2,0,2},   // maternal informative
+  {1,1,1,1}, {0,0,0,0}, {0,0,0,0}, {2,2,2,2}    // uninformative
+};
+
+// when the OPGP are considered the baseline (and so phase is unknown and the r.f's are sex-specific)
+const int geno_config[5][4] = {
+  {2,0,0,1}, {0,0,1,1}, {2,2,0,0}, {0,1,0,1}, {2,0,2,0}
+};
+
+// Function for checking that all the OPGP (or config) values are valid indices of the table.
+// Returns the first invalid value or zero if they are all valid.
+int check_geno(int *pgeno, R_xlen_t n, int nmax){
+  R_xlen_t i;
+  for(i = 0; i < n; i++){
+    if( (pgeno[i] < 1) | (pgeno[i] > nmax) )
+      return (pgeno[i] == 0) ? -1 : pgeno[i];
+  }
+  return 0;
+}
+
+// Function for mapping each cell of the depth matrices to the index of its (depth_Ref, depth_Alt) pair
+// among the unique pairs in the data, so that the emission probabilities only need to be computed once
+// for each pair. The pair indices of the cells are stored in pindx and the depths of each pair in
+// *pairRef and *pairAlt (allocated here). Returns the number of unique pairs.
+// Also checks that the depths are non-negative and returns the largest depth in maxDepth.
+// The pairs are found with an open addressing hash table which starts small and is doubled (and the
+// pairs rehashed) whenever it is half full, so the memory used only depends on the number of unique pairs.
+int depth_pairs(int *depth_Ref, int *depth_Alt, R_xlen_t nCells, int *pindx,
+                int **pairRef, int **pairAlt, int *maxDepth){
+  R_xlen_t cell;
+  int a, b, k, nPairs = 0;
+  size_t h, mask, size = 64;
+  *maxDepth = 0;
+  for(cell = 0; cell < nCells; cell++){
+    if( (depth_Ref[cell] < 0) | (depth_Alt[cell] < 0) )
+      error("Read depths must be non-negative");
+    if(depth_Ref[cell] > *maxDepth)
+      *maxDepth = depth_Ref[cell];
+    if(depth_Alt[cell] > *maxDepth)
+      *maxDepth = depth_Alt[cell];
+  }
+  // Hash table of the pairs seen so far (0 = empty, otherwise the pair index + 1)
+  mask = size - 1;
+  int *table = Calloc(size, int);
+  int *ref = Calloc(size/2, int);
+  int *alt = Calloc(size/2, int);
+  for(cell = 0; cell < nCells; cell++){
+    a = depth_Ref[cell];
+    b = depth_Alt[cell];
+    h = ((size_t) a * 2654435761u + (size_t) b * 40503u) & mask;
+    while( (table[h] != 0) && !((ref[table[h]-1] == a) & (alt[table[h]-1] == b)) )
+      h = (h + 1) & mask;
+    if(table[h] == 0){
+      if((size_t) nPairs == size/2){
+        // Double the table and rehash the pairs
+        size = 2*size;
+        mask = size - 1;
+        Free(table);
+        table = Calloc(size, int);
+        ref = Realloc(ref, size/2, int);
+        alt = Realloc(alt, size/2, int);
+        for(k = 0; k < nPairs; k++){
+          h = ((size_t) ref[k] * 2654435761u + (size_t) alt[k] * 40503u) & mask;
+          while(table[h] != 0)
+            h = (h + 1) & mask;
+          table[h] = k + 1;
+        }
+        h = ((size_t) a * 2654435761u + (size_t) b * 40503u) & mask;
+        while(table[h] != 0)
+          h = (h + 1) & mask;
+      }
+      ref[nPairs] = a;
+      alt[nPairs] = b;
+      nPairs++;
+      table[h] = nPairs;
+    }
+    pindx[cell] = table[h] - 1;
+  }
+  *pairRef = (int *) R_alloc(nPairs > 0 ? nPairs : 1, sizeof(int));
+  *pairAlt = (int *) R_alloc(nPairs > 0 ? nPairs : 1, sizeof(int));
+  for(k = 0; k < nPairs; k++){
+    (*pairRef)[k] = ref[k];
+    (*pairAlt)[k] = alt[k];
+  }
+  Free(table);
+  Free(ref);
+  Free(alt);
+  return nPairs;
+}
+
+// Version of depth_pairs for sparse depth matrices with nRow rows (individuals) and nCol columns (SNPs),
+// stored by row: the nonzero cells of row i are ptr[i],...,ptr[i+1]-1, with the columns in col and the
+// depths in depth_Ref and depth_Alt. The pair indices are only stored for these cells (pindx[k] for the
+// k-th cell), while the cells which are not stored share the pair (0,0), whose index is returned in zero.
+int depth_pairs_sparse(int *ptr, int *col, int *depth_Ref, int *depth_Alt, int nRow, int nCol, int *pindx,
+                       int **pairRef, int **pairAlt, int *maxDepth, int *zero){
+  int ind, k, nPairs, *ref, *alt;
+  if(ptr[0] != 0)
+    error("Invalid sparse read count matrix");
+  for(ind = 0; ind < nRow; ind++){
+    if(ptr[ind+1] < ptr[ind])
+      error("Invalid sparse read count matrix");
+    for(k = ptr[ind]; k < ptr[ind+1]; k++){
+      if( (col[k] < 0) | (col[k] >= nCol) )
+        error("Invalid sparse read count matrix");
+    }
+  }
+  nPairs = depth_pairs(depth_Ref, depth_Alt, ptr[nRow], pindx, &ref, &alt, maxDepth);
+  // Add the pair (0,0) of the cells which are not stored (unless it is already there)
+  for(*zero = 0; *zero < nPairs && (ref[*zero] != 0 || alt[*zero] != 0); (*zero)++)
+    ;
+  *pairRef = (int *) R_alloc((size_t) nPairs + 1, sizeof(int));
+  *pairAlt = (int *) R_alloc((size_t) nPairs + 1, sizeof(int));
+  for(k = 0; k < nPairs; k++){
+    (*pairRef)[k] = ref[k];
+    (*pairAlt)[k] = alt[k];
+  }
+  if(*zero == nPairs){
+    (*pairRef)[nPairs] = 0;
+    (*pairAlt)[nPairs] = 0;
+    nPairs++;
+  }
+  return nPairs;
+}
+
+// Function for computing the emission probabilities given the true genotypes
+// pAA and pBB are computed for each of the nPairs unique (depth_Ref, depth_Alt) pairs (see depth_pairs).
+// The powers of (1-epsilon) and epsilon are looked up from tables of the depths 0,...,maxDepth
+// (powTab must have room for 2*(maxDepth+1) values) rather than computed for each pair.
+void computeProb(double *ppAA, double *ppBB, double epsilon, int *pdepth_Ref, int *pdepth_Alt,
+                 int nPairs, int maxDepth, double *powTab){
+  int d, indx;
+  double *pow1 = powTab, *powE = powTab + maxDepth + 1;
+  for(d = 0; d <= maxDepth; d++){
+    pow1[d] = pow(1 - epsilon, d);
+    powE[d] = pow(epsilon, d);
+  }
+  for(indx = 0; indx < nPairs; indx++){
+    ppAA[indx] = pow1[pdepth_Ref[indx]] * powE[pdepth_Alt[indx]];
+    ppBB[indx] = powE[pdepth_Ref[indx]] * pow1[pdepth_Alt[indx]];
+  }
+}
+
+// Function for computing the transition matrix cache for each interval (see probFun.h)
+// when the r.f.'s are sex-specific (r_f and r_m are the same vector when they are not)
+void Tmat_cache(double *Tc, double *r_f, double *r_m, int nInt){
+  int snp;
+  for(snp = 0; snp < nInt; snp++){
+    Tc[4*snp]     = 1 - r_f[snp];
+    Tc[4*snp + 1] = r_f[snp];
+    Tc[4*snp + 2] = 1 - r_m[snp];
+    Tc[4*snp + 3] = r_m[snp];
+  }
+}
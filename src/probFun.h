@@ -1,25 +1,226 @@
-/*
-##########################################################################
-# Genotyping Uncertainty with Sequencing data and linkage MAPping (GUSMap)
-# Copyright 2017 Timothy P. Bilton <tbilton@maths.otago.ac.nz>
-#
-# This program is free software: you can redistribute it and/or modify
-# it under the terms of the GNU General Public License as published by
-# the Free Software Foundation, either version 3 of the License, or
-# (at your option) any later version.
-#
-# This program is distributed in the hope that it will be useful,
-# but WITHOUT ANY WARRANTY; without even the implied warranty of
-# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-# GNU General Public License for more details.
-# 
-# You should have received a copy of the GNU General Public License
-# along with this program.  If not, see <http://www.gnu.org/licenses/>.
-#########################################################################
-*/
-
-
-double Qentry(int OPGP,double Kaa,double Kab, double Kbb,int elem);
-double Qentry_up(int config,double Kaa,double Kab, double Kbb,int elem);
-double Tmat_ss(int s1, int s2, double r_f, double r_m);
-
+/*
+##########################################################################
+# Genotyping Uncertainty with Sequencing data and linkage MAPping (GUSMap)
+# Copyright 2017 Timothy P. Bilton <tbilton@maths.otago.ac.nz>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+# 
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#########################################################################
+*/
+
+
+extern const int geno_OPGP[16][4];
+extern const int geno_config[5][4];
+int check_geno(int *pgeno, R_xlen_t n, int nmax);
+void Tmat_cache(double *Tc, double *r_f, double *r_m, int nInt);
+int depth_pairs(int *depth_Ref, int *depth_Alt, R_xlen_t nCells, int *pindx,
+                int **pairRef, int **pairAlt, int *maxDepth);
+int depth_pairs_sparse(int *ptr, int *col, int *depth_Ref, int *depth_Alt, int nRow, int nCol, int *pindx,
+                       int **pairRef, int **pairAlt, int *maxDepth, int *zero);
+void computeProb(double *ppAA, double *ppBB, double epsilon, int *pdepth_Ref, int *pdepth_Alt,
+                 int nPairs, int maxDepth, double *powTab);
+
+// Gather the emission probabilities of the four states in one go,
+// where geno is the row of geno_OPGP (or geno_config) for the OPGP (or config) of the SNP.
+static inline void Qvec(const int *geno, double Kaa, double Kab, double Kbb, double *Q){
+  const double K[3] = {Kab, Kaa, Kbb};
+  Q[0] = K[geno[0]];
+  Q[1] = K[geno[1]];
+  Q[2] = K[geno[2]];
+  Q[3] = K[geno[3]];
+}
+
+// The transition matrix between the states s = 2*(paternal) + (maternal) is the Kronecker product
+// of the paternal matrix [1-r_f, r_f; r_f, 1-r_f] and the maternal matrix [1-r_m, r_m; r_m, 1-r_m].
+// For each interval, the cache Tc holds (1-r_f, r_f, 1-r_m, r_m) (see Tmat_cache) and the
+// product of the transition matrix with a vector is computed by applying the two 2x2 factors in turn.
+// Note: the transition matrix is symmetric so these are used in both the forward and backward recursions.
+
+// Apply the maternal factor: out = (I x M) in
+static inline void Tmult_mat(const double *Tc, const double *in, double *out){
+  out[0] = Tc[2]*in[0] + Tc[3]*in[1];
+  out[1] = Tc[3]*in[0] + Tc[2]*in[1];
+  out[2] = Tc[2]*in[2] + Tc[3]*in[3];
+  out[3] = Tc[3]*in[2] + Tc[2]*in[3];
+}
+
+// Apply the paternal factor: out = (P x I) in
+static inline void Tmult_pat(const double *Tc, const double *in, double *out){
+  out[0] = Tc[0]*in[0] + Tc[1]*in[2];
+  out[1] = Tc[0]*in[1] + Tc[1]*in[3];
+  out[2] = Tc[1]*in[0] + Tc[0]*in[2];
+  out[3] = Tc[1]*in[1] + Tc[0]*in[3];
+}
+
+// Apply the full transition matrix: out = (P x M) in
+static inline void Tmult(const double *Tc, const double *in, double *out){
+  double tmp[4];
+  Tmult_mat(Tc, in, tmp);
+  Tmult_pat(Tc, tmp, out);
+}
+
+
+//// Lane kernels
+// At each SNP, the individuals of a family share the OPGP (or config) and the transition matrix,
+// so the recursions of NLANE individuals are computed together with the individual as the
+// innermost index (i.e., x[s*NLANE + l] for state s of lane l). The loops over the lanes have a
+// fixed length and are vectorized by the compiler. When there are fewer than NLANE individuals
+// left in a family, the unused lanes repeat the last individual and are ignored in the output.
+#define NLANE 8
+
+// Where supported (GCC or clang on x86-64 Linux), the lane kernels are compiled for AVX-512,
+// AVX2 and the baseline instruction set, and the version used is chosen at run time from the CPU.
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define LANE_KERNEL __attribute__((target_clones("avx512f", "avx2", "default")))
+#endif
+#endif
+#ifndef LANE_KERNEL
+#define LANE_KERNEL
+#endif
+
+// Load the values of nl consecutive individuals into the lanes of dst
+static inline void lane_load(const double *src, int nl, double *dst){
+  int l;
+  if(nl == NLANE){
+    for(l = 0; l < NLANE; l++)
+      dst[l] = src[l];
+  }
+  else{
+    for(l = 0; l < NLANE; l++)
+      dst[l] = src[l < nl ? l : nl - 1];
+  }
+}
+
+// Load the values tab[pindx[l]] of nl consecutive individuals into the lanes of dst
+// (used when the values are stored for each unique depth pair, see depth_pairs)
+static inline void lane_gather(const double *tab, const int *pindx, int nl, double *dst){
+  int l;
+  if(nl == NLANE){
+    for(l = 0; l < NLANE; l++)
+      dst[l] = tab[pindx[l]];
+  }
+  else{
+    for(l = 0; l < NLANE; l++)
+      dst[l] = tab[pindx[l < nl ? l : nl - 1]];
+  }
+}
+
+// Emission probabilities of the four states for the lanes (the lane version of Qvec).
+// As all the lanes share the same genotype table row, Q[s] simply points to the lanes of Kaa, Kab or Kbb.
+static inline void Qlanes(const int *geno, const double *Kaa, const double *Kab, const double *Kbb, const double **Q){
+  const double *K[3] = {Kab, Kaa, Kbb};
+  Q[0] = K[geno[0]];
+  Q[1] = K[geno[1]];
+  Q[2] = K[geno[2]];
+  Q[3] = K[geno[3]];
+}
+
+// Lane versions of Tmult_mat, Tmult_pat and Tmult
+static inline void Tmult_mat_lanes(const double *Tc, const double *in, double *out){
+  int l;
+  for(l = 0; l < NLANE; l++){
+    out[l]           = Tc[2]*in[l]           + Tc[3]*in[NLANE + l];
+    out[NLANE + l]   = Tc[3]*in[l]           + Tc[2]*in[NLANE + l];
+    out[2*NLANE + l] = Tc[2]*in[2*NLANE + l] + Tc[3]*in[3*NLANE + l];
+    out[3*NLANE + l] = Tc[3]*in[2*NLANE + l] + Tc[2]*in[3*NLANE + l];
+  }
+}
+
+static inline void Tmult_pat_lanes(const double *Tc, const double *in, double *out){
+  int l;
+  for(l = 0; l < NLANE; l++){
+    out[l]           = Tc[0]*in[l]         + Tc[1]*in[2*NLANE + l];
+    out[NLANE + l]   = Tc[0]*in[NLANE + l] + Tc[1]*in[3*NLANE + l];
+    out[2*NLANE + l] = Tc[1]*in[l]         + Tc[0]*in[2*NLANE + l];
+    out[3*NLANE + l] = Tc[1]*in[NLANE + l] + Tc[0]*in[3*NLANE + l];
+  }
+}
+
+static inline void Tmult_lanes(const double *Tc, const double *in, double *out){
+  double tmp[4*NLANE];
+  Tmult_mat_lanes(Tc, in, tmp);
+  Tmult_pat_lanes(Tc, tmp, out);
+}
+
+// Convert the four states of the lanes to and from single precision
+// (used to store the scaled forward probabilities in single precision, see EM_lanes in 'em.c')
+static inline void lanes_to_float(const double *in, float *out){
+  int l;
+  for(l = 0; l < 4*NLANE; l++)
+    out[l] = (float) in[l];
+}
+
+static inline void lanes_from_float(const float *in, double *out){
+  int l;
+  for(l = 0; l < 4*NLANE; l++)
+    out[l] = in[l];
+}
+
+//// Gaps of missing data
+// A SNP with no reads has an emission probability of one for every state, so the recursions only need
+// the SNPs with reads of each individual and the transition matrix over each gap between two of these.
+// The product of the 2x2 factors [1-r_i, r_i; r_i, 1-r_i] of the intervals of a gap is a factor of the
+// same form with 1 - 2r = prod(1 - 2r_i), so the transition matrix of the gap from SNP a to SNP b (a <= b)
+// is given in the form of Tmat_cache by Tgap. An empty gap (a = b) gives the identity.
+static inline void Tgap(const double *Tc, int a, int b, double *T){
+  int i;
+  double df = 1, dm = 1;
+  if(b == a + 1){
+    T[0] = Tc[4*a];
+    T[1] = Tc[4*a + 1];
+    T[2] = Tc[4*a + 2];
+    T[3] = Tc[4*a + 3];
+    return;
+  }
+  for(i = a; i < b; i++){
+    df = df * (Tc[4*i] - Tc[4*i + 1]);
+    dm = dm * (Tc[4*i + 2] - Tc[4*i + 3]);
+  }
+  T[0] = (1 + df)/2;
+  T[1] = (1 - df)/2;
+  T[2] = (1 + dm)/2;
+  T[3] = (1 - dm)/2;
+}
+
+// A group of lanes only steps through the SNPs with reads (see EM_lanes_sparse in 'em.c' and ll_lanes_sparse
+// in 'likelihoods.c') when none of its individuals have reads at more than this fraction of the SNPs.
+#define EM_SPARSE 0.3
+
+// Lane versions of Tmult_mat, Tmult_pat and Tmult where each lane has its own transition matrix,
+// given by Tl[k*NLANE + l] for the k-th element of the cache of lane l (see Tgap).
+static inline void Tmult_mat_lanes_var(const double *Tl, const double *in, double *out){
+  int l;
+  for(l = 0; l < NLANE; l++){
+    out[l]           = Tl[2*NLANE + l]*in[l]           + Tl[3*NLANE + l]*in[NLANE + l];
+    out[NLANE + l]   = Tl[3*NLANE + l]*in[l]           + Tl[2*NLANE + l]*in[NLANE + l];
+    out[2*NLANE + l] = Tl[2*NLANE + l]*in[2*NLANE + l] + Tl[3*NLANE + l]*in[3*NLANE + l];
+    out[3*NLANE + l] = Tl[3*NLANE + l]*in[2*NLANE + l] + Tl[2*NLANE + l]*in[3*NLANE + l];
+  }
+}
+
+static inline void Tmult_pat_lanes_var(const double *Tl, const double *in, double *out){
+  int l;
+  for(l = 0; l < NLANE; l++){
+    out[l]           = Tl[l]*in[l]                 + Tl[NLANE + l]*in[2*NLANE + l];
+    out[NLANE + l]   = Tl[l]*in[NLANE + l]         + Tl[NLANE + l]*in[3*NLANE + l];
+    out[2*NLANE + l] = Tl[NLANE + l]*in[l]         + Tl[l]*in[2*NLANE + l];
+    out[3*NLANE + l] = Tl[NLANE + l]*in[NLANE + l] + Tl[l]*in[3*NLANE + l];
+  }
+}
+
+static inline void Tmult_lanes_var(const double *Tl, const double *in, double *out){
+  double tmp[4*NLANE];
+  Tmult_mat_lanes_var(Tl, in, tmp);
+  Tmult_pat_lanes_var(Tl, tmp, out);
+}
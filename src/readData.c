@@ -0,0 +1,1029 @@
+/*
+##########################################################################
+# Genotyping Uncertainty with Sequencing data and linkage MAPping (GUSMap)
+# Copyright 2017-2018 Timothy P. Bilton <tbilton@maths.otago.ac.nz>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#########################################################################
+*/
+
+#include <R.h>
+#include <Rinternals.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <process.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+
+//////////// Reading of the sequencing data files into read count matrices /////////////////////
+// The files (plain text or gzip compressed) are streamed through a buffer of whole lines. Each
+// time the buffer is filled, its lines are parsed in parallel: line k of the chunk writes the read
+// counts of SNP k of the chunk directly into a block of read count matrices, which are stored by
+// SNP as in R (individuals x SNPs), and the skipped lines are then removed in order. The blocks are
+// only copied into the R matrices at the end (and freed one at a time), so the read counts are never
+// held in more than one full copy plus one of the two R matrices.
+
+#define READ_CHUNK (1 << 25)    // initial size of the buffer (32MB), which grows for longer lines
+
+enum { FILE_VCF, FILE_RA, FILE_UNEAK };
+
+// Errors found when parsing a line (in parallel, so reported after the chunk is parsed)
+enum { LINE_OK, LINE_SKIP, LINE_SHORT, LINE_POS, LINE_FORMAT, LINE_DEPTH };
+
+static const char *lineError[] = {"", "", "the line has fewer fields than the header",
+                                  "invalid position", "no allelic depth (AD, RO and AO, or DP4) field",
+                                  "invalid read count"};
+
+typedef struct {
+  gzFile fp;
+  char *buf;                // lines buf[pos], ..., buf[len-1] have not been used
+  size_t size, len, pos;
+  int eof;
+  char **line;              // start of the lines of the current chunk
+  int *status;              // LINE_OK, LINE_SKIP or the error of each line
+  int nLine, maxLine;
+  long lineNo;              // number of lines before the current chunk
+} TextFile;
+
+// Read count matrices, in blocks of SNPs (nSamp x blockLen[b] for block b), and SNP information
+typedef struct {
+  int nSamp, nSnps, maxSnps;
+  int *ref, *alt;                    // block of the current chunk, which starts at SNP blockStart
+  int **blockRef, **blockAlt, *blockLen, nBlock, maxBlock, blockStart;
+  int *pos, *chromRun;               // chromRun: first SNP of each run of SNPs on the same chromosome
+  char *chrom;                       // names of the runs, separated by '\0'
+  size_t chromLen, chromSize;
+  int nRun, maxRun;
+} DepthData;
+
+static void text_close(TextFile *tf){
+  if(tf->fp)
+    gzclose(tf->fp);
+  tf->fp = NULL;
+  Free(tf->buf);
+  Free(tf->line);
+  Free(tf->status);
+}
+
+static void depth_free(DepthData *dd){
+  int b;
+  for(b = 0; b < dd->nBlock; b++){
+    Free(dd->blockRef[b]);
+    Free(dd->blockAlt[b]);
+  }
+  Free(dd->blockRef);
+  Free(dd->blockAlt);
+  Free(dd->blockLen);
+  Free(dd->pos);
+  Free(dd->chromRun);
+  Free(dd->chrom);
+}
+
+static void text_open(TextFile *tf, const char *file){
+  memset(tf, 0, sizeof(TextFile));
+  tf->fp = gzopen(file, "rb");
+  if(tf->fp == NULL)
+    error("Unable to open the file '%s'", file);
+  gzbuffer(tf->fp, 1 << 17);
+  tf->size = READ_CHUNK;
+  tf->buf = Calloc(tf->size + 1, char);
+  tf->maxLine = 1024;
+  tf->line = Calloc(tf->maxLine, char *);
+  tf->status = Calloc(tf->maxLine, int);
+}
+
+// Read the next chunk of complete lines (with the '\n' or "\r\n" replaced by '\0') into tf->line.
+// Returns the number of lines, which is 0 at the end of the file.
+static int text_chunk(TextFile *tf){
+  char *p, *end, *nl;
+  int nRead;
+  tf->lineNo += tf->nLine;
+  tf->nLine = 0;
+  // Move the unused part of the buffer to the start and fill the rest. The buffer is doubled until
+  // it holds at least one complete line.
+  memmove(tf->buf, tf->buf + tf->pos, tf->len - tf->pos);
+  tf->len -= tf->pos;
+  tf->pos = 0;
+  while(!tf->eof){
+    while(!tf->eof && tf->len < tf->size){
+      // gzread takes the number of bytes as an unsigned int, but fails for more than INT_MAX
+      nRead = gzread(tf->fp, tf->buf + tf->len,
+                     (tf->size - tf->len > INT_MAX) ? INT_MAX : (unsigned int) (tf->size - tf->len));
+      if(nRead < 0)
+        return -1;
+      if(nRead == 0)
+        tf->eof = 1;
+      tf->len += nRead;
+    }
+    if(tf->eof || memchr(tf->buf, '\n', tf->len))
+      break;
+    tf->size *= 2;
+    tf->buf = Realloc(tf->buf, tf->size + 1, char);
+  }
+  // Find the lines
+  p = tf->buf;
+  end = tf->buf + tf->len;
+  while(p < end){
+    nl = memchr(p, '\n', end - p);
+    if(nl == NULL){
+      if(!tf->eof)
+        break;
+      nl = end;       // last line without '\n' (there is room for the '\0')
+    }
+    *nl = '\0';
+    if(nl > p && nl[-1] == '\r')
+      nl[-1] = '\0';
+    if(tf->nLine == tf->maxLine){
+      tf->maxLine *= 2;
+      tf->line = Realloc(tf->line, tf->maxLine, char *);
+      tf->status = Realloc(tf->status, tf->maxLine, int);
+    }
+    tf->line[tf->nLine++] = p;
+    p = nl + 1;
+  }
+  tf->pos = (p < end) ? (size_t) (p - tf->buf) : tf->len;
+  return tf->nLine;
+}
+
+// Start a block for the nNew SNPs of a chunk (and make room for their positions)
+static void depth_grow(DepthData *dd, int nNew){
+  size_t size = (size_t) dd->nSamp * nNew;
+  if(dd->nBlock == dd->maxBlock){
+    dd->maxBlock = 2 * dd->maxBlock + 16;
+    dd->blockRef = Realloc(dd->blockRef, dd->maxBlock, int *);
+    dd->blockAlt = Realloc(dd->blockAlt, dd->maxBlock, int *);
+    dd->blockLen = Realloc(dd->blockLen, dd->maxBlock, int);
+  }
+  dd->ref = dd->blockRef[dd->nBlock] = Calloc(size, int);
+  dd->alt = dd->blockAlt[dd->nBlock] = Calloc(size, int);
+  dd->blockLen[dd->nBlock++] = 0;
+  dd->blockStart = dd->nSnps;
+  if(dd->nSnps + nNew > dd->maxSnps){
+    dd->maxSnps = (dd->nSnps + nNew > 2 * dd->maxSnps) ? dd->nSnps + nNew : 2 * dd->maxSnps;
+    dd->pos = Realloc(dd->pos, dd->maxSnps, int);
+  }
+}
+
+// Trim the block of the current chunk to the SNPs that were kept (freeing it if there are none)
+static void depth_trim(DepthData *dd){
+  int b = dd->nBlock - 1, nKept = dd->nSnps - dd->blockStart;
+  if(nKept == 0){
+    Free(dd->blockRef[b]);
+    Free(dd->blockAlt[b]);
+    dd->nBlock--;
+  }
+  else{
+    dd->blockRef[b] = Realloc(dd->blockRef[b], (size_t) dd->nSamp * nKept, int);
+    dd->blockAlt[b] = Realloc(dd->blockAlt[b], (size_t) dd->nSamp * nKept, int);
+    dd->blockLen[b] = nKept;
+  }
+  dd->ref = dd->alt = NULL;
+}
+
+// Add SNP snp (which is at dd->nSnps or after it) on chromosome chrom (of length len) to the data
+static void depth_add(DepthData *dd, int snp, const char *chrom, size_t len, int pos){
+  size_t nSamp = dd->nSamp, from = snp - dd->blockStart, to = dd->nSnps - dd->blockStart;
+  if(snp != dd->nSnps){
+    memcpy(dd->ref + nSamp * to, dd->ref + nSamp * from, nSamp * sizeof(int));
+    memcpy(dd->alt + nSamp * to, dd->alt + nSamp * from, nSamp * sizeof(int));
+  }
+  dd->pos[dd->nSnps] = pos;
+  if(dd->nRun == 0 || strlen(dd->chrom + dd->chromLen) != len || strncmp(dd->chrom + dd->chromLen, chrom, len)){
+    if(dd->nRun > 0)
+      dd->chromLen += strlen(dd->chrom + dd->chromLen) + 1;
+    if(dd->chromLen + len + 1 > dd->chromSize){
+      dd->chromSize = 2 * (dd->chromLen + len + 1);
+      dd->chrom = Realloc(dd->chrom, dd->chromSize, char);
+    }
+    memcpy(dd->chrom + dd->chromLen, chrom, len);
+    dd->chrom[dd->chromLen + len] = '\0';
+    if(dd->nRun == dd->maxRun){
+      dd->maxRun = 2 * dd->maxRun + 16;
+      dd->chromRun = Realloc(dd->chromRun, dd->maxRun, int);
+    }
+    dd->chromRun[dd->nRun++] = dd->nSnps;
+  }
+  dd->nSnps++;
+}
+
+// Copy the rows with keep[i] TRUE (all if keep is NULL) of the blocks of read counts into the matrix
+// out (nKeep x nSnps), freeing each block once it is copied
+static void depth_copy(DepthData *dd, int **block, const int *keep, int nKeep, int *out){
+  int b, i, snp;
+  size_t nSamp = dd->nSamp;
+  for(b = 0; b < dd->nBlock; b++){
+    if(nKeep == dd->nSamp){
+      memcpy(out, block[b], nSamp * dd->blockLen[b] * sizeof(int));
+      out += nSamp * dd->blockLen[b];
+    }
+    else{
+      for(snp = 0; snp < dd->blockLen[b]; snp++)
+        for(i = 0; i < dd->nSamp; i++)
+          if(keep[i])
+            *out++ = block[b][i + nSamp * snp];
+    }
+    Free(block[b]);
+  }
+}
+
+// Return the data of the samples with keep[i] TRUE (all if keep is NULL) as list(depth_Ref,
+// depth_Alt, chrom, pos, sample IDs) and free them
+static SEXP depth_out(DepthData *dd, SEXP sampID, const int *keep){
+  int i, k, run, snp, end, nKeep = 0;
+  size_t off = 0;
+  SEXP pout = PROTECT(allocVector(VECSXP, 5));
+  for(i = 0; i < dd->nSamp; i++)
+    nKeep += (keep == NULL || keep[i]);
+  SET_VECTOR_ELT(pout, 0, allocMatrix(INTSXP, nKeep, dd->nSnps));
+  depth_copy(dd, dd->blockRef, keep, nKeep, INTEGER(VECTOR_ELT(pout, 0)));
+  SET_VECTOR_ELT(pout, 1, allocMatrix(INTSXP, nKeep, dd->nSnps));
+  depth_copy(dd, dd->blockAlt, keep, nKeep, INTEGER(VECTOR_ELT(pout, 1)));
+  SET_VECTOR_ELT(pout, 2, allocVector(STRSXP, dd->nSnps));
+  for(run = 0; run < dd->nRun; run++){
+    SEXP name = PROTECT(mkChar(dd->chrom + off));
+    end = (run + 1 < dd->nRun) ? dd->chromRun[run + 1] : dd->nSnps;
+    for(snp = dd->chromRun[run]; snp < end; snp++)
+      SET_STRING_ELT(VECTOR_ELT(pout, 2), snp, name);
+    off += strlen(dd->chrom + off) + 1;
+    UNPROTECT(1);
+  }
+  SET_VECTOR_ELT(pout, 3, allocVector(INTSXP, dd->nSnps));
+  if(dd->nSnps > 0)
+    memcpy(INTEGER(VECTOR_ELT(pout, 3)), dd->pos, dd->nSnps * sizeof(int));
+  SET_VECTOR_ELT(pout, 4, allocVector(STRSXP, nKeep));
+  for(i = 0, k = 0; i < dd->nSamp; i++)
+    if(keep == NULL || keep[i])
+      SET_STRING_ELT(VECTOR_ELT(pout, 4), k++, STRING_ELT(sampID, i));
+  depth_free(dd);
+  UNPROTECT(1);
+  return pout;
+}
+
+// Start of the field after the one at p (NULL if it is the last field)
+static char *next_field(char *p){
+  p = strchr(p, '\t');
+  return p ? p + 1 : NULL;
+}
+
+// Parse a read count at *p ('.' is 0 reads) and move p past it. Returns 0 if there is no count.
+static int parse_count(const char **p, int *val){
+  const char *s = *p;
+  long v = 0;
+  if(*s == '.'){
+    *val = 0;
+    *p = s + 1;
+    return 1;
+  }
+  if(*s < '0' || *s > '9')
+    return 0;
+  while(*s >= '0' && *s <= '9'){
+    v = 10 * v + (*s++ - '0');
+    if(v > INT_MAX)
+      return 0;
+  }
+  *val = (int) v;
+  *p = s;
+  return 1;
+}
+
+// Parse the position at *p (which must be followed by a tab) and move p past it
+static int parse_pos(char **p, int *pos){
+  char *s = *p;
+  long v = 0;
+  for(; *s >= '0' && *s <= '9' && v <= INT_MAX; s++)
+    v = 10 * v + (*s - '0');
+  if(s == *p || *s != '\t' || v > INT_MAX)
+    return 0;
+  *pos = (int) v;
+  *p = s;
+  return 1;
+}
+
+// TRUE if the field of length len at p is an empty genotype
+static int vcf_empty(const char *p, size_t len){
+  return (len == 1 && p[0] == '.') ||
+    (len == 3 && p[0] == '.' && p[2] == '.' && (p[1] == '/' || p[1] == ',' || p[1] == '|'));
+}
+
+// Length of the field or subfield at p
+static size_t field_len(const char *p){
+  size_t len = 0;
+  while(p[len] != '\0' && p[len] != '\t' && p[len] != ':')
+    len++;
+  return len;
+}
+
+
+//// VCF files
+
+// Positions of the allelic depth fields in the FORMAT field of a VCF line (-1 if absent)
+typedef struct {
+  int ad, ro, ao, dp4;
+} VCFformat;
+
+static void vcf_format(const char *p, VCFformat *fmt){
+  int k = 0;
+  size_t len;
+  fmt->ad = fmt->ro = fmt->ao = fmt->dp4 = -1;
+  while(1){
+    len = field_len(p);
+    if(len == 2 && !strncmp(p, "AD", 2)) fmt->ad = k;
+    else if(len == 2 && !strncmp(p, "RO", 2)) fmt->ro = k;
+    else if(len == 2 && !strncmp(p, "AO", 2)) fmt->ao = k;
+    else if(len == 3 && !strncmp(p, "DP4", 3)) fmt->dp4 = k;
+    if(p[len] != ':')
+      break;
+    p += len + 1;
+    k++;
+  }
+}
+
+// Subfield k of the sample field at p (NULL if the field has fewer subfields)
+static const char *vcf_subfield(const char *p, int k){
+  for(; k > 0; k--){
+    p += field_len(p);
+    if(*p != ':')
+      return NULL;
+    p++;
+  }
+  return p;
+}
+
+// Parse one line of a VCF file into the read counts ref and alt of its nSamp samples. The position
+// is returned in pos and the end of the chromosome name is set to '\0'.
+static int vcf_line(char *line, int nSamp, int *ref, int *alt, int *pos){
+  char *p = line, *refAllele, *altAllele;
+  const char *q, *s;
+  int i, k, f, c[4];
+  size_t len;
+  VCFformat fmt;
+  // CHROM and POS
+  if((p = next_field(p)) == NULL)
+    return LINE_SHORT;
+  p[-1] = '\0';
+  if(!parse_pos(&p, pos))
+    return LINE_POS;
+  // ID, REF and ALT: indels and multiple alternative alleles are removed
+  if((refAllele = next_field(p + 1)) == NULL || (altAllele = next_field(refAllele)) == NULL)
+    return LINE_SHORT;
+  if(refAllele[0] == '\t' || refAllele[1] != '\t' || altAllele[0] == '\t' || altAllele[1] != '\t' ||
+     refAllele[0] == '.' || altAllele[0] == '.')
+    return LINE_SKIP;
+  // QUAL, FILTER, INFO and FORMAT
+  p = altAllele;
+  for(k = 0; k < 4; k++)
+    if((p = next_field(p)) == NULL)
+      return LINE_SHORT;
+  vcf_format(p, &fmt);
+  if(fmt.ad < 0 && (fmt.ro < 0 || fmt.ao < 0) && fmt.dp4 < 0)
+    return LINE_FORMAT;
+  // Samples
+  for(i = 0; i < nSamp; i++){
+    if((p = next_field(p)) == NULL)
+      return LINE_SHORT;
+    ref[i] = alt[i] = 0;
+    len = field_len(p);
+    if(p[len] != ':' && vcf_empty(p, len))
+      continue;
+    if(fmt.ad >= 0){
+      if((q = vcf_subfield(p, fmt.ad)) == NULL || vcf_empty(q, field_len(q)))
+        continue;
+      if(!parse_count(&q, ref + i) || *q++ != ',' || !parse_count(&q, alt + i))
+        return LINE_DEPTH;
+    }
+    else if(fmt.ro >= 0 && fmt.ao >= 0){
+      if((q = vcf_subfield(p, fmt.ro)) == NULL || (s = vcf_subfield(p, fmt.ao)) == NULL)
+        continue;
+      if(!parse_count(&q, ref + i) || !parse_count(&s, alt + i))
+        return LINE_DEPTH;
+    }
+    else{
+      if((q = vcf_subfield(p, fmt.dp4)) == NULL || vcf_empty(q, field_len(q)))
+        continue;
+      for(f = 0; f < 4; f++)
+        if(!parse_count(&q, c + f) || (f < 3 && *q++ != ','))
+          return LINE_DEPTH;
+      if(c[0] > INT_MAX - c[1] || c[2] > INT_MAX - c[3])
+        return LINE_DEPTH;
+      ref[i] = c[0] + c[1];
+      alt[i] = c[2] + c[3];
+    }
+  }
+  return LINE_OK;
+}
+
+
+
+//// RA files
+
+// Parse one line of an RA file into the read counts ref and alt of its nSamp samples. The lines
+// start with CHROM and POS (reference) or the SNP name (uneak), of which the end is set to '\0',
+// and the read counts of a sample are given as ref,alt (reference) or ref|alt (uneak).
+static int ra_line(char *line, int format, int nSamp, int *ref, int *alt, int *pos){
+  char *p = line, sep = (format == FILE_RA) ? ',' : '|';
+  const char *q;
+  int i;
+  if((p = next_field(p)) == NULL)
+    return LINE_SHORT;
+  p[-1] = '\0';
+  if(format == FILE_RA){
+    if(!parse_pos(&p, pos))
+      return LINE_POS;
+    p++;
+  }
+  else
+    *pos = NA_INTEGER;
+  for(i = 0; i < nSamp; i++){
+    if(i > 0 && (p = next_field(p)) == NULL)
+      return LINE_SHORT;
+    q = p;
+    if(!parse_count(&q, ref + i) || *q++ != sep || !parse_count(&q, alt + i) || (*q != '\t' && *q != '\0'))
+      return LINE_DEPTH;
+  }
+  return LINE_OK;
+}
+
+
+//// Reading of the files
+
+// Find the samples to keep: those not in excsamp with a mean read depth (from their total depth
+// sumDepth over nSnps SNPs) of at least sampthres. Returns the number of samples with a low depth,
+// which have low[i] TRUE.
+static int depth_keep(SEXP sampID, const double *sumDepth, int nSnps, SEXP excsamp, double sampthres,
+                      int *keep, int *low){
+  int i, k, nLow = 0;
+  for(i = 0; i < LENGTH(sampID); i++){
+    low[i] = nSnps > 0 && sumDepth[i] / nSnps < sampthres;
+    nLow += low[i];
+    keep[i] = !low[i];
+    for(k = 0; k < LENGTH(excsamp) && keep[i]; k++)
+      if(!strcmp(CHAR(STRING_ELT(sampID, i)), CHAR(STRING_ELT(excsamp, k))))
+        keep[i] = 0;
+  }
+  return nLow;
+}
+
+// Add the IDs of the nLow samples with low[i] TRUE to the list returned by depth_out
+static SEXP depth_result(SEXP data, SEXP sampID, const int *low, int nLow){
+  int i, k;
+  SEXP pout = PROTECT(allocVector(VECSXP, 6));
+  for(k = 0; k < 5; k++)
+    SET_VECTOR_ELT(pout, k, VECTOR_ELT(data, k));
+  SET_VECTOR_ELT(pout, 5, allocVector(STRSXP, nLow));
+  for(i = 0, k = 0; k < nLow; i++)
+    if(low[i])
+      SET_STRING_ELT(VECTOR_ELT(pout, 5), k++, STRING_ELT(sampID, i));
+  UNPROTECT(1);
+  return pout;
+}
+
+// R_CheckUserInterrupt for R_ToplevelExec (see read_depth)
+static void check_interrupt(void *data){
+  R_CheckUserInterrupt();
+}
+
+// Read the allele counts of all the SNPs of a VCF or RA file (plain text or gzip compressed) into
+// samples x SNPs integer matrices. Returns list(depth_Ref, depth_Alt, chrom, pos, sample IDs, IDs of
+// the samples removed for their read depth). If filter is TRUE, the samples in excsamp or with a mean
+// read depth (over all the SNPs) below sampthres are removed. The depth of each sample is summed as
+// the lines are parsed, separately for each thread. A user interrupt is checked for after each chunk of lines.
+static SEXP read_depth(const char *file, int format, int nThreads, int filter, SEXP excsamp, double sampthres){
+  int nLine, i, k, first, skip, nSamp = -1, nLow = 0, *status, *keep = NULL, *low = NULL;
+  size_t nCell;
+  char *p, *line;
+  double *sums = NULL;
+  TextFile tf;
+  DepthData dd;
+  SEXP sampID = R_NilValue;
+  const char *fileType = (format == FILE_VCF) ? "VCF" : "RA";
+
+#ifdef _OPENMP
+  if(nThreads > omp_get_num_procs())
+    nThreads = omp_get_num_procs();
+#endif
+  if(nThreads < 1)
+    nThreads = 1;
+
+  memset(&dd, 0, sizeof(DepthData));
+  text_open(&tf, file);
+  while((nLine = text_chunk(&tf)) > 0){
+    // Meta-information and header lines (the header line is the first line of an RA file)
+    for(first = 0; first < nLine; first++){
+      line = tf.line[first];
+      if((format == FILE_VCF) ? line[0] != '#' : nSamp >= 0)
+        break;
+      if(format == FILE_VCF && strncmp(line, "#CHROM", 6))
+        continue;
+      for(k = 0, p = line; p; k++)
+        p = next_field(p);
+      skip = (format == FILE_VCF) ? 9 : (format == FILE_RA) ? 2 : 1;
+      nSamp = k - skip - ((format == FILE_UNEAK) ? 5 : 0);
+      if(nSamp < 1){
+        text_close(&tf);
+        error("The header line of the %s file has no samples", fileType);
+      }
+      if(sampID != R_NilValue)
+        UNPROTECT(1);
+      sampID = PROTECT(allocVector(STRSXP, nSamp));
+      for(k = 0, p = line; k < skip; k++)
+        p = next_field(p);
+      for(k = 0; k < nSamp; k++){
+        SET_STRING_ELT(sampID, k, mkCharLen(p, (int) strcspn(p, "\t")));
+        p = next_field(p);
+      }
+      dd.nSamp = nSamp;
+      if(filter){
+        Free(sums);
+        sums = Calloc((size_t) nThreads * nSamp, double);
+      }
+    }
+    if(first == nLine)
+      continue;
+    if(nSamp < 0){
+      text_close(&tf);
+      error("The VCF file has no header line (#CHROM ...) before the first SNP");
+    }
+    // Parse the SNPs of the chunk in parallel
+    nLine -= first;
+    depth_grow(&dd, nLine);
+    status = tf.status + first;
+    nCell = (size_t) nSamp;
+#ifdef _OPENMP
+    #pragma omp parallel num_threads(nThreads) private(k, i)
+#endif
+    {
+      int thread = 0;
+#ifdef _OPENMP
+      thread = omp_get_thread_num();
+      #pragma omp for schedule(dynamic, 64)
+#endif
+      for(k = 0; k < nLine; k++){
+        char *line_k = tf.line[first + k];
+        int *ref = dd.ref + nCell * k, *alt = dd.alt + nCell * k;
+        if(line_k[0] == '\0')
+          status[k] = LINE_SKIP;
+        else if(format == FILE_VCF)
+          status[k] = vcf_line(line_k, nSamp, ref, alt, dd.pos + dd.nSnps + k);
+        else
+          status[k] = ra_line(line_k, format, nSamp, ref, alt, dd.pos + dd.nSnps + k);
+        if(sums && status[k] == LINE_OK)
+          for(i = 0; i < nSamp; i++)
+            sums[i + nCell * thread] += (double) ref[i] + alt[i];
+      }
+    }
+    // Keep the SNPs in order
+    first = dd.nSnps;
+    for(k = 0; k < nLine; k++){
+      if(status[k] == LINE_SKIP)
+        continue;
+      if(status[k] != LINE_OK){
+        long lineNo = tf.lineNo + (tf.nLine - nLine) + k + 1;
+        const char *msg = lineError[status[k]];
+        text_close(&tf);
+        depth_free(&dd);
+        Free(sums);
+        error("Unable to read line %ld of the %s file: %s", lineNo, fileType, msg);
+      }
+      line = tf.line[tf.nLine - nLine + k];
+      depth_add(&dd, first + k, line, strlen(line), dd.pos[first + k]);
+    }
+    depth_trim(&dd);
+    // Check for a user interrupt once per chunk, without jumping past the buffers allocated with Calloc
+    if(!R_ToplevelExec(check_interrupt, NULL)){
+      text_close(&tf);
+      depth_free(&dd);
+      Free(sums);
+      error("Reading of the %s file interrupted", fileType);
+    }
+  }
+  text_close(&tf);
+  if(nLine < 0){
+    depth_free(&dd);
+    Free(sums);
+    error("Unable to read the file '%s'", file);
+  }
+  if(nSamp < 0){
+    depth_free(&dd);
+    error("The %s file has no header line", fileType);
+  }
+  // Mean depth of the samples and the samples to keep
+  if(filter){
+    keep = (int *) R_alloc(nSamp, sizeof(int));
+    low = (int *) R_alloc(nSamp, sizeof(int));
+    for(k = 1; k < nThreads; k++)
+      for(i = 0; i < nSamp; i++)
+        sums[i] += sums[i + (size_t) nSamp * k];
+    nLow = depth_keep(sampID, sums, dd.nSnps, excsamp, sampthres, keep, low);
+    Free(sums);
+  }
+  SEXP pout = depth_result(PROTECT(depth_out(&dd, sampID, keep)), sampID, low, nLow);
+  UNPROTECT(2);
+  return pout;
+}
+
+//// Binary cache of the read counts
+// The data read from a file are cached in a versioned binary file, which is loaded by mapping it
+// into memory. The file consists of a header (CacheHeader) followed by the sections
+//   normalised path of the source file, sample IDs and chromosome names ('\0' terminated strings), first SNP of each run of SNPs on
+//   the same chromosome (uint32), positions (int32), reference and alternate read counts (uint16,
+//   samples x SNPs as in R) and the overflow cells (CacheOver),
+// each starting at a multiple of 8 bytes. Read counts above 65534 are stored as 65535 and given in
+// the overflow cells (in the order of the cells). The path, size and modification time of the source
+// file are kept, so that a cache of another file or which is out of date is not used. The cache is
+// written to a temporary file in the same directory, which is then renamed, so that a process loading
+// the cache never sees a partly written file.
+
+#define CACHE_MAGIC "GUSMAPDC"
+#define CACHE_VERSION 2
+#define CACHE_ENDIAN 0x01020304
+#define CACHE_MAX 65535
+
+typedef struct {
+  char magic[8];
+  uint32_t version, endian, format, nInd, nSnps, nRun;
+  uint64_t nOver, srcLen, idLen, chromLen;
+  double srcSize, srcTime;
+} CacheHeader;
+
+typedef struct {
+  uint64_t cell;
+  int32_t ref, alt;
+} CacheOver;
+
+// Offsets of the sections of a cache file
+typedef struct {
+  size_t src, id, chrom, run, pos, ref, alt, over, size;
+} CacheLayout;
+
+static size_t align8(size_t x){
+  return (x + 7) & ~((size_t) 7);
+}
+
+static void cache_layout(const CacheHeader *h, CacheLayout *l){
+  size_t nCell = (size_t) h->nInd * h->nSnps;
+  l->src = align8(sizeof(CacheHeader));
+  l->id = align8(l->src + h->srcLen);
+  l->chrom = align8(l->id + h->idLen);
+  l->run = align8(l->chrom + h->chromLen);
+  l->pos = align8(l->run + (size_t) h->nRun * sizeof(uint32_t));
+  l->ref = align8(l->pos + (size_t) h->nSnps * sizeof(int32_t));
+  l->alt = align8(l->ref + nCell * sizeof(uint16_t));
+  l->over = align8(l->alt + nCell * sizeof(uint16_t));
+  l->size = l->over + h->nOver * sizeof(CacheOver);
+}
+
+// Write the zeros following a section of n bytes
+static int cache_pad(FILE *fp, size_t n){
+  static const char zero[8] = {0};
+  return fwrite(zero, 1, align8(n) - n, fp) == align8(n) - n;
+}
+
+// Write n bytes of x followed by zeros up to a multiple of 8 bytes
+static int cache_put(FILE *fp, const void *x, size_t n){
+  return fwrite(x, 1, n, fp) == n && cache_pad(fp, n);
+}
+
+// Open a new temporary file in the directory of file, of which the name is stored in tmp (of length
+// strlen(file) + 16)
+static FILE *cache_temp(const char *file, char *tmp){
+#ifndef _WIN32
+  int fd;
+  FILE *fp;
+  sprintf(tmp, "%s.tmpXXXXXX", file);
+  if((fd = mkstemp(tmp)) < 0)
+    return NULL;
+  fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if((fp = fdopen(fd, "wb")) == NULL){
+    close(fd);
+    remove(tmp);
+  }
+  return fp;
+#else
+  sprintf(tmp, "%s.tmp%d", file, (int) _getpid());
+  return fopen(tmp, "wb");
+#endif
+}
+
+// Write the data (list(depth_Ref, depth_Alt, chrom, pos, sample IDs) as returned by read_depth) of the
+// file srcFile (normalised path), of the given format and of which the size and modification time
+// are src, to the cache file
+SEXP write_cache(SEXP file, SEXP data, SEXP format, SEXP srcFile, SEXP src){
+  int i, snp, ok;
+  size_t cell, nCell, len, k;
+  SEXP ref = VECTOR_ELT(data, 0), alt = VECTOR_ELT(data, 1), chrom = VECTOR_ELT(data, 2);
+  SEXP pos = VECTOR_ELT(data, 3), sampID = VECTOR_ELT(data, 4);
+  CacheHeader h;
+  CacheOver *over;
+  uint16_t *col;
+  uint32_t *run;
+  char *str, *tmp;
+  const char *name = CHAR(STRING_ELT(file, 0)), *srcName = CHAR(STRING_ELT(srcFile, 0));
+  FILE *fp;
+
+  memset(&h, 0, sizeof(CacheHeader));
+  memcpy(h.magic, CACHE_MAGIC, 8);
+  h.version = CACHE_VERSION;
+  h.endian = CACHE_ENDIAN;
+  h.format = INTEGER(format)[0];
+  h.nInd = LENGTH(sampID);
+  h.nSnps = LENGTH(pos);
+  h.srcLen = strlen(srcName) + 1;
+  h.srcSize = REAL(src)[0];
+  h.srcTime = REAL(src)[1];
+  nCell = (size_t) h.nInd * h.nSnps;
+  // Sample IDs, chromosome runs and overflow cells
+  for(i = 0; i < (int) h.nInd; i++)
+    h.idLen += strlen(CHAR(STRING_ELT(sampID, i))) + 1;
+  run = (uint32_t *) R_alloc(h.nSnps + 1, sizeof(uint32_t));
+  for(snp = 0; snp < (int) h.nSnps; snp++){
+    if(snp == 0 || strcmp(CHAR(STRING_ELT(chrom, snp)), CHAR(STRING_ELT(chrom, snp - 1)))){
+      run[h.nRun++] = snp;
+      h.chromLen += strlen(CHAR(STRING_ELT(chrom, snp))) + 1;
+    }
+  }
+  for(cell = 0; cell < nCell; cell++)
+    h.nOver += (INTEGER(ref)[cell] >= CACHE_MAX || INTEGER(alt)[cell] >= CACHE_MAX);
+  str = R_alloc(h.idLen + h.chromLen + 1, sizeof(char));
+  for(i = 0, len = 0; i < (int) h.nInd; i++){
+    strcpy(str + len, CHAR(STRING_ELT(sampID, i)));
+    len += strlen(str + len) + 1;
+  }
+  for(k = 0; k < h.nRun; k++){
+    strcpy(str + len, CHAR(STRING_ELT(chrom, run[k])));
+    len += strlen(str + len) + 1;
+  }
+  over = (CacheOver *) R_alloc(h.nOver + 1, sizeof(CacheOver));
+  for(cell = 0, k = 0; cell < nCell; cell++){
+    if(INTEGER(ref)[cell] >= CACHE_MAX || INTEGER(alt)[cell] >= CACHE_MAX){
+      over[k].cell = cell;
+      over[k].ref = INTEGER(ref)[cell];
+      over[k++].alt = INTEGER(alt)[cell];
+    }
+  }
+  // Write the temporary file
+  tmp = R_alloc(strlen(name) + 16, sizeof(char));
+  fp = cache_temp(name, tmp);
+  if(fp == NULL)
+    error("Unable to create the cache file '%s'", name);
+  ok = cache_put(fp, &h, sizeof(CacheHeader)) && cache_put(fp, srcName, h.srcLen) && cache_put(fp, str, h.idLen) &&
+    cache_put(fp, str + h.idLen, h.chromLen) && cache_put(fp, run, h.nRun * sizeof(uint32_t)) &&
+    cache_put(fp, INTEGER(pos), h.nSnps * sizeof(int32_t));
+  col = (uint16_t *) R_alloc(h.nInd + 1, sizeof(uint16_t));
+  for(k = 0; k < 2 && ok; k++){
+    const int *x = INTEGER(k == 0 ? ref : alt);
+    for(snp = 0; snp < (int) h.nSnps && ok; snp++){
+      for(i = 0; i < (int) h.nInd; i++){
+        cell = i + (size_t) h.nInd * snp;
+        col[i] = (x[cell] >= CACHE_MAX) ? CACHE_MAX : (uint16_t) x[cell];
+      }
+      ok = fwrite(col, sizeof(uint16_t), h.nInd, fp) == h.nInd;
+    }
+    ok = ok && cache_pad(fp, nCell * sizeof(uint16_t));
+  }
+  ok = ok && fwrite(over, sizeof(CacheOver), h.nOver, fp) == h.nOver;
+  if(fclose(fp) != 0 || !ok){
+    remove(tmp);
+    error("Unable to write the cache file '%s'", name);
+  }
+  // Replace the cache file (rename does not replace an existing file on Windows)
+#ifdef _WIN32
+  remove(name);
+#endif
+  if(rename(tmp, name) != 0){
+    remove(tmp);
+    error("Unable to write the cache file '%s'", name);
+  }
+  return R_NilValue;
+}
+
+// Memory map of a cache file (read into memory where mmap is not available)
+typedef struct {
+  char *addr;
+  size_t size;
+} CacheMap;
+
+static int cache_map(const char *file, CacheMap *m){
+  m->addr = NULL;
+  m->size = 0;
+#ifndef _WIN32
+  struct stat st;
+  int fd = open(file, O_RDONLY);
+  if(fd < 0)
+    return 0;
+  if(fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(CacheHeader)){
+    close(fd);
+    return 0;
+  }
+  m->size = st.st_size;
+  m->addr = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(m->addr == MAP_FAILED){
+    m->addr = NULL;
+    return 0;
+  }
+#else
+  FILE *fp = fopen(file, "rb");
+  long size;
+  if(fp == NULL)
+    return 0;
+  if(fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < (long) sizeof(CacheHeader) || fseek(fp, 0, SEEK_SET) != 0){
+    fclose(fp);
+    return 0;
+  }
+  m->size = size;
+  m->addr = Calloc(m->size, char);
+  if(fread(m->addr, 1, m->size, fp) != m->size){
+    fclose(fp);
+    Free(m->addr);
+    return 0;
+  }
+  fclose(fp);
+#endif
+  return 1;
+}
+
+static void cache_unmap(CacheMap *m){
+  if(m->addr == NULL)
+    return;
+#ifndef _WIN32
+  munmap(m->addr, m->size);
+  m->addr = NULL;
+#else
+  Free(m->addr);
+#endif
+}
+
+// TRUE if the n bytes at p hold (at least) nStr '\0' terminated strings
+static int cache_strings(const char *p, size_t n, size_t nStr){
+  size_t k, found = 0;
+  for(k = 0; k < n && found < nStr; k++)
+    found += (p[k] == '\0');
+  return found == nStr;
+}
+
+// TRUE if the mapped file is a valid cache of the current version for the source file srcFile, of
+// which the size and modification time are src
+static int cache_valid(const CacheMap *m, int format, const char *srcFile, const double *src, CacheLayout *l){
+  const CacheHeader *h = (const CacheHeader *) m->addr;
+  const uint32_t *run;
+  const CacheOver *over;
+  size_t k, nCell;
+  if(memcmp(h->magic, CACHE_MAGIC, 8) || h->version != CACHE_VERSION || h->endian != CACHE_ENDIAN ||
+     (int) h->format != format || h->srcSize != src[0] || h->srcTime != src[1] || h->nInd == 0 ||
+     h->nInd > INT_MAX || h->nSnps > INT_MAX || h->nRun > h->nSnps || (h->nRun == 0 && h->nSnps > 0))
+    return 0;
+  cache_layout(h, l);
+  if(l->size != m->size || h->srcLen != strlen(srcFile) + 1 || memcmp(m->addr + l->src, srcFile, h->srcLen) ||
+     !cache_strings(m->addr + l->id, h->idLen, h->nInd) ||
+     !cache_strings(m->addr + l->chrom, h->chromLen, h->nRun))
+    return 0;
+  run = (const uint32_t *) (m->addr + l->run);
+  for(k = 0; k < h->nRun; k++)
+    if((k == 0) ? run[k] != 0 : (run[k] <= run[k - 1] || run[k] >= h->nSnps))
+      return 0;
+  nCell = (size_t) h->nInd * h->nSnps;
+  over = (const CacheOver *) (m->addr + l->over);
+  for(k = 0; k < h->nOver; k++)
+    if(over[k].cell >= nCell || (k > 0 && over[k].cell <= over[k - 1].cell) || over[k].ref < 0 || over[k].alt < 0)
+      return 0;
+  return 1;
+}
+
+// Load the data of a cache file written by write_cache, without the samples in excsamp or with a
+// mean depth below sampthres. Returns the data as read_depth, or NULL if the file does not exist,
+// is not a valid cache of the current version or is not up to date with the source file srcFile
+// (normalised path) of the given format, of which the size and modification time are src. The read counts are decoded from the mapped file straight into the R
+// matrices, in parallel over the SNPs.
+SEXP read_cache(SEXP file, SEXP format, SEXP srcFile, SEXP src, SEXP excsamp, SEXP sampthres, SEXP nThreads){
+  int i, k, snp, nKeep, nLow, nThreads_c = INTEGER(nThreads)[0], *keep, *low, *row;
+  size_t off;
+  double *sums;
+  CacheMap m;
+  CacheLayout l;
+  const CacheHeader *h;
+  const uint16_t *ref, *alt;
+  const uint32_t *run;
+  const CacheOver *over;
+  const char *str;
+
+#ifdef _OPENMP
+  if(nThreads_c > omp_get_num_procs())
+    nThreads_c = omp_get_num_procs();
+#endif
+  if(nThreads_c < 1)
+    nThreads_c = 1;
+
+  if(!cache_map(CHAR(STRING_ELT(file, 0)), &m))
+    return R_NilValue;
+  if(!cache_valid(&m, INTEGER(format)[0], CHAR(STRING_ELT(srcFile, 0)), REAL(src), &l)){
+    cache_unmap(&m);
+    return R_NilValue;
+  }
+  h = (const CacheHeader *) m.addr;
+  ref = (const uint16_t *) (m.addr + l.ref);
+  alt = (const uint16_t *) (m.addr + l.alt);
+  run = (const uint32_t *) (m.addr + l.run);
+  over = (const CacheOver *) (m.addr + l.over);
+
+  // Sample IDs and the samples to keep
+  SEXP sampID = PROTECT(allocVector(STRSXP, h->nInd));
+  for(i = 0, str = m.addr + l.id; i < (int) h->nInd; i++){
+    SET_STRING_ELT(sampID, i, mkChar(str));
+    str += strlen(str) + 1;
+  }
+  sums = (double *) R_alloc(h->nInd, sizeof(double));
+  memset(sums, 0, h->nInd * sizeof(double));
+  for(snp = 0; snp < (int) h->nSnps; snp++)
+    for(i = 0, off = (size_t) h->nInd * snp; i < (int) h->nInd; i++)
+      sums[i] += (double) ref[off + i] + alt[off + i];
+  for(k = 0; k < (int) h->nOver; k++)
+    sums[over[k].cell % h->nInd] += (double) over[k].ref - ref[over[k].cell] + over[k].alt - alt[over[k].cell];
+  keep = (int *) R_alloc(h->nInd, sizeof(int));
+  low = (int *) R_alloc(h->nInd, sizeof(int));
+  row = (int *) R_alloc(h->nInd, sizeof(int));
+  nLow = depth_keep(sampID, sums, h->nSnps, excsamp, REAL(sampthres)[0], keep, low);
+  for(i = 0, nKeep = 0; i < (int) h->nInd; i++)
+    row[i] = keep[i] ? nKeep++ : -1;
+
+  // Read counts, chromosomes, positions and IDs of the samples kept
+  SEXP data = PROTECT(allocVector(VECSXP, 5));
+  SET_VECTOR_ELT(data, 0, allocMatrix(INTSXP, nKeep, h->nSnps));
+  SET_VECTOR_ELT(data, 1, allocMatrix(INTSXP, nKeep, h->nSnps));
+  int *ref_out = INTEGER(VECTOR_ELT(data, 0)), *alt_out = INTEGER(VECTOR_ELT(data, 1));
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(nThreads_c) private(i) schedule(static)
+#endif
+  for(snp = 0; snp < (int) h->nSnps; snp++){
+    size_t from = (size_t) h->nInd * snp, to = (size_t) nKeep * snp;
+    for(i = 0; i < (int) h->nInd; i++){
+      if(row[i] >= 0){
+        ref_out[to + row[i]] = ref[from + i];
+        alt_out[to + row[i]] = alt[from + i];
+      }
+    }
+  }
+  for(k = 0; k < (int) h->nOver; k++){
+    i = over[k].cell % h->nInd;
+    if(row[i] >= 0){
+      ref_out[row[i] + (size_t) nKeep * (over[k].cell / h->nInd)] = over[k].ref;
+      alt_out[row[i] + (size_t) nKeep * (over[k].cell / h->nInd)] = over[k].alt;
+    }
+  }
+  SET_VECTOR_ELT(data, 2, allocVector(STRSXP, h->nSnps));
+  for(k = 0, str = m.addr + l.chrom; k < (int) h->nRun; k++){
+    SEXP name = PROTECT(mkChar(str));
+    for(snp = run[k]; snp < ((k + 1 < (int) h->nRun) ? (int) run[k + 1] : (int) h->nSnps); snp++)
+      SET_STRING_ELT(VECTOR_ELT(data, 2), snp, name);
+    str += strlen(str) + 1;
+    UNPROTECT(1);
+  }
+  SET_VECTOR_ELT(data, 3, allocVector(INTSXP, h->nSnps));
+  if(h->nSnps > 0)
+    memcpy(INTEGER(VECTOR_ELT(data, 3)), m.addr + l.pos, h->nSnps * sizeof(int32_t));
+  SET_VECTOR_ELT(data, 4, allocVector(STRSXP, nKeep));
+  for(i = 0; i < (int) h->nInd; i++)
+    if(row[i] >= 0)
+      SET_STRING_ELT(VECTOR_ELT(data, 4), row[i], STRING_ELT(sampID, i));
+  cache_unmap(&m);
+  SEXP pout = depth_result(data, sampID, low, nLow);
+  UNPROTECT(2);
+  return pout;
+}
+
+
+//// R interface
+
+// Read the allele counts of all the SNPs of a VCF file (the last element of the list is empty)
+SEXP read_vcf(SEXP file, SEXP nThreads){
+  return read_depth(CHAR(STRING_ELT(file, 0)), FILE_VCF, INTEGER(nThreads)[0], 0, R_NilValue, 0);
+}
+
+// Read the allele counts of all the SNPs of an RA file in the reference (format = 1) or uneak
+// (format = 2) layout, without the samples in excsamp or with a mean depth below sampthres
+SEXP read_ra(SEXP file, SEXP format, SEXP excsamp, SEXP sampthres, SEXP nThreads){
+  return read_depth(CHAR(STRING_ELT(file, 0)), (INTEGER(format)[0] == 1) ? FILE_RA : FILE_UNEAK,
+                    INTEGER(nThreads)[0], 1, excsamp, REAL(sampthres)[0]);
+}